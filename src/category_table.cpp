@@ -0,0 +1,74 @@
+#include "category_table.h"
+
+using namespace std;
+using apache::thrift::concurrency::RWGuard;
+
+CategoryTable g_categoryTable;
+
+static const string counter_names[CategoryTable::NUM_COUNTERS] = {
+  "received good",
+  "received bad",
+  "committed",
+  "requeue",
+  "lost",
+  "denied for rate"
+};
+
+CategoryTable::CategoryTable()
+  : numCategories(0) {
+  for (int i = 0; i < MAX_CHUNKS; ++i) {
+    chunks[i] = NULL;
+  }
+  lock = scribe::concurrency::createReadWriteMutex();
+}
+
+CategoryTable::~CategoryTable() {
+  for (int i = 0; i < MAX_CHUNKS; ++i) {
+    delete[] chunks[i];
+  }
+}
+
+const string& CategoryTable::counterName(counter_t counter) {
+  return counter_names[counter];
+}
+
+category_id_t CategoryTable::find(const string& category) const {
+  RWGuard guard(*lock);
+  id_map_t::const_iterator iter = ids.find(category);
+  return iter == ids.end() ? NO_CATEGORY_ID : iter->second;
+}
+
+category_id_t CategoryTable::intern(const string& category) {
+  category_id_t id = find(category);
+  if (id != NO_CATEGORY_ID) {
+    return id;
+  }
+
+  RWGuard guard(*lock, true);
+  id_map_t::const_iterator iter = ids.find(category);
+  if (iter != ids.end()) {
+    return iter->second;
+  }
+
+  id = numCategories;
+  if (id / CHUNK_SIZE >= MAX_CHUNKS) {
+    LOG_OPER("[%s] category table is full, not interning category",
+             category.c_str());
+    return NO_CATEGORY_ID;
+  }
+  if (chunks[id / CHUNK_SIZE] == NULL) {
+    chunks[id / CHUNK_SIZE] = new Category[CHUNK_SIZE];
+  }
+
+  Category& entry = chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+  entry.id = id;
+  entry.name = category;
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    entry.counterNames[i] = category + ":" + counter_names[i];
+  }
+  ids[category] = id;
+
+  // publish the fully built entry to lock-free readers of size()
+  __atomic_store_n(&numCategories, id + 1, __ATOMIC_RELEASE);
+  return id;
+}
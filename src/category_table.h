@@ -0,0 +1,84 @@
+#ifndef SCRIBE_CATEGORY_TABLE_H
+#define SCRIBE_CATEGORY_TABLE_H
+
+#include "common.h"
+
+#include <boost/unordered_map.hpp>
+
+typedef unsigned long category_id_t;
+#define NO_CATEGORY_ID ((category_id_t)-1)
+
+/*
+ * Process-wide table of interned category names.
+ *
+ * Every category that gets a store is given a small integer id that never
+ * changes or gets reused for the life of the process. The id can be used
+ * to index per-category arrays instead of hashing or comparing the
+ * category string, and to get at the fb303 counter names for the category
+ * without building "<category>:<counter>" strings for every update.
+ *
+ * Looking up a name takes a read lock; looking up an id takes no lock.
+ * Log() finds ids in its CategoryRoutes snapshot instead of by name here.
+ */
+class CategoryTable {
+ public:
+  // per-category counters whose full names are built once per category
+  enum counter_t {
+    RECEIVED_GOOD,
+    RECEIVED_BAD,
+    COMMITTED,
+    REQUEUE,
+    LOST,
+    DENIED_FOR_RATE,
+    NUM_COUNTERS
+  };
+
+  struct Category {
+    category_id_t id;
+    std::string name;
+    std::string counterNames[NUM_COUNTERS];  // "<name>:<counter>"
+  };
+
+  CategoryTable();
+  ~CategoryTable();
+
+  // returns the id of category, adding it if it has not been seen yet
+  category_id_t intern(const std::string& category);
+  // returns NO_CATEGORY_ID if category has never been interned
+  category_id_t find(const std::string& category) const;
+
+  // id must have been returned by intern()
+  inline const Category& get(category_id_t id) const {
+    return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+  }
+
+  // number of ids handed out so far, all ids are below this
+  inline category_id_t size() const {
+    return __atomic_load_n(&numCategories, __ATOMIC_ACQUIRE);
+  }
+
+  static const std::string& counterName(counter_t counter);
+
+ private:
+  // Categories live in fixed-size chunks that are never moved, so get()
+  // can run concurrently with intern() adding new ones.
+  enum {
+    CHUNK_SIZE = 1024,
+    MAX_CHUNKS = 4096
+  };
+
+  typedef boost::unordered_map<std::string, category_id_t> id_map_t;
+
+  id_map_t ids;
+  Category* chunks[MAX_CHUNKS];
+  category_id_t numCategories;
+  boost::shared_ptr<apache::thrift::concurrency::ReadWriteMutex> lock;
+
+  // disallow copy and assignment
+  CategoryTable(const CategoryTable& rhs);
+  CategoryTable& operator=(const CategoryTable& rhs);
+};
+
+extern CategoryTable g_categoryTable;
+
+#endif // !defined SCRIBE_CATEGORY_TABLE_H
@@ -0,0 +1,797 @@
+#include "compressed_file.h"
+#include "compression_pool.h"
+
+#include <limits.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#define UINT_SIZE 4
+#define CHUNK_SIZE (64 * 1024)
+
+using namespace std;
+using boost::shared_ptr;
+
+/*
+ * gzip, through zlib
+ */
+class GzipCompressor : public Compressor {
+ public:
+  explicit GzipCompressor(int level) {
+    memset(&stream, 0, sizeof(stream));
+    // 16 asks for a gzip header and trailer instead of zlib's
+    if (deflateInit2(&stream, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                     Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw std::runtime_error("failed to initialize gzip compression");
+    }
+  }
+
+  ~GzipCompressor() {
+    deflateEnd(&stream);
+  }
+
+  bool compress(const char* data, size_t length, string& out) {
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = length;
+    return deflateAll(Z_NO_FLUSH, out);
+  }
+
+  bool flush(string& out) {
+    return deflateAll(Z_SYNC_FLUSH, out);
+  }
+
+  bool finish(string& out) {
+    return deflateAll(Z_FINISH, out);
+  }
+
+ private:
+  bool deflateAll(int mode, string& out) {
+    char buffer[CHUNK_SIZE];
+    int result;
+    do {
+      stream.next_out = (Bytef*)buffer;
+      stream.avail_out = CHUNK_SIZE;
+      result = deflate(&stream, mode);
+      if (result == Z_STREAM_ERROR) {
+        return false;
+      }
+      out.append(buffer, CHUNK_SIZE - stream.avail_out);
+    } while (stream.avail_out == 0 ||
+             (mode == Z_FINISH && result != Z_STREAM_END));
+    return true;
+  }
+
+  z_stream stream;
+};
+
+class GzipDecompressor : public Decompressor {
+ public:
+  GzipDecompressor() : inStream(false) {
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+      throw std::runtime_error("failed to initialize gzip decompression");
+    }
+  }
+
+  ~GzipDecompressor() {
+    inflateEnd(&stream);
+  }
+
+  bool decompress(const char* data, size_t length, string& out) {
+    char buffer[CHUNK_SIZE];
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = length;
+
+    // a full buffer may mean there is more output waiting
+    do {
+      stream.next_out = (Bytef*)buffer;
+      stream.avail_out = CHUNK_SIZE;
+      int result = inflate(&stream, Z_NO_FLUSH);
+      out.append(buffer, CHUNK_SIZE - stream.avail_out);
+
+      if (result == Z_STREAM_END) {
+        // another member may follow
+        inStream = false;
+        inflateReset(&stream);
+      } else if (result == Z_OK) {
+        inStream = true;
+      } else if (result != Z_BUF_ERROR) {
+        return false;
+      }
+    } while (stream.avail_in > 0 || stream.avail_out == 0);
+    return true;
+  }
+
+  bool incomplete() {
+    return inStream;
+  }
+
+ private:
+  z_stream stream;
+  bool inStream;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdCompressor : public Compressor {
+ public:
+  explicit ZstdCompressor(int level)
+    : context(ZSTD_createCCtx()) {
+    if (context == NULL) {
+      throw std::runtime_error("failed to initialize zstd compression");
+    }
+    ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel,
+                           level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+  }
+
+  ~ZstdCompressor() {
+    ZSTD_freeCCtx(context);
+  }
+
+  bool compress(const char* data, size_t length, string& out) {
+    return compressAll(data, length, ZSTD_e_continue, out);
+  }
+
+  bool flush(string& out) {
+    return compressAll(NULL, 0, ZSTD_e_flush, out);
+  }
+
+  bool finish(string& out) {
+    return compressAll(NULL, 0, ZSTD_e_end, out);
+  }
+
+ private:
+  bool compressAll(const char* data, size_t length, ZSTD_EndDirective mode,
+                   string& out) {
+    char buffer[CHUNK_SIZE];
+    ZSTD_inBuffer input = { data, length, 0 };
+    size_t remaining;
+    do {
+      ZSTD_outBuffer output = { buffer, CHUNK_SIZE, 0 };
+      remaining = ZSTD_compressStream2(context, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        return false;
+      }
+      out.append(buffer, output.pos);
+    } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+    return true;
+  }
+
+  ZSTD_CCtx* context;
+};
+
+class ZstdDecompressor : public Decompressor {
+ public:
+  ZstdDecompressor()
+    : context(ZSTD_createDCtx()),
+      inFrame(false) {
+    if (context == NULL) {
+      throw std::runtime_error("failed to initialize zstd decompression");
+    }
+  }
+
+  ~ZstdDecompressor() {
+    ZSTD_freeDCtx(context);
+  }
+
+  bool decompress(const char* data, size_t length, string& out) {
+    char buffer[CHUNK_SIZE];
+    ZSTD_inBuffer input = { data, length, 0 };
+    ZSTD_outBuffer output;
+    // a full buffer may mean there is more output waiting
+    do {
+      output.dst = buffer;
+      output.size = CHUNK_SIZE;
+      output.pos = 0;
+      size_t result = ZSTD_decompressStream(context, &output, &input);
+      if (ZSTD_isError(result)) {
+        return false;
+      }
+      out.append(buffer, output.pos);
+      // 0 means a frame just ended
+      inFrame = (result != 0);
+    } while (input.pos < input.size || output.pos == output.size);
+    return true;
+  }
+
+  bool incomplete() {
+    return inFrame;
+  }
+
+ private:
+  ZSTD_DCtx* context;
+  bool inFrame;
+};
+#endif // HAVE_ZSTD
+
+#ifdef HAVE_LZ4
+class Lz4Compressor : public Compressor {
+ public:
+  explicit Lz4Compressor(int level)
+    : started(false) {
+    if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION))) {
+      throw std::runtime_error("failed to initialize lz4 compression");
+    }
+    memset(&preferences, 0, sizeof(preferences));
+    preferences.compressionLevel = level < 0 ? 0 : level;
+    preferences.frameInfo.blockMode = LZ4F_blockLinked;
+  }
+
+  ~Lz4Compressor() {
+    LZ4F_freeCompressionContext(context);
+  }
+
+  bool compress(const char* data, size_t length, string& out) {
+    if (!start(out)) {
+      return false;
+    }
+    // one call per chunk keeps the output buffer bounded
+    while (length > 0) {
+      size_t chunk = min(length, (size_t)CHUNK_SIZE);
+      size_t size = out.size();
+      out.resize(size + LZ4F_compressBound(chunk, &preferences));
+      size_t result = LZ4F_compressUpdate(context, &out[size], out.size() - size,
+                                          data, chunk, NULL);
+      if (LZ4F_isError(result)) {
+        out.resize(size);
+        return false;
+      }
+      out.resize(size + result);
+      data += chunk;
+      length -= chunk;
+    }
+    return true;
+  }
+
+  bool flush(string& out) {
+    return start(out) && end(out, false);
+  }
+
+  bool finish(string& out) {
+    return start(out) && end(out, true);
+  }
+
+ private:
+  bool start(string& out) {
+    if (started) {
+      return true;
+    }
+    char header[LZ4F_HEADER_SIZE_MAX];
+    size_t result = LZ4F_compressBegin(context, header, sizeof(header),
+                                       &preferences);
+    if (LZ4F_isError(result)) {
+      return false;
+    }
+    out.append(header, result);
+    started = true;
+    return true;
+  }
+
+  bool end(string& out, bool finish) {
+    size_t size = out.size();
+    out.resize(size + LZ4F_compressBound(0, &preferences));
+    size_t result = finish ?
+      LZ4F_compressEnd(context, &out[size], out.size() - size, NULL) :
+      LZ4F_flush(context, &out[size], out.size() - size, NULL);
+    if (LZ4F_isError(result)) {
+      out.resize(size);
+      return false;
+    }
+    out.resize(size + result);
+    if (finish) {
+      started = false;
+    }
+    return true;
+  }
+
+  LZ4F_cctx* context;
+  LZ4F_preferences_t preferences;
+  bool started;
+};
+
+class Lz4Decompressor : public Decompressor {
+ public:
+  Lz4Decompressor()
+    : inFrame(false) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION))) {
+      throw std::runtime_error("failed to initialize lz4 decompression");
+    }
+  }
+
+  ~Lz4Decompressor() {
+    LZ4F_freeDecompressionContext(context);
+  }
+
+  bool decompress(const char* data, size_t length, string& out) {
+    char buffer[CHUNK_SIZE];
+    size_t out_size;
+    // a full buffer may mean there is more output waiting
+    do {
+      out_size = CHUNK_SIZE;
+      size_t in_size = length;
+      size_t result = LZ4F_decompress(context, buffer, &out_size,
+                                      data, &in_size, NULL);
+      if (LZ4F_isError(result)) {
+        return false;
+      }
+      out.append(buffer, out_size);
+      data += in_size;
+      length -= in_size;
+      // 0 means a frame just ended, the next one starts over
+      inFrame = (result != 0);
+    } while (length > 0 || out_size == CHUNK_SIZE);
+    return true;
+  }
+
+  bool incomplete() {
+    return inFrame;
+  }
+
+ private:
+  LZ4F_dctx* context;
+  bool inFrame;
+};
+#endif // HAVE_LZ4
+
+static Compressor* createCompressor(const string& codec, int level) {
+  if (codec == "gzip") {
+    return new GzipCompressor(level);
+#ifdef HAVE_ZSTD
+  } else if (codec == "zstd") {
+    return new ZstdCompressor(level);
+#endif
+#ifdef HAVE_LZ4
+  } else if (codec == "lz4") {
+    return new Lz4Compressor(level);
+#endif
+  }
+  return NULL;
+}
+
+static Decompressor* createDecompressor(const string& codec) {
+  if (codec == "gzip") {
+    return new GzipDecompressor();
+#ifdef HAVE_ZSTD
+  } else if (codec == "zstd") {
+    return new ZstdDecompressor();
+#endif
+#ifdef HAVE_LZ4
+  } else if (codec == "lz4") {
+    return new Lz4Decompressor();
+#endif
+  }
+  return NULL;
+}
+
+// Compresses one block of a large write as a stream of its own
+class BlockTask : public PoolTask {
+ public:
+  BlockTask(const string& codec_, int level_)
+    : codec(codec_), level(level_), success(false) {
+  }
+
+  void run() {
+    try {
+      shared_ptr<Compressor> compressor(createCompressor(codec, level));
+      success = true;
+      for (vector<struct iovec>::iterator iter = parts.begin();
+           success && iter != parts.end(); ++iter) {
+        success = compressor->compress((const char*)iter->iov_base,
+                                       iter->iov_len, out);
+      }
+      success = success && compressor->finish(out);
+    } catch (const std::exception& e) {
+      LOG_OPER("Exception < %s > compressing a block", e.what());
+      success = false;
+    }
+  }
+
+  string codec;
+  int level;
+  vector<struct iovec> parts;  // the block, as pieces of the write
+  string out;
+  bool success;
+};
+
+CompressedFile::CompressedFile(shared_ptr<FileInterface> raw_file,
+                               const string& name, const string& codec_,
+                               int level_, unsigned long block_size,
+                               bool frame)
+  : FileInterface(name, frame),
+    rawFile(raw_file),
+    codec(codec_),
+    level(level_),
+    blockSize(block_size),
+    written(false),
+    readPos(0),
+    rawEnd(false) {
+}
+
+CompressedFile::~CompressedFile() {
+  close();
+}
+
+bool CompressedFile::isSupported(const string& codec) {
+  return codec == "gzip"
+#ifdef HAVE_ZSTD
+    || codec == "zstd"
+#endif
+#ifdef HAVE_LZ4
+    || codec == "lz4"
+#endif
+    ;
+}
+
+string CompressedFile::extension(const string& codec) {
+  if (codec == "gzip") {
+    return ".gz";
+  } else if (codec == "zstd") {
+    return ".zst";
+  } else if (codec == "lz4") {
+    return ".lz4";
+  }
+  return string();
+}
+
+string CompressedFile::codecFromFilename(const string& name) {
+  const char* codecs[] = { "gzip", "zstd", "lz4" };
+  for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i) {
+    string ext = extension(codecs[i]);
+    if (name.size() > ext.size() &&
+        0 == name.compare(name.size() - ext.size(), ext.size(), ext)) {
+      return codecs[i];
+    }
+  }
+  return string();
+}
+
+bool CompressedFile::openRead() {
+  if (!rawFile->openRead()) {
+    return false;
+  }
+  try {
+    decompressor.reset(createDecompressor(codec));
+  } catch (const std::exception& e) {
+    LOG_OPER("Exception < %s > opening file <%s> for reading",
+             e.what(), filename.c_str());
+  }
+  if (!decompressor) {
+    rawFile->close();
+    return false;
+  }
+  readBuffer.clear();
+  readPos = 0;
+  rawEnd = false;
+  return true;
+}
+
+bool CompressedFile::openWrite() {
+  return rawFile->openWrite() && startWriting();
+}
+
+bool CompressedFile::openTruncate() {
+  return rawFile->openTruncate() && startWriting();
+}
+
+bool CompressedFile::startWriting() {
+  try {
+    compressor.reset(createCompressor(codec, level));
+  } catch (const std::exception& e) {
+    LOG_OPER("Exception < %s > opening file <%s> for writing",
+             e.what(), filename.c_str());
+  }
+  if (!compressor) {
+    rawFile->close();
+    return false;
+  }
+  written = false;
+  return true;
+}
+
+bool CompressedFile::isOpen() {
+  return rawFile->isOpen();
+}
+
+void CompressedFile::close() {
+  if (compressor) {
+    // an empty stream is not worth writing
+    string out;
+    if (written && (!compressor->finish(out) || !rawFile->write(out))) {
+      LOG_OPER("Failed to finish compressed stream in file <%s>",
+               filename.c_str());
+    }
+    compressor.reset();
+  }
+  decompressor.reset();
+  readBuffer.clear();
+  rawFile->close();
+}
+
+bool CompressedFile::writeCompressed(const string& data) {
+  written = true;
+  return data.empty() || rawFile->write(data);
+}
+
+bool CompressedFile::write(const string& data) {
+  if (!compressor && !openWrite()) {
+    return false;
+  }
+  string out;
+  if (!compressor->compress(data.data(), data.size(), out)) {
+    LOG_OPER("Failed to compress data for file <%s>", filename.c_str());
+    return false;
+  }
+  return writeCompressed(out);
+}
+
+bool CompressedFile::writev(const struct iovec* iov, int iovcnt) {
+  if (!compressor && !openWrite()) {
+    return false;
+  }
+
+  unsigned long total_length = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total_length += iov[i].iov_len;
+  }
+  if (g_compressionPool && blockSize > 0 && total_length >= 2 * blockSize) {
+    return writeBlocks(iov, iovcnt, total_length);
+  }
+
+  string out;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (!compressor->compress((const char*)iov[i].iov_base, iov[i].iov_len,
+                              out)) {
+      LOG_OPER("Failed to compress data for file <%s>", filename.c_str());
+      return false;
+    }
+  }
+  return writeCompressed(out);
+}
+
+/*
+ * Compresses the write in blocks on the compression pool. Each block is a
+ * stream of its own, so the current stream is ended first and the next
+ * write starts a new one.
+ */
+bool CompressedFile::writeBlocks(const struct iovec* iov, int iovcnt,
+                                 unsigned long total_length) {
+  string out;
+  if (written) {
+    shared_ptr<Compressor> next;
+    try {
+      next.reset(createCompressor(codec, level));
+    } catch (const std::exception& e) {
+      LOG_OPER("Exception < %s > restarting compression for file <%s>",
+               e.what(), filename.c_str());
+    }
+    if (!next || !compressor->finish(out)) {
+      LOG_OPER("Failed to finish compressed stream in file <%s>",
+               filename.c_str());
+      return false;
+    }
+    compressor = next;
+    written = false;
+  }
+
+  // cut the buffers into blocks, without copying them
+  unsigned long num_blocks = (total_length + blockSize - 1) / blockSize;
+  vector<BlockTask> blocks(num_blocks, BlockTask(codec, level));
+  unsigned long block = 0;
+  unsigned long block_length = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    const char* data = (const char*)iov[i].iov_base;
+    size_t left = iov[i].iov_len;
+    while (left > 0) {
+      if (block_length == blockSize) {
+        ++block;
+        block_length = 0;
+      }
+      struct iovec part;
+      part.iov_base = (void*)data;
+      part.iov_len = min(left, (size_t)(blockSize - block_length));
+      blocks[block].parts.push_back(part);
+      block_length += part.iov_len;
+      data += part.iov_len;
+      left -= part.iov_len;
+    }
+  }
+
+  vector<PoolTask*> tasks;
+  for (vector<BlockTask>::iterator iter = blocks.begin();
+       iter != blocks.end(); ++iter) {
+    tasks.push_back(&*iter);
+  }
+  shared_ptr<CompressionPool> pool = g_compressionPool;
+  pool->run(tasks);
+
+  for (vector<BlockTask>::iterator iter = blocks.begin();
+       iter != blocks.end(); ++iter) {
+    if (!iter->success) {
+      LOG_OPER("Failed to compress data for file <%s>", filename.c_str());
+      return false;
+    }
+    out.append(iter->out);
+    iter->out.clear();
+  }
+
+  // everything is in complete streams, nothing is left for close()
+  return out.empty() || rawFile->write(out);
+}
+
+bool CompressedFile::flush() {
+  if (compressor && written) {
+    string out;
+    if (!compressor->flush(out) || !rawFile->write(out)) {
+      LOG_OPER("Failed to flush compressed data to file <%s>",
+               filename.c_str());
+      return false;
+    }
+  }
+  return rawFile->flush();
+}
+
+unsigned long CompressedFile::fileSize() {
+  return rawFile->fileSize();
+}
+
+// Decompresses until length bytes are buffered or the file ends
+bool CompressedFile::fill(size_t length) {
+  if (readPos > CHUNK_SIZE) {
+    readBuffer.erase(0, readPos);
+    readPos = 0;
+  }
+
+  char buffer[CHUNK_SIZE];
+  while (readBuffer.size() - readPos < length && !rawEnd) {
+    long result = rawFile->readRaw(buffer, CHUNK_SIZE);
+    if (result <= 0) {
+      rawEnd = true;
+      break;
+    }
+    if (!decompressor->decompress(buffer, result, readBuffer)) {
+      LOG_OPER("WARNING: failed to decompress file <%s>", filename.c_str());
+      rawEnd = true;
+      break;
+    }
+  }
+  return readBuffer.size() - readPos >= length;
+}
+
+/*
+ * Same contract as StdFile::readNext(). Loss is counted in decompressed
+ * bytes, what a cut off stream would have held is unknown. Unless it was
+ * a damaged checksummed frame, nothing more is read after a loss.
+ */
+long CompressedFile::readNext(string& _return) {
+  if (!decompressor || !fill(UINT_SIZE)) {
+    long loss = decompressor ? readBuffer.size() - readPos : 0;
+    if (decompressor && (loss > 0 || decompressor->incomplete())) {
+      LOG_OPER("WARNING: Data Loss, compressed file <%s> ends early",
+               filename.c_str());
+      stopReading();
+      return loss > 0 ? -loss : -1;
+    }
+    return 0;
+  }
+
+  long size = unserializeUInt(readBuffer.data() + readPos);
+  if (size == 0) {
+    return 0;
+  }
+  if (isChecksummedFrame(readBuffer.data() + readPos)) {
+    return readChecksummed(_return);
+  }
+  if (size >= INT_MAX) {
+    long loss = readBuffer.size() - readPos;
+    LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s", loss,
+             filename.c_str());
+    stopReading();
+    return -loss;
+  }
+
+  if (!fill(UINT_SIZE + size)) {
+    long loss = readBuffer.size() - readPos;
+    LOG_OPER("WARNING: Data Loss %ld bytes in %s", loss, filename.c_str());
+    stopReading();
+    return -loss;
+  }
+
+  _return.assign(readBuffer, readPos + UINT_SIZE, size);
+  readPos += UINT_SIZE + size;
+  return size;
+}
+
+// Makes readNext() return 0 from now on
+void CompressedFile::stopReading() {
+  decompressor.reset();
+  readBuffer.clear();
+  readPos = 0;
+}
+
+long CompressedFile::readChecksummed(string& _return) {
+  unsigned long size;
+  if (fill(CHECKSUMMED_FRAME_HEADER_SIZE) &&
+      parseChecksummedHeader(readBuffer.data() + readPos, &size) &&
+      fill(CHECKSUMMED_FRAME_HEADER_SIZE + size) &&
+      checkFrameData(readBuffer.data() + readPos,
+                     readBuffer.data() + readPos + CHECKSUMMED_FRAME_HEADER_SIZE,
+                     size)) {
+    _return.assign(readBuffer, readPos + CHECKSUMMED_FRAME_HEADER_SIZE, size);
+    readPos += CHECKSUMMED_FRAME_HEADER_SIZE + size;
+    return size;
+  }
+
+  // skip to the next good frame that starts a record
+  long loss = 1;
+  ++readPos;
+  for (;;) {
+    long found = findChecksummedFrame(readBuffer.data() + readPos,
+                                      readBuffer.size() - readPos);
+    if (found >= 0) {
+      loss += found;
+      readPos += found;
+      break;
+    }
+
+    // the end could be the start of a header
+    size_t available = readBuffer.size() - readPos;
+    size_t keep = min(available, (size_t)CHECKSUMMED_FRAME_HEADER_SIZE - 1);
+    loss += available - keep;
+    readPos += available - keep;
+    if (rawEnd) {
+      loss += keep;
+      readPos += keep;
+      break;
+    }
+    fill(keep + CHUNK_SIZE);
+  }
+
+  LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s, reading on after it",
+           loss, filename.c_str());
+  return -loss;
+}
+
+void CompressedFile::deleteFile() {
+  rawFile->deleteFile();
+}
+
+void CompressedFile::listImpl(const string& path, vector<string>& _return) {
+  rawFile->listImpl(path, _return);
+}
+
+string CompressedFile::getFrame(unsigned data_length) {
+  if (framed) {
+    char buf[UINT_SIZE];
+    serializeUInt(data_length, buf);
+    return string(buf, UINT_SIZE);
+  } else {
+    return string();
+  }
+}
+
+bool CompressedFile::createDirectory(string path) {
+  return rawFile->createDirectory(path);
+}
+
+bool CompressedFile::createSymlink(string oldpath, string newpath) {
+  return rawFile->createSymlink(oldpath, newpath);
+}
+
+void CompressedFile::setShouldLogCalls(bool must_log) {
+  FileInterface::setShouldLogCalls(must_log);
+  rawFile->setShouldLogCalls(must_log);
+}
+
+void CompressedFile::setPreallocateSize(unsigned long size) {
+  FileInterface::setPreallocateSize(size);
+  rawFile->setPreallocateSize(size);
+}
+
+void CompressedFile::setSyncPolicy(file_sync_policy_t policy) {
+  FileInterface::setSyncPolicy(policy);
+  rawFile->setSyncPolicy(policy);
+}
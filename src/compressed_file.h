@@ -0,0 +1,107 @@
+#ifndef SCRIBE_COMPRESSED_FILE_H
+#define SCRIBE_COMPRESSED_FILE_H
+
+#include "common.h"
+#include "file.h"
+
+// Streaming compression codec, one instance per stream
+class Compressor {
+ public:
+  virtual ~Compressor() {}
+
+  // Each call appends the compressed data it has ready to out
+  virtual bool compress(const char* data, size_t length, std::string& out) = 0;
+  // everything compressed so far, so a reader can get to it
+  virtual bool flush(std::string& out) = 0;
+  // ends the stream
+  virtual bool finish(std::string& out) = 0;
+};
+
+class Decompressor {
+ public:
+  virtual ~Decompressor() {}
+
+  // Appends what data decompresses to to out. Streams that follow each
+  // other, as left by reopening a file for appending, are read as one.
+  virtual bool decompress(const char* data, size_t length, std::string& out) = 0;
+  // whether the input so far ended in the middle of a stream
+  virtual bool incomplete() = 0;
+};
+
+/*
+ * Compresses everything written to another FileInterface, and
+ * decompresses it again when read (see compression in scribe.conf).
+ *
+ * The file holds a standard stream of the codec, so it can be read with
+ * gzip, zstd or lz4 and the frames inside are the same as they would be
+ * without compression. Opening a file for writing starts a new stream
+ * after whatever is in the file already, and every codec reads streams
+ * that follow each other as one.
+ *
+ * Large writes are split into blocks of block_size that are compressed as
+ * streams of their own on g_compressionPool, when there is one, and
+ * written in order.
+ *
+ * fileSize() is the size on disk, i.e. compressed.
+ */
+class CompressedFile : public FileInterface {
+ public:
+  CompressedFile(boost::shared_ptr<FileInterface> raw_file,
+                 const std::string& name, const std::string& codec,
+                 int level, unsigned long block_size, bool framed);
+  virtual ~CompressedFile();
+
+  // whether this build supports codec (gzip, zstd or lz4)
+  static bool isSupported(const std::string& codec);
+  // the file name extension used for codec, including the dot
+  static std::string extension(const std::string& codec);
+  // the codec whose extension name ends with, empty if none
+  static std::string codecFromFilename(const std::string& name);
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  bool isOpen();
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  unsigned long fileSize();
+  long readNext(std::string& _return);
+  void deleteFile();
+  void listImpl(const std::string& path, std::vector<std::string>& _return);
+  std::string getFrame(unsigned data_size);
+  bool createDirectory(std::string path);
+  bool createSymlink(std::string oldpath, std::string newpath);
+  void setShouldLogCalls(bool must_log);
+  void setPreallocateSize(unsigned long size);
+  void setSyncPolicy(file_sync_policy_t policy);
+
+ private:
+  bool startWriting();
+  bool writeCompressed(const std::string& data);
+  bool writeBlocks(const struct iovec* iov, int iovcnt,
+                   unsigned long total_length);
+  bool fill(size_t length);
+  long readChecksummed(std::string& _return);
+  void stopReading();
+
+  boost::shared_ptr<FileInterface> rawFile;
+  std::string codec;
+  int level;
+  unsigned long blockSize;
+
+  boost::shared_ptr<Compressor> compressor;     // while writing
+  bool written;                                 // anything since opening
+  boost::shared_ptr<Decompressor> decompressor; // while reading
+  std::string readBuffer;                       // decompressed, not read yet
+  size_t readPos;
+  bool rawEnd;                                  // all of rawFile was read
+
+  // disallow copy, assignment, and empty construction
+  CompressedFile();
+  CompressedFile(CompressedFile& rhs);
+  CompressedFile& operator=(CompressedFile& rhs);
+};
+
+#endif // !defined SCRIBE_COMPRESSED_FILE_H
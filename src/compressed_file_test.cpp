@@ -0,0 +1,175 @@
+#include "compressed_file.h"
+#include "compression_pool.h"
+#include "test_util.h"
+
+#include <zlib.h>
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+static std::string makeRecord(int i) {
+    std::ostringstream record;
+    record << "record " << i << ' ' << std::string(i % 100, 'x');
+    return record.str();
+}
+
+class CompressedFileTest : public TempDirTestCase {
+public:
+    CPPUNIT_TEST_SUITE(CompressedFileTest);
+    CPPUNIT_TEST(testCodecs);
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testAppend);
+    CPPUNIT_TEST(testChecksummed);
+    CPPUNIT_TEST(testBlocks);
+    CPPUNIT_TEST(testGzipFormat);
+    CPPUNIT_TEST_SUITE_END();
+
+    void tearDown() {
+        g_compressionPool.reset();
+        TempDirTestCase::tearDown();
+    }
+
+    std::vector<std::string> supportedCodecs() {
+        const char* codecs[] = { "gzip", "zstd", "lz4" };
+        std::vector<std::string> supported;
+        for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i) {
+            if (CompressedFile::isSupported(codecs[i])) {
+                supported.push_back(codecs[i]);
+            }
+        }
+        return supported;
+    }
+
+    boost::shared_ptr<FileInterface> makeFile(const std::string& codec,
+                                              unsigned long block_size = 0,
+                                              bool checksum = false) {
+        std::string name = path + "/file" + CompressedFile::extension(codec);
+        boost::shared_ptr<FileInterface> raw =
+            FileInterface::createFileInterface("std", name, false);
+        boost::shared_ptr<FileInterface> file(
+            new CompressedFile(raw, name, codec, -1, block_size, true));
+        file->setFrameChecksum(checksum);
+        return file;
+    }
+
+    void writeRecords(boost::shared_ptr<FileInterface> file, int first,
+                      int count) {
+        CPPUNIT_ASSERT(file->openWrite());
+        for (int i = first; i < first + count; ++i) {
+            std::string record = makeRecord(i);
+            CPPUNIT_ASSERT(file->write(file->getFrame(record.size()) + record));
+        }
+        CPPUNIT_ASSERT(file->flush());
+        file->close();
+    }
+
+    void readRecords(boost::shared_ptr<FileInterface> file, int count) {
+        CPPUNIT_ASSERT(file->openRead());
+        for (int i = 0; i < count; ++i) {
+            std::string record;
+            CPPUNIT_ASSERT(file->readNext(record) > 0);
+            CPPUNIT_ASSERT_EQUAL(makeRecord(i), record);
+        }
+        std::string record;
+        CPPUNIT_ASSERT_EQUAL(0L, file->readNext(record));
+        file->close();
+    }
+
+    void testCodecs() {
+        CPPUNIT_ASSERT(CompressedFile::isSupported("gzip"));
+        CPPUNIT_ASSERT(!CompressedFile::isSupported("rot13"));
+        CPPUNIT_ASSERT_EQUAL(std::string("gzip"),
+                             CompressedFile::codecFromFilename("cat_00001.gz"));
+        CPPUNIT_ASSERT_EQUAL(std::string("zstd"),
+                             CompressedFile::codecFromFilename("cat_00001.zst"));
+        CPPUNIT_ASSERT_EQUAL(std::string("lz4"),
+                             CompressedFile::codecFromFilename("cat_00001.lz4"));
+        CPPUNIT_ASSERT(CompressedFile::codecFromFilename("cat_00001").empty());
+        CPPUNIT_ASSERT(CompressedFile::codecFromFilename(".gz").empty());
+    }
+
+    void testRoundTrip() {
+        std::vector<std::string> codecs = supportedCodecs();
+        for (size_t i = 0; i < codecs.size(); ++i) {
+            writeRecords(makeFile(codecs[i]), 0, 1000);
+            readRecords(makeFile(codecs[i]), 1000);
+            makeFile(codecs[i])->deleteFile();
+        }
+    }
+
+    void testAppend() {
+        // reopening for writing starts a new stream, read as one
+        std::vector<std::string> codecs = supportedCodecs();
+        for (size_t i = 0; i < codecs.size(); ++i) {
+            writeRecords(makeFile(codecs[i]), 0, 10);
+            writeRecords(makeFile(codecs[i]), 10, 10);
+            readRecords(makeFile(codecs[i]), 20);
+            makeFile(codecs[i])->deleteFile();
+        }
+    }
+
+    void testChecksummed() {
+        std::vector<std::string> codecs = supportedCodecs();
+        for (size_t i = 0; i < codecs.size(); ++i) {
+            writeRecords(makeFile(codecs[i], 0, true), 0, 100);
+            readRecords(makeFile(codecs[i], 0, true), 100);
+            makeFile(codecs[i])->deleteFile();
+        }
+    }
+
+    void testBlocks() {
+        // writes of several blocks are compressed on the pool
+        g_compressionPool.reset(new CompressionPool(2));
+        std::vector<std::string> codecs = supportedCodecs();
+        for (size_t i = 0; i < codecs.size(); ++i) {
+            boost::shared_ptr<FileInterface> file = makeFile(codecs[i], 256);
+            CPPUNIT_ASSERT(file->openWrite());
+            std::string data;
+            for (int j = 0; j < 500; ++j) {
+                std::string record = makeRecord(j);
+                data += file->getFrame(record.size()) + record;
+            }
+            CPPUNIT_ASSERT(file->write(data));
+            file->close();
+
+            readRecords(makeFile(codecs[i]), 500);
+            makeFile(codecs[i])->deleteFile();
+        }
+    }
+
+    void testGzipFormat() {
+        // anyone with zlib can read what is written
+        writeRecords(makeFile("gzip"), 0, 10);
+
+        gzFile file = gzopen((path + "/file.gz").c_str(), "rb");
+        CPPUNIT_ASSERT(file != NULL);
+        std::string data;
+        char buffer[4096];
+        int length;
+        while ((length = gzread(file, buffer, sizeof(buffer))) > 0) {
+            data.append(buffer, length);
+        }
+        gzclose(file);
+
+        std::string expected;
+        boost::shared_ptr<FileInterface> framer = makeFile("gzip");
+        for (int i = 0; i < 10; ++i) {
+            std::string record = makeRecord(i);
+            expected += framer->getFrame(record.size()) + record;
+        }
+        CPPUNIT_ASSERT(expected == data);
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CompressedFileTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
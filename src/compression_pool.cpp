@@ -0,0 +1,112 @@
+#include "compression_pool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+boost::shared_ptr<CompressionPool> g_compressionPool;
+
+static void* poolStatic(void* this_ptr) {
+  CompressionPool* pool = (CompressionPool*)this_ptr;
+  pool->threadMember();
+  return NULL;
+}
+
+CompressionPool::CompressionPool(unsigned long num_threads)
+  : stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&workCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, poolStatic, (void*) this) != 0) {
+      LOG_OPER("failed to create compression thread, running with %lu",
+               (unsigned long)threads.size());
+      break;
+    }
+    threads.push_back(thread);
+  }
+}
+
+CompressionPool::~CompressionPool() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&workCond);
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<pthread_t>::iterator iter = threads.begin();
+       iter != threads.end(); ++iter) {
+    pthread_join(*iter, NULL);
+  }
+
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&workCond);
+  pthread_cond_destroy(&doneCond);
+}
+
+void CompressionPool::run(const vector<PoolTask*>& tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+
+  Group group;
+  group.tasks = &tasks;
+  group.next = 0;
+  group.done = 0;
+
+  pthread_mutex_lock(&mutex);
+  groups.push_back(&group);
+  pthread_cond_broadcast(&workCond);
+
+  PoolTask* task;
+  while ((task = takeTask(&group)) != NULL) {
+    pthread_mutex_unlock(&mutex);
+    task->run();
+    pthread_mutex_lock(&mutex);
+    finishTask(&group);
+  }
+
+  // the rest is running on pool threads
+  while (group.done < tasks.size()) {
+    pthread_cond_wait(&doneCond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Must hold mutex. Returns NULL once every task of group has been taken.
+PoolTask* CompressionPool::takeTask(Group* group) {
+  if (group->next == group->tasks->size()) {
+    return NULL;
+  }
+  PoolTask* task = (*group->tasks)[group->next++];
+  if (group->next == group->tasks->size()) {
+    groups.erase(find(groups.begin(), groups.end(), group));
+  }
+  return task;
+}
+
+// Must hold mutex
+void CompressionPool::finishTask(Group* group) {
+  if (++group->done == group->tasks->size()) {
+    pthread_cond_broadcast(&doneCond);
+  }
+}
+
+void CompressionPool::threadMember() {
+  pthread_mutex_lock(&mutex);
+  while (!stopping) {
+    if (groups.empty()) {
+      pthread_cond_wait(&workCond, &mutex);
+      continue;
+    }
+
+    Group* group = groups.front();
+    PoolTask* task = takeTask(group);
+    pthread_mutex_unlock(&mutex);
+    task->run();
+    pthread_mutex_lock(&mutex);
+    finishTask(group);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,62 @@
+#ifndef SCRIBE_COMPRESSION_POOL_H
+#define SCRIBE_COMPRESSION_POOL_H
+
+#include "common.h"
+
+#include <deque>
+
+// A piece of work for a CompressionPool
+class PoolTask {
+ public:
+  virtual ~PoolTask() {}
+  virtual void run() = 0;
+};
+
+/*
+ * Fixed-size pool of threads shared by all stores for CPU-heavy work on
+ * batches, mainly compressing them in blocks (see compression_threads in
+ * scribe.conf).
+ *
+ * run() takes a group of tasks and returns once all of them are done. The
+ * calling thread works on its own group too, so a group always makes
+ * progress even when every pool thread is busy with someone else's.
+ */
+class CompressionPool {
+ public:
+  explicit CompressionPool(unsigned long num_threads);
+  ~CompressionPool();
+
+  void run(const std::vector<PoolTask*>& tasks);
+
+  unsigned long getNumThreads() const { return threads.size(); }
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  struct Group {
+    const std::vector<PoolTask*>* tasks;
+    size_t next;                  // first task no one has taken yet
+    size_t done;
+  };
+
+  PoolTask* takeTask(Group* group);
+  void finishTask(Group* group);
+
+  std::vector<pthread_t> threads;
+  std::deque<Group*> groups;      // with tasks left to take, oldest first
+  bool stopping;
+  pthread_mutex_t mutex;          // Must be held to read/modify any of the above
+  pthread_cond_t workCond;        // signaled when a group is added
+  pthread_cond_t doneCond;        // signaled when a group is done
+
+  // disallow copy and assignment
+  CompressionPool(const CompressionPool& rhs);
+  CompressionPool& operator=(const CompressionPool& rhs);
+};
+
+// NULL unless compression_threads is set
+extern boost::shared_ptr<CompressionPool> g_compressionPool;
+
+#endif // !defined SCRIBE_COMPRESSION_POOL_H
@@ -423,12 +423,19 @@ scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
   // but we need to use them internally to avoid even more copies.
   std::vector<LogEntry> msgs;
   map<string, int> categorySendCounts;
+  map<string, int>::iterator count_iter = categorySendCounts.end();
   msgs.reserve(size);
   for (logentry_vector_t::iterator iter = messages->begin();
        iter != messages->end();
        ++iter) {
     msgs.push_back(**iter);
-    categorySendCounts[(*iter)->category] += 1;
+    // only look up the counter again when the category changes
+    if (count_iter == categorySendCounts.end() ||
+        count_iter->first != (*iter)->category) {
+      count_iter = categorySendCounts.insert(
+          make_pair((*iter)->category, 0)).first;
+    }
+    ++count_iter->second;
   }
   ResultCode::type result = ResultCode::TRY_LATER;
   try {
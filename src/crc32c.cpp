@@ -0,0 +1,96 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42
+#endif
+
+// reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t (*crc32c_function_t)(uint32_t, const char*, size_t);
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, which lets
+// the portable version handle 8 bytes at a time
+static uint32_t table[8][256];
+
+static void initTable() {
+  for (uint32_t b = 0; b < 256; ++b) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    table[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; ++b) {
+    for (int k = 1; k < 8; ++k) {
+      table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+    }
+  }
+}
+
+uint32_t crc32cPortable(uint32_t crc, const char* data, size_t length) {
+  const unsigned char* pos = (const unsigned char*)data;
+  crc = ~crc;
+
+  while (length >= 8) {
+    uint32_t low = crc ^ (pos[0] | pos[1] << 8 | pos[2] << 16 |
+                          (uint32_t)pos[3] << 24);
+    crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+          table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+          table[3][pos[4]] ^ table[2][pos[5]] ^
+          table[1][pos[6]] ^ table[0][pos[7]];
+    pos += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *pos++) & 0xff];
+  }
+
+  return ~crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const char* data, size_t length) {
+  uint64_t crc64 = ~crc;
+
+  // byte at a time up to an 8 byte boundary, then 8 bytes at a time
+  while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    --length;
+  }
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+  }
+
+  return ~(uint32_t)crc64;
+}
+#endif
+
+static crc32c_function_t chooseFunction() {
+  initTable();
+#ifdef HAVE_CRC32C_SSE42
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32cSse42;
+  }
+#endif
+  return crc32cPortable;
+}
+
+// chosen once, when the program starts
+static crc32c_function_t crc32cFunction = chooseFunction();
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t length) {
+  return crc32cFunction(crc, data, length);
+}
@@ -0,0 +1,20 @@
+#ifndef SCRIBE_CRC32C_H
+#define SCRIBE_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI and ext4, of length bytes of
+ * data. Pass the result of an earlier call as crc to continue it over
+ * more data, 0 to start.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a table
+ * otherwise. Both give the same result.
+ */
+uint32_t crc32c(uint32_t crc, const char* data, size_t length);
+
+// the table version, whatever the CPU supports
+uint32_t crc32cPortable(uint32_t crc, const char* data, size_t length);
+
+#endif // !defined SCRIBE_CRC32C_H
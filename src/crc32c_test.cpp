@@ -0,0 +1,63 @@
+#include "crc32c.h"
+
+#include <string>
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+class Crc32cTest : public CppUnit::TestCase {
+public:
+    CPPUNIT_TEST_SUITE(Crc32cTest);
+    CPPUNIT_TEST(testKnownValues);
+    CPPUNIT_TEST(testContinued);
+    CPPUNIT_TEST(testPortable);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testKnownValues() {
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0, crc32c(0, "", 0));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xe3069283, crc32c(0, "123456789", 9));
+
+        // RFC 3720, 32 bytes of zeros
+        std::string zeros(32, '\0');
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x8a9136aa,
+                             crc32c(0, zeros.data(), zeros.size()));
+    }
+
+    void testContinued() {
+        std::string data = "The quick brown fox jumps over the lazy dog";
+        uint32_t whole = crc32c(0, data.data(), data.size());
+        for (size_t split = 0; split <= data.size(); ++split) {
+            uint32_t crc = crc32c(0, data.data(), split);
+            crc = crc32c(crc, data.data() + split, data.size() - split);
+            CPPUNIT_ASSERT_EQUAL(whole, crc);
+        }
+    }
+
+    void testPortable() {
+        // every alignment and length around the 8 byte steps
+        std::string data;
+        for (int i = 0; i < 300; ++i) {
+            data.push_back((char)(i * 31 + 7));
+        }
+        for (size_t start = 0; start < 16; ++start) {
+            for (size_t length = 0; start + length <= data.size(); length += 7) {
+                CPPUNIT_ASSERT_EQUAL(
+                    crc32cPortable(0, data.data() + start, length),
+                    crc32c(0, data.data() + start, length));
+            }
+        }
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(Crc32cTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
@@ -75,6 +75,12 @@ unsigned long scribe::clock::nowInMsec() {
   return ((unsigned long)sec) * 1000 + (tv.tv_usec / 1000);
 }
 
+unsigned long long scribe::clock::monotonicNowInMsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 /*
  * Hash functions
  */
@@ -124,6 +124,8 @@ namespace concurrency {
 
 namespace clock {
   unsigned long nowInMsec();
+  // milliseconds of a clock that never jumps, only good for intervals
+  unsigned long long monotonicNowInMsec();
 
 } // !namespace scribe::clock
 
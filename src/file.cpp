@@ -22,6 +22,12 @@
 #include "common.h"
 #include "file.h"
 #include "HdfsFile.h"
+#include "crc32c.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 #define INITIAL_BUFFER_SIZE (64 * 1024)
 #define LARGE_BUFFER_SIZE (16 * INITIAL_BUFFER_SIZE) /* arbitrarily chosen */
@@ -35,6 +41,8 @@ boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::s
                                                                     bool framed) {
   if (0 == type.compare("std")) {
     return shared_ptr<FileInterface>(new StdFile(name, framed));
+  } else if (0 == type.compare("posix")) {
+    return shared_ptr<FileInterface>(new PosixFile(name, framed));
   } else if (0 == type.compare("hdfs")) {
     return shared_ptr<FileInterface>(new HdfsFile(name));
   } else {
@@ -51,8 +59,42 @@ std::vector<std::string> FileInterface::list(const std::string& path, const std:
   return files;
 }
 
+// Writes and syncs a temporary file, renames it over name and syncs the
+// directory, which is what makes the rename itself durable.
+bool FileInterface::replaceLocalFile(const std::string& name,
+                                     const std::string& contents) {
+  string tmp_name = name + ".tmp";
+  PosixFile tmp_file(tmp_name, false);
+  tmp_file.setSyncPolicy(SYNC_DATA);
+  bool success = tmp_file.openTruncate() && tmp_file.write(contents) &&
+    tmp_file.flush();
+  tmp_file.close();
+  if (!success || rename(tmp_name.c_str(), name.c_str()) != 0) {
+    unlink(tmp_name.c_str());
+    return false;
+  }
+
+  string::size_type slash = name.rfind('/');
+  string directory = slash == string::npos ? "." :
+    slash == 0 ? "/" : name.substr(0, slash);
+  int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    LOG_OPER("Failed to open directory <%s>: %s",
+             directory.c_str(), strerror(errno));
+    return false;
+  }
+  success = fsync(dir_fd) == 0;
+  if (!success) {
+    LOG_OPER("Failed to sync directory <%s>: %s",
+             directory.c_str(), strerror(errno));
+  }
+  ::close(dir_fd);
+  return success;
+}
+
 FileInterface::FileInterface(const std::string& name, bool frame)
-  : framed(frame), filename(name), log_calls(false) {
+  : framed(frame), frameChecksum(false), filename(name), log_calls(false),
+    preallocateSize(0), syncPolicy(SYNC_NONE) {
   LZOCompressionLevel = 0;
 }
 
@@ -67,6 +109,183 @@ void FileInterface::setShouldLogCalls(bool must_log) {
   log_calls = must_log;
 }
 
+long FileInterface::readRaw(char* data, unsigned long length) {
+  LOG_OPER("Raw reads are not supported for file <%s>", filename.c_str());
+  return -1;
+}
+
+long FileInterface::tellRaw() {
+  return -1;
+}
+
+bool FileInterface::seekRaw(unsigned long offset) {
+  return false;
+}
+
+void FileInterface::setFrameChecksum(bool checksum) {
+  frameChecksum = checksum;
+}
+
+string FileInterface::getFrame(const struct iovec* iov, int iovcnt,
+                               bool continued) {
+  unsigned long length = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    length += iov[i].iov_len;
+  }
+  if (!framed || !frameChecksum || length > FRAME_MAX_CHECKSUMMED_LENGTH) {
+    return getFrame(length);
+  }
+
+  uint32_t crc = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    crc = crc32c(crc, (const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+
+  char header[CHECKSUMMED_FRAME_HEADER_SIZE];
+  serializeUInt(length | FRAME_CHECKSUMMED | (continued ? FRAME_CONTINUED : 0),
+                header);
+  serializeUInt(crc, header + UINT_SIZE);
+  serializeUInt(crc32c(0, header, 2 * UINT_SIZE), header + 2 * UINT_SIZE);
+  return string(header, CHECKSUMMED_FRAME_HEADER_SIZE);
+}
+
+// same byte order as serializeUInt(), for the static helpers below
+static uint32_t getUInt(const char* buffer) {
+  uint32_t value = 0;
+  for (int i = 0; i < UINT_SIZE; ++i) {
+    value |= (uint32_t)(unsigned char)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+bool FileInterface::isChecksummedFrame(const char* header) {
+  return (getUInt(header) & FRAME_CHECKSUMMED) != 0;
+}
+
+bool FileInterface::parseChecksummedHeader(const char* header,
+                                           unsigned long* length) {
+  if (!isChecksummedFrame(header) ||
+      crc32c(0, header, 2 * UINT_SIZE) != getUInt(header + 2 * UINT_SIZE)) {
+    return false;
+  }
+  *length = getUInt(header) & FRAME_MAX_CHECKSUMMED_LENGTH;
+  return true;
+}
+
+bool FileInterface::checkFrameData(const char* header, const char* data,
+                                   unsigned long length) {
+  return crc32c(0, data, length) == getUInt(header + UINT_SIZE);
+}
+
+long FileInterface::findChecksummedFrame(const char* buffer,
+                                         unsigned long length) {
+  unsigned long frame_length;
+  for (unsigned long offset = 0;
+       offset + CHECKSUMMED_FRAME_HEADER_SIZE <= length; ++offset) {
+    // cheap tests first, this looks at every byte
+    if ((buffer[offset + UINT_SIZE - 1] & 0xc0) == 0x80 &&
+        parseChecksummedHeader(buffer + offset, &frame_length)) {
+      return offset;
+    }
+  }
+  return -1;
+}
+
+/*
+ * readNext() for a checksummed frame, whose first 4 bytes were just read
+ * into length. Files that implement it need readRaw(), tellRaw() and
+ * seekRaw().
+ */
+long FileInterface::readChecksummedFrame(const char* length,
+                                         std::string& _return) {
+  long offset = tellRaw() - UINT_SIZE;
+  char header[CHECKSUMMED_FRAME_HEADER_SIZE];
+  memcpy(header, length, UINT_SIZE);
+
+  unsigned long size = 0;
+  bool good = offset >= 0 &&
+    readRaw(header + UINT_SIZE, 2 * UINT_SIZE) == 2 * UINT_SIZE &&
+    parseChecksummedHeader(header, &size);
+  if (good) {
+    _return.resize(size);
+    good = (size == 0 || readRaw(&_return[0], size) == (long)size) &&
+      checkFrameData(header, _return.data(), size);
+  }
+  if (good) {
+    return size;
+  }
+
+  _return.clear();
+  if (offset < 0) {
+    return -(1000 * 1000 * 1000);
+  }
+  return -(long)skipDamagedFrame(offset);
+}
+
+/*
+ * Looks for the next good checksummed frame that starts a record after
+ * the damaged one at offset, and leaves the file there, or at its end if
+ * there is none. Returns the number of bytes skipped.
+ */
+unsigned long FileInterface::skipDamagedFrame(unsigned long offset) {
+  unsigned long window_start = offset + 1;
+  string window;
+  char buffer[INITIAL_BUFFER_SIZE];
+  unsigned long next;
+
+  if (!seekRaw(window_start)) {
+    next = max(fileSize(), window_start);
+  } else {
+    for (;;) {
+      long result = readRaw(buffer, sizeof(buffer));
+      if (result > 0) {
+        window.append(buffer, result);
+      }
+      long found = findChecksummedFrame(window.data(), window.size());
+      if (found >= 0) {
+        next = window_start + found;
+        seekRaw(next);
+        break;
+      }
+      if (result <= 0) {
+        next = window_start + window.size();
+        break;
+      }
+      // the end could be the start of a header
+      unsigned long keep = min(window.size(),
+                               (size_t)CHECKSUMMED_FRAME_HEADER_SIZE - 1);
+      window_start += window.size() - keep;
+      window.erase(0, window.size() - keep);
+    }
+  }
+
+  LOG_OPER("WARNING: Corruption Data Loss %lu bytes in %s, reading on after it",
+           next - offset, filename.c_str());
+  return next - offset;
+}
+
+void FileInterface::setPreallocateSize(unsigned long size) {
+  preallocateSize = size;
+}
+
+void FileInterface::setSyncPolicy(file_sync_policy_t policy) {
+  syncPolicy = policy;
+}
+
+bool FileInterface::writev(const struct iovec* iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  string data;
+  data.reserve(total);
+  for (int i = 0; i < iovcnt; ++i) {
+    data.append((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  return write(data);
+}
+
 StdFile::StdFile(const std::string& name, bool frame)
   : FileInterface(name, frame), inputBuffer(NULL), bufferSize(0) {
 }
@@ -152,6 +371,22 @@ bool StdFile::write(const std::string& data) {
   return true;
 }
 
+// Hands each buffer straight to the fstream. Large buffers bypass the
+// stream's own buffer, so messages are not copied on their way to disk.
+bool StdFile::writev(const struct iovec* iov, int iovcnt) {
+  if (!isOpen() && !openWrite()) {
+    return false;
+  }
+
+  for (int i = 0; i < iovcnt; ++i) {
+    file.write((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  if (file.bad()) {
+    return false;
+  }
+  return true;
+}
+
 bool StdFile::flush() {
   if (file.is_open()) {
     file.flush();
@@ -168,7 +403,9 @@ bool StdFile::flush() {
  * returns a negative number if it
  * encounters any problem when reading from the file. The negative
  * number is the number of bytes in the file that will not be read
- * becuase of this problem (most likely corruption of file).
+ * becuase of this problem (most likely corruption of file). After a
+ * damaged checksummed frame reading can go on with the next good one,
+ * otherwise the next call returns 0.
  *
  * returns 0 on end of file or when it encounters a frame of size 0
  *
@@ -213,7 +450,10 @@ StdFile::readNext(std::string& _return) {
     /* end of file */
     return (0);
   }
-  // check if most signiifcant bit set - should never be set
+  if (isChecksummedFrame(inputBuffer)) {
+    return readChecksummedFrame(inputBuffer, _return);
+  }
+  // a plain length never has the most significant bit set
   if (size >= INT_MAX) {
     /* Definitely corrupted. Stop reading any further */
     CALC_LOSS();
@@ -278,6 +518,27 @@ void StdFile::listImpl(const std::string& path, std::vector<std::string>& _retur
   }
 }
 
+long StdFile::readRaw(char* data, unsigned long length) {
+  if (!file.is_open()) {
+    return -1;
+  }
+  file.read(data, length);
+  return file.bad() ? -1 : (long)file.gcount();
+}
+
+long StdFile::tellRaw() {
+  return file.is_open() ? (long)file.tellg() : -1;
+}
+
+bool StdFile::seekRaw(unsigned long offset) {
+  if (!file.is_open()) {
+    return false;
+  }
+  file.clear();
+  file.seekg(offset);
+  return !file.fail();
+}
+
 void StdFile::deleteFile() {
   boost::filesystem::remove(filename);
 }
@@ -302,6 +563,450 @@ bool StdFile::createSymlink(std::string oldpath, std::string newpath) {
   return false;
 }
 
+PosixFile::PosixFile(const std::string& name, bool frame)
+  : FileInterface(name, frame),
+    fd(-1),
+    writing(false),
+    preallocated(false),
+    size(0),
+    syncedSize(0),
+    inputBuffer(NULL),
+    bufferStart(0),
+    bufferEnd(0),
+    readOffset(0) {
+}
+
+PosixFile::~PosixFile() {
+  close();
+}
+
+bool PosixFile::openRead() {
+  if (!open(O_RDONLY)) {
+    return false;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return true;
+}
+
+bool PosixFile::openWrite() {
+  /* try to create the directory containing the file */
+  string::size_type slash = filename.find_last_of("/");
+  if (slash != string::npos && slash != 0 &&
+      !createDirectory(filename.substr(0, slash))) {
+    return false;
+  }
+  return open(O_WRONLY | O_CREAT | O_APPEND);
+}
+
+bool PosixFile::openTruncate() {
+  return open(O_WRONLY | O_CREAT | O_APPEND | O_TRUNC);
+}
+
+bool PosixFile::open(int flags) {
+  if (fd >= 0) {
+    return false;
+  }
+
+  fd = ::open(filename.c_str(), flags | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_OPER("Failed to open file <%s>: %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  writing = (flags & O_WRONLY) != 0;
+  readOffset = 0;
+  bufferStart = bufferEnd = 0;
+  if (writing) {
+    struct stat st;
+    size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    syncedSize = size;
+
+    // KEEP_SIZE so the file size still says how much has been written
+    if (preallocateSize > size) {
+      if (fallocate(fd, FALLOC_FL_KEEP_SIZE, size, preallocateSize - size) == 0) {
+        preallocated = true;
+      } else {
+        LOG_OPER("Failed to preallocate %lu bytes for file <%s>: %s",
+                 preallocateSize, filename.c_str(), strerror(errno));
+      }
+    }
+  }
+  return true;
+}
+
+bool PosixFile::isOpen() {
+  return fd >= 0;
+}
+
+void PosixFile::close() {
+  if (fd < 0) {
+    return;
+  }
+
+  if (writing) {
+    flush();
+    if (preallocated) {
+      // give back the space we did not use
+      if (ftruncate(fd, size) != 0) {
+        LOG_OPER("Failed to trim preallocated space of file <%s>: %s",
+                 filename.c_str(), strerror(errno));
+      }
+      preallocated = false;
+    }
+    if (syncPolicy == SYNC_DATA) {
+      // the data is on disk, no need to keep it cached
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+  }
+
+  ::close(fd);
+  fd = -1;
+  writing = false;
+  if (inputBuffer) {
+    free(inputBuffer);
+    inputBuffer = NULL;
+  }
+}
+
+bool PosixFile::write(const std::string& data) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.size();
+  return writev(&iov, 1);
+}
+
+bool PosixFile::writev(const struct iovec* iov, int iovcnt) {
+  if (!isOpen() && !openWrite()) {
+    return false;
+  }
+
+  // copy since a short write means adjusting the first buffer
+  vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t first = 0;
+  while (first < pending.size()) {
+    if (pending[first].iov_len == 0) {
+      ++first;
+      continue;
+    }
+
+    int count = min(pending.size() - first, (size_t)IOV_MAX);
+    ssize_t written = ::writev(fd, &pending[first], count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("Failed to write to file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    }
+
+    size += written;
+    while (written > 0) {
+      if ((size_t)written >= pending[first].iov_len) {
+        written -= pending[first].iov_len;
+        ++first;
+      } else {
+        pending[first].iov_base = (char*)pending[first].iov_base + written;
+        pending[first].iov_len -= written;
+        written = 0;
+      }
+    }
+  }
+  return true;
+}
+
+bool PosixFile::flush() {
+  if (fd < 0) {
+    return false;
+  }
+  if (!writing || size == syncedSize) {
+    return true;
+  }
+
+  switch (syncPolicy) {
+  case SYNC_WRITEBACK:
+    if (sync_file_range(fd, syncedSize, size - syncedSize,
+                        SYNC_FILE_RANGE_WRITE) != 0) {
+      LOG_OPER("Failed to start writeback of file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    }
+    break;
+  case SYNC_DATA:
+    if (fdatasync(fd) != 0) {
+      LOG_OPER("Failed to sync file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    }
+    break;
+  case SYNC_NONE:
+    break;
+  }
+  syncedSize = size;
+  return true;
+}
+
+unsigned long PosixFile::fileSize() {
+  if (writing) {
+    return size;
+  }
+
+  struct stat st;
+  int result = fd >= 0 ? fstat(fd, &st) : stat(filename.c_str(), &st);
+  if (result != 0) {
+    LOG_OPER("Failed to get size for file <%s> error <%s>",
+             filename.c_str(), strerror(errno));
+    return 0;
+  }
+  return st.st_size;
+}
+
+// Reads up to length bytes through inputBuffer, returns how many were read
+size_t PosixFile::read(char* data, size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    if (bufferStart == bufferEnd) {
+      if (!inputBuffer) {
+        inputBuffer = (char*) malloc(INITIAL_BUFFER_SIZE);
+        if (inputBuffer == NULL) {
+          break;
+        }
+      }
+      ssize_t result = ::read(fd, inputBuffer, INITIAL_BUFFER_SIZE);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        break;
+      }
+      bufferStart = 0;
+      bufferEnd = result;
+    }
+
+    size_t count = min(length - done, bufferEnd - bufferStart);
+    memcpy(data + done, inputBuffer + bufferStart, count);
+    bufferStart += count;
+    done += count;
+  }
+  readOffset += done;
+  return done;
+}
+
+/*
+ * Same contract as StdFile::readNext(): returns the size of the frame
+ * read, 0 at the end of the file, or minus the number of bytes that will
+ * not be read because of corruption.
+ */
+long PosixFile::readNext(std::string& _return) {
+  char header[UINT_SIZE];
+  if (fd < 0 || read(header, UINT_SIZE) != UINT_SIZE) {
+    return 0;
+  }
+
+  long size = unserializeUInt(header);
+  if (size == 0) {
+    return 0;
+  }
+  if (isChecksummedFrame(header)) {
+    return readChecksummedFrame(header, _return);
+  }
+  if (size >= INT_MAX) {
+    long loss = -(long)(fileSize() - (readOffset - UINT_SIZE));
+    LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s", -loss,
+             filename.c_str());
+    return loss < 0 ? loss : -(1000 * 1000 * 1000);
+  }
+
+  _return.resize(size);
+  if (read(&_return[0], size) != (size_t)size) {
+    LOG_OPER("WARNING: Data Loss %ld bytes in %s", size, filename.c_str());
+    return -size;
+  }
+  return size;
+}
+
+long PosixFile::readRaw(char* data, unsigned long length) {
+  return fd < 0 ? -1 : read(data, length);
+}
+
+long PosixFile::tellRaw() {
+  return fd < 0 ? -1 : readOffset;
+}
+
+bool PosixFile::seekRaw(unsigned long offset) {
+  if (fd < 0 || lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+    return false;
+  }
+  bufferStart = bufferEnd = 0;
+  readOffset = offset;
+  return true;
+}
+
+void PosixFile::deleteFile() {
+  if (unlink(filename.c_str()) != 0 && errno != ENOENT) {
+    LOG_OPER("Failed to delete file <%s>: %s", filename.c_str(), strerror(errno));
+  }
+}
+
+void PosixFile::listImpl(const std::string& path,
+                         std::vector<std::string>& _return) {
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    if (errno != ENOENT) {
+      LOG_OPER("Failed to list files in <%s>: %s", path.c_str(), strerror(errno));
+    }
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      _return.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+}
+
+string PosixFile::getFrame(unsigned data_length) {
+  if (framed) {
+    char buf[UINT_SIZE];
+    serializeUInt(data_length, buf);
+    return string(buf, UINT_SIZE);
+  } else {
+    return string();
+  }
+}
+
+bool PosixFile::createDirectory(std::string path) {
+  try {
+    boost::filesystem::create_directories(path);
+  } catch(const std::exception& e) {
+    LOG_OPER("Exception < %s > in PosixFile::createDirectory for path %s ",
+      e.what(),path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool PosixFile::createSymlink(std::string oldpath, std::string newpath) {
+  return symlink(oldpath.c_str(), newpath.c_str()) == 0;
+}
+
+MappedFrameReader::MappedFrameReader(const std::string& name)
+  : filename(name),
+    mapping(NULL),
+    size(0),
+    offset(0) {
+}
+
+MappedFrameReader::~MappedFrameReader() {
+  close();
+}
+
+bool MappedFrameReader::open() {
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_OPER("Failed to open file <%s>: %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    LOG_OPER("Failed to get size for file <%s> error <%s>",
+             filename.c_str(), strerror(errno));
+    ::close(fd);
+    return false;
+  }
+
+  size = st.st_size;
+  offset = 0;
+  // an empty file can't be mapped, and has no frames anyway
+  if (size > 0) {
+    void* result = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (result == MAP_FAILED) {
+      LOG_OPER("Failed to map file <%s>: %s", filename.c_str(), strerror(errno));
+      ::close(fd);
+      return false;
+    }
+    mapping = (char*)result;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+  }
+
+  // the mapping keeps the file open
+  ::close(fd);
+  return true;
+}
+
+void MappedFrameReader::close() {
+  if (mapping) {
+    munmap(mapping, size);
+    mapping = NULL;
+  }
+  size = offset = 0;
+}
+
+bool MappedFrameReader::seek(unsigned long new_offset) {
+  if (new_offset > size) {
+    return false;
+  }
+  offset = new_offset;
+  return true;
+}
+
+long MappedFrameReader::next(const char** data) {
+  if (size - offset < UINT_SIZE) {
+    return 0;
+  }
+
+  // same byte order as FileInterface::unserializeUInt()
+  unsigned long length = 0;
+  for (int i = 0; i < UINT_SIZE; ++i) {
+    length |= (unsigned long)(unsigned char)mapping[offset + i] << (8 * i);
+  }
+  if (length == 0) {
+    return 0;
+  }
+  if (length & FRAME_CHECKSUMMED) {
+    return nextChecksummed(data);
+  }
+  if (length >= INT_MAX || length > size - offset - UINT_SIZE) {
+    long loss = size - offset;
+    LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s", loss,
+             filename.c_str());
+    offset = size;
+    return -loss;
+  }
+
+  *data = mapping + offset + UINT_SIZE;
+  offset += UINT_SIZE + length;
+  return length;
+}
+
+long MappedFrameReader::nextChecksummed(const char** data) {
+  const char* header = mapping + offset;
+  unsigned long length;
+  if (size - offset >= CHECKSUMMED_FRAME_HEADER_SIZE &&
+      FileInterface::parseChecksummedHeader(header, &length) &&
+      length <= size - offset - CHECKSUMMED_FRAME_HEADER_SIZE &&
+      FileInterface::checkFrameData(header,
+                                    header + CHECKSUMMED_FRAME_HEADER_SIZE,
+                                    length)) {
+    *data = header + CHECKSUMMED_FRAME_HEADER_SIZE;
+    offset += CHECKSUMMED_FRAME_HEADER_SIZE + length;
+    return length;
+  }
+
+  // skip to the next good frame that starts a record
+  long found = FileInterface::findChecksummedFrame(header + 1,
+                                                   size - offset - 1);
+  long loss = found >= 0 ? found + 1 : size - offset;
+  LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s, reading on after it",
+           loss, filename.c_str());
+  offset += loss;
+  return -loss;
+}
+
 // Buffer had better be at least UINT_SIZE long!
 unsigned FileInterface::unserializeUInt(const char* buffer) {
   unsigned retval = 0;
@@ -24,6 +24,33 @@
 
 #include "common.h"
 
+#include <sys/uio.h>
+
+/*
+ * Frames are a 4 byte length followed by the data. Files written with
+ * frame checksums (see setFrameChecksum()) use a longer header instead:
+ *
+ *   4 bytes  length, with FRAME_CHECKSUMMED set and FRAME_CONTINUED set
+ *            if the frame belongs to the same record as the one before
+ *   4 bytes  CRC32C of the data
+ *   4 bytes  CRC32C of the 8 bytes before
+ *
+ * Plain lengths never have the top bit set, so both kinds can be in the
+ * same file. The header's own checksum lets a reader find the next good
+ * frame after a damaged one, and lose only that one.
+ */
+#define FRAME_CHECKSUMMED             0x80000000
+#define FRAME_CONTINUED               0x40000000
+#define FRAME_MAX_CHECKSUMMED_LENGTH  0x3fffffff
+#define CHECKSUMMED_FRAME_HEADER_SIZE 12
+
+// what flush() does besides handing data to the kernel
+enum file_sync_policy_t {
+  SYNC_NONE,      // nothing
+  SYNC_WRITEBACK, // start writeback of the new data, without waiting
+  SYNC_DATA       // fdatasync
+};
+
 class FileInterface {
  public:
   FileInterface(const std::string& name, bool framed);
@@ -33,6 +60,10 @@ class FileInterface {
                                                               const std::string& name,
                                                               bool framed = false);
   static std::vector<std::string> list(const std::string& path, const std::string& fsType);
+  // Replaces the contents of a small local file such that after a crash
+  // it has either the old or the new contents
+  static bool replaceLocalFile(const std::string& name,
+                               const std::string& contents);
 
   virtual bool openRead() = 0;
   virtual bool openWrite() = 0;
@@ -40,25 +71,59 @@ class FileInterface {
   virtual bool isOpen() = 0;
   virtual void close() = 0;
   virtual bool write(const std::string& data) = 0;
+  // Writes the buffers as if they were one. The default copies them into
+  // a string for write().
+  virtual bool writev(const struct iovec* iov, int iovcnt);
   virtual bool flush() = 0;
   virtual unsigned long fileSize() = 0;
   virtual long readNext(std::string& _return) = 0;
+  // Reads up to length bytes as they are in the file, ignoring frames.
+  // Returns how many were read, 0 at the end of the file, or -1.
+  virtual long readRaw(char* data, unsigned long length);
+  // Offset of the next readRaw(), and moving it. Only needed by files that
+  // read checksummed frames with readChecksummedFrame().
+  virtual long tellRaw();
+  virtual bool seekRaw(unsigned long offset);
   virtual void deleteFile() = 0;
   virtual void listImpl(const std::string& path, std::vector<std::string>& _return) = 0;
   virtual std::string getFrame(unsigned data_size) {return std::string();};
+  // Frame for data made of the buffers. Checksummed if setFrameChecksum()
+  // asked for it, continued marks the frame as part of the previous record.
+  virtual std::string getFrame(const struct iovec* iov, int iovcnt,
+                               bool continued = false);
+  virtual void setFrameChecksum(bool checksum);
   virtual bool createDirectory(std::string path) = 0;
   virtual bool createSymlink(std::string oldpath, std::string newpath) = 0;
   virtual void setShouldLZOCompress(int compressionLevel);
   virtual void setShouldLogCalls(bool must_log);
+  // ignored by files that can't preallocate or control syncing
+  virtual void setPreallocateSize(unsigned long size);
+  virtual void setSyncPolicy(file_sync_policy_t policy);
+
+  // The first 4 bytes of a frame say whether it is checksummed
+  static bool isChecksummedFrame(const char* header);
+  // Checks a checksummed frame header, and gets the length from it
+  static bool parseChecksummedHeader(const char* header, unsigned long* length);
+  static bool checkFrameData(const char* header, const char* data,
+                             unsigned long length);
+  // Offset of the first good checksummed header in buffer that starts a
+  // record, or -1 if there is none
+  static long findChecksummedFrame(const char* buffer, unsigned long length);
 
  protected:
   bool framed;
+  bool frameChecksum;
   std::string filename;
   int LZOCompressionLevel;
   bool log_calls;
+  unsigned long preallocateSize;
+  file_sync_policy_t syncPolicy;
 
   unsigned unserializeUInt(const char* buffer);
   void serializeUInt(unsigned data, char* buffer);
+
+  long readChecksummedFrame(const char* length, std::string& _return);
+  unsigned long skipDamagedFrame(unsigned long offset);
 };
 
 class StdFile : public FileInterface {
@@ -72,9 +137,13 @@ class StdFile : public FileInterface {
   bool isOpen();
   void close();
   bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
   bool flush();
   unsigned long fileSize();
   long readNext(std::string& _return);
+  long readRaw(char* data, unsigned long length);
+  long tellRaw();
+  bool seekRaw(unsigned long offset);
   void deleteFile();
   void listImpl(const std::string& path, std::vector<std::string>& _return);
   std::string getFrame(unsigned data_size);
@@ -94,4 +163,94 @@ class StdFile : public FileInterface {
   StdFile& operator=(StdFile& rhs);
 };
 
+/*
+ * Local file on a plain file descriptor (fs_type=posix).
+ *
+ * Unlike StdFile it writes with write(2)/writev(2) and no stream buffer
+ * in between, keeps track of the size of the file it writes instead of
+ * asking the filesystem, can preallocate space for the file, and
+ * implements the sync policies.
+ */
+class PosixFile : public FileInterface {
+ public:
+  PosixFile(const std::string& name, bool framed);
+  virtual ~PosixFile();
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  bool isOpen();
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  unsigned long fileSize();
+  long readNext(std::string& _return);
+  long readRaw(char* data, unsigned long length);
+  long tellRaw();
+  bool seekRaw(unsigned long offset);
+  void deleteFile();
+  void listImpl(const std::string& path, std::vector<std::string>& _return);
+  std::string getFrame(unsigned data_size);
+  bool createDirectory(std::string path);
+  bool createSymlink(std::string newpath, std::string oldpath);
+
+ private:
+  bool open(int flags);
+  size_t read(char* data, size_t length);
+
+  int fd;
+  bool writing;
+  bool preallocated;
+  unsigned long size;       // of the file, while writing
+  unsigned long syncedSize; // passed to the sync policy so far
+
+  // buffered reads, see read()
+  char* inputBuffer;
+  size_t bufferStart;
+  size_t bufferEnd;
+  unsigned long readOffset;
+
+  // disallow copy, assignment, and empty construction
+  PosixFile();
+  PosixFile(PosixFile& rhs);
+  PosixFile& operator=(PosixFile& rhs);
+};
+
+/*
+ * Reads the frames of a local framed file through a read-only mapping of
+ * it, handing out each frame where it is in the mapping instead of
+ * copying it into a buffer first. Frames stay valid until close().
+ */
+class MappedFrameReader {
+ public:
+  explicit MappedFrameReader(const std::string& name);
+  ~MappedFrameReader();
+
+  bool open();
+  void close();
+
+  // Same contract as FileInterface::readNext(), but points data at the
+  // frame instead of copying it.
+  long next(const char** data);
+
+  // byte offset of the next frame
+  unsigned long tell() const { return offset; }
+  // start reading frames at offset, which must be the start of one
+  bool seek(unsigned long new_offset);
+
+ private:
+  long nextChecksummed(const char** data);
+
+  std::string filename;
+  char* mapping;
+  unsigned long size;
+  unsigned long offset;
+
+  // disallow copy, assignment, and empty construction
+  MappedFrameReader();
+  MappedFrameReader(MappedFrameReader& rhs);
+  MappedFrameReader& operator=(MappedFrameReader& rhs);
+};
+
 #endif // !defined SCRIBE_FILE_H
@@ -0,0 +1,159 @@
+#include "file_syncer.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// rounds with at least this many files use syncfs
+#define SYNCFS_MIN_FILES 4
+
+static pthread_mutex_t syncers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<dev_t, boost::shared_ptr<FileSyncer> > syncers;
+
+static void* syncerStatic(void* this_ptr) {
+  FileSyncer* syncer = (FileSyncer*)this_ptr;
+  syncer->threadMember();
+  return NULL;
+}
+
+boost::shared_ptr<FileSyncer> FileSyncer::get(const string& filename) {
+  // the file may not exist yet, its directory does
+  string dir = filename;
+  string::size_type slash = dir.find_last_of('/');
+  dir = slash == string::npos ? "." : (slash == 0 ? "/" : dir.substr(0, slash));
+
+  struct stat st;
+  dev_t device = stat(dir.c_str(), &st) == 0 ? st.st_dev : 0;
+
+  pthread_mutex_lock(&syncers_mutex);
+  boost::shared_ptr<FileSyncer>& syncer = syncers[device];
+  if (!syncer) {
+    syncer.reset(new FileSyncer(device));
+  }
+  boost::shared_ptr<FileSyncer> result = syncer;
+  pthread_mutex_unlock(&syncers_mutex);
+  return result;
+}
+
+FileSyncer::FileSyncer(dev_t device_)
+  : device(device_),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&pendingCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+
+  if (pthread_create(&syncThread, NULL, syncerStatic, (void*) this) != 0) {
+    throw std::runtime_error("failed to create file sync thread");
+  }
+}
+
+FileSyncer::~FileSyncer() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&pendingCond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(syncThread, NULL);
+
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&pendingCond);
+  pthread_cond_destroy(&doneCond);
+}
+
+// Must hold mutex
+boost::shared_ptr<FileSyncer::Request> FileSyncer::add(const string& filename) {
+  boost::shared_ptr<Request>& request = pending[filename];
+  if (!request) {
+    request.reset(new Request);
+    request->done = false;
+    request->success = false;
+    pthread_cond_signal(&pendingCond);
+  }
+  return request;
+}
+
+bool FileSyncer::sync(const string& filename) {
+  pthread_mutex_lock(&mutex);
+  boost::shared_ptr<Request> request = add(filename);
+  while (!request->done) {
+    pthread_cond_wait(&doneCond, &mutex);
+  }
+  bool success = request->success;
+  pthread_mutex_unlock(&mutex);
+  return success;
+}
+
+void FileSyncer::syncLater(const string& filename) {
+  pthread_mutex_lock(&mutex);
+  add(filename);
+  pthread_mutex_unlock(&mutex);
+}
+
+void FileSyncer::threadMember() {
+  pthread_mutex_lock(&mutex);
+  while (!stopping || !pending.empty()) {
+    if (pending.empty()) {
+      pthread_cond_wait(&pendingCond, &mutex);
+      continue;
+    }
+
+    // everything asked for while the last round ran goes in this one
+    request_map_t requests;
+    requests.swap(pending);
+    pthread_mutex_unlock(&mutex);
+
+    syncRound(requests);
+
+    pthread_mutex_lock(&mutex);
+    for (request_map_t::iterator iter = requests.begin();
+         iter != requests.end(); ++iter) {
+      iter->second->done = true;
+    }
+    pthread_cond_broadcast(&doneCond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Syncs the files of requests and sets whether that worked, the caller
+// marks them done.
+void FileSyncer::syncRound(const request_map_t& requests) {
+  bool use_syncfs = requests.size() >= SYNCFS_MIN_FILES;
+  int fs_result = -1;       // of syncfs, once it has been called
+
+  for (request_map_t::const_iterator iter = requests.begin();
+       iter != requests.end(); ++iter) {
+    int fd = open(iter->first.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // deleted already, nothing left to sync
+      iter->second->success = (errno == ENOENT);
+      if (!iter->second->success) {
+        LOG_OPER("failed to open file <%s> to sync it: %s",
+                 iter->first.c_str(), strerror(errno));
+      }
+      continue;
+    }
+
+    if (!use_syncfs) {
+      iter->second->success = (fdatasync(fd) == 0);
+      if (!iter->second->success) {
+        LOG_OPER("failed to sync file <%s>: %s",
+                 iter->first.c_str(), strerror(errno));
+      }
+    } else if (fs_result < 0) {
+      // the first file that opens stands in for the whole filesystem
+      fs_result = (syncfs(fd) == 0) ? 1 : 0;
+      if (fs_result == 0) {
+        LOG_OPER("failed to sync filesystem of <%s>: %s",
+                 iter->first.c_str(), strerror(errno));
+      }
+    }
+    ::close(fd);
+  }
+
+  if (use_syncfs) {
+    for (request_map_t::const_iterator iter = requests.begin();
+         iter != requests.end(); ++iter) {
+      iter->second->success = iter->second->success || fs_result == 1;
+    }
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef SCRIBE_FILE_SYNCER_H
+#define SCRIBE_FILE_SYNCER_H
+
+#include "common.h"
+
+/*
+ * Group commit of local files to disk, shared by all file stores that
+ * write to the same filesystem (see durability in scribe.conf).
+ *
+ * Stores hand over the names of files they have written to and either
+ * wait for them to be synced or not. A single thread per filesystem
+ * collects everything handed over while it was busy and syncs it in one
+ * round, so stores that ask at the same time share the cost. A round with
+ * a few files fdatasyncs each of them, a round with many files does one
+ * syncfs for the whole filesystem instead.
+ *
+ * Files are opened again by name to sync them, so callers don't need to
+ * keep them open and must flush anything they buffer themselves first.
+ */
+class FileSyncer {
+ public:
+  // The syncer for the filesystem that holds filename, created on first use
+  static boost::shared_ptr<FileSyncer> get(const std::string& filename);
+
+  ~FileSyncer();
+
+  // Returns once filename has been synced by a round started after this
+  // call, false if that failed.
+  bool sync(const std::string& filename);
+  // Sync filename in the next round without waiting for it
+  void syncLater(const std::string& filename);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  struct Request {
+    bool done;
+    bool success;
+  };
+  typedef std::map<std::string, boost::shared_ptr<Request> > request_map_t;
+
+  explicit FileSyncer(dev_t device);
+  boost::shared_ptr<Request> add(const std::string& filename);
+  void syncRound(const request_map_t& requests);
+
+  dev_t device;
+  request_map_t pending;       // for the next round
+  bool stopping;
+  pthread_t syncThread;
+  pthread_mutex_t mutex;       // Must be held to read/modify pending
+  pthread_cond_t pendingCond;  // signaled when something is added
+  pthread_cond_t doneCond;     // signaled when a round is done
+
+  // disallow copy and assignment
+  FileSyncer(const FileSyncer& rhs);
+  FileSyncer& operator=(const FileSyncer& rhs);
+};
+
+#endif // !defined SCRIBE_FILE_SYNCER_H
@@ -0,0 +1,119 @@
+#include "file_worker.h"
+
+using namespace std;
+using boost::shared_ptr;
+
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shared_ptr<FileWorker> worker;
+
+static void* workerStatic(void* this_ptr) {
+  FileWorker* file_worker = (FileWorker*)this_ptr;
+  file_worker->threadMember();
+  return NULL;
+}
+
+shared_ptr<FileWorker> FileWorker::get() {
+  pthread_mutex_lock(&worker_mutex);
+  if (!worker) {
+    worker.reset(new FileWorker());
+  }
+  shared_ptr<FileWorker> result = worker;
+  pthread_mutex_unlock(&worker_mutex);
+  return result;
+}
+
+FileWorker::FileWorker()
+  : stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&taskCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+
+  if (pthread_create(&workerThread, NULL, workerStatic, (void*) this) != 0) {
+    throw std::runtime_error("failed to create file worker thread");
+  }
+}
+
+FileWorker::~FileWorker() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&taskCond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(workerThread, NULL);
+
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&taskCond);
+  pthread_cond_destroy(&doneCond);
+}
+
+void FileWorker::submit(shared_ptr<FileTask> task) {
+  pthread_mutex_lock(&mutex);
+  tasks.push_back(task);
+  pthread_cond_signal(&taskCond);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool FileWorker::isDone(shared_ptr<FileTask> task) {
+  pthread_mutex_lock(&mutex);
+  bool done = task->done;
+  pthread_mutex_unlock(&mutex);
+  return done;
+}
+
+void FileWorker::wait(shared_ptr<FileTask> task) {
+  pthread_mutex_lock(&mutex);
+  while (!task->done) {
+    pthread_cond_wait(&doneCond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void FileWorker::threadMember() {
+  pthread_mutex_lock(&mutex);
+  while (!stopping || !tasks.empty()) {
+    if (tasks.empty()) {
+      pthread_cond_wait(&taskCond, &mutex);
+      continue;
+    }
+
+    shared_ptr<FileTask> task = tasks.front();
+    tasks.pop_front();
+    pthread_mutex_unlock(&mutex);
+
+    try {
+      task->run();
+    } catch (const std::exception& e) {
+      LOG_OPER("Exception < %s > in background file operation", e.what());
+    }
+
+    pthread_mutex_lock(&mutex);
+    task->done = true;
+    pthread_cond_broadcast(&doneCond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void OpenFileTask::run() {
+  success = true;
+  for (vector<string>::iterator iter = directories.begin();
+       success && iter != directories.end(); ++iter) {
+    success = file->createDirectory(*iter);
+  }
+  success = success && file->openWrite();
+}
+
+void CloseFileTask::run() {
+  file->flush();
+  bool empty = deleteIfEmpty && file->fileSize() == 0;
+  file->close();
+  if (empty) {
+    file->deleteFile();
+  }
+}
+
+void AppendFileTask::run() {
+  success = file->createDirectory(directory) && file->openWrite();
+  if (success) {
+    success = file->write(data);
+    file->close();
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef SCRIBE_FILE_WORKER_H
+#define SCRIBE_FILE_WORKER_H
+
+#include "common.h"
+#include "file.h"
+
+#include <deque>
+
+// A slow file operation for the FileWorker
+class FileTask {
+ public:
+  FileTask() : done(false) {}
+  virtual ~FileTask() {}
+  virtual void run() = 0;
+
+ private:
+  friend class FileWorker;
+  bool done;                    // protected by the worker's mutex
+};
+
+/*
+ * Thread that does the slow parts of rotating files for file stores with
+ * background_rotation, so the store threads don't wait for them: opening
+ * the next file ahead of time, closing the old one and writing stats.
+ * Closing an HDFS file in particular can take seconds.
+ *
+ * Tasks run one at a time in the order they were submitted, so a store
+ * that closes a file and then waits for a later task knows the close is
+ * done too. Tasks left when the process exits still run.
+ */
+class FileWorker {
+ public:
+  // the worker shared by all stores, started on first use
+  static boost::shared_ptr<FileWorker> get();
+
+  ~FileWorker();
+
+  void submit(boost::shared_ptr<FileTask> task);
+  bool isDone(boost::shared_ptr<FileTask> task);
+  void wait(boost::shared_ptr<FileTask> task);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  FileWorker();
+
+  std::deque<boost::shared_ptr<FileTask> > tasks;
+  bool stopping;
+  pthread_t workerThread;
+  pthread_mutex_t mutex;        // Must be held to read/modify any of the above
+  pthread_cond_t taskCond;      // signaled when a task is submitted
+  pthread_cond_t doneCond;      // signaled when a task is done
+
+  // disallow copy and assignment
+  FileWorker(const FileWorker& rhs);
+  FileWorker& operator=(const FileWorker& rhs);
+};
+
+// Creates the directories and opens file for writing
+class OpenFileTask : public FileTask {
+ public:
+  OpenFileTask(boost::shared_ptr<FileInterface> file_,
+               const std::vector<std::string>& directories_)
+    : file(file_), directories(directories_), success(false) {}
+  void run();
+
+  boost::shared_ptr<FileInterface> file;
+  std::vector<std::string> directories;
+  bool success;
+};
+
+// Flushes and closes file, and deletes it if it is empty and should be
+class CloseFileTask : public FileTask {
+ public:
+  CloseFileTask(boost::shared_ptr<FileInterface> file_, bool delete_if_empty)
+    : file(file_), deleteIfEmpty(delete_if_empty) {}
+  void run();
+
+  boost::shared_ptr<FileInterface> file;
+  bool deleteIfEmpty;
+};
+
+// Appends data to a file, creating its directory first
+class AppendFileTask : public FileTask {
+ public:
+  AppendFileTask(boost::shared_ptr<FileInterface> file_,
+                 const std::string& directory_, const std::string& data_)
+    : file(file_), directory(directory_), data(data_), success(false) {}
+  void run();
+
+  boost::shared_ptr<FileInterface> file;
+  std::string directory;
+  std::string data;
+  bool success;
+};
+
+#endif // !defined SCRIBE_FILE_WORKER_H
@@ -0,0 +1,216 @@
+#include "file.h"
+#include "compressed_file.h"
+#include "test_util.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+// A category frame followed by a continued message frame, like buffer
+// files with checksummed frames hold for every message
+struct TestRecord {
+    std::string category;
+    std::string message;
+    unsigned long offset; // where the category frame starts
+    unsigned long size;   // of both frames
+};
+
+// records with damage, see makeFile()
+enum {
+    DAMAGED_CATEGORY = 2,
+    DAMAGED_MESSAGE = 5,
+    DAMAGED_HEADER = 8,
+    RECORD_COUNT = 10
+};
+
+class FrameResyncTest : public TempDirTestCase {
+public:
+    CPPUNIT_TEST_SUITE(FrameResyncTest);
+    CPPUNIT_TEST(testFindFrame);
+    CPPUNIT_TEST(testStdFile);
+    CPPUNIT_TEST(testPosixFile);
+    CPPUNIT_TEST(testCompressedFile);
+    CPPUNIT_TEST(testMappedReader);
+    CPPUNIT_TEST_SUITE_END();
+
+    std::vector<TestRecord> records;
+
+    // Frames for all the records, with the category of one, the message
+    // of another and the header of a third one damaged. The damaged
+    // message is larger than any of the readers' buffers.
+    std::string makeFile() {
+        boost::shared_ptr<FileInterface> framer =
+            FileInterface::createFileInterface("std", path + "/framer", true);
+        framer->setFrameChecksum(true);
+
+        std::string data;
+        records.clear();
+        for (int i = 0; i < RECORD_COUNT; ++i) {
+            TestRecord record;
+            record.category = "category\n";
+            record.message = makeMessage(i);
+            if (i == DAMAGED_MESSAGE) {
+                record.message += std::string(200 * 1000, 'x');
+            }
+            record.offset = data.size();
+            data += frame(framer, record.category, false);
+            data += frame(framer, record.message, true);
+            record.size = data.size() - record.offset;
+            records.push_back(record);
+        }
+
+        data[records[DAMAGED_CATEGORY].offset +
+             CHECKSUMMED_FRAME_HEADER_SIZE] ^= 1;
+        data[records[DAMAGED_MESSAGE].offset + records[DAMAGED_MESSAGE].size -
+             1] ^= 1;
+        data[records[DAMAGED_HEADER].offset] ^= 1;
+        return data;
+    }
+
+    std::string frame(boost::shared_ptr<FileInterface> framer,
+                      const std::string& data, bool continued) {
+        struct iovec iov;
+        iov.iov_base = (void*)data.data();
+        iov.iov_len = data.size();
+        return framer->getFrame(&iov, 1, continued) + data;
+    }
+
+    // Expects every record but the damaged ones, each of those read as
+    // exactly its own size lost. What comes before the damaged message
+    // is read as usual.
+    void assertResynced(const std::vector<long>& results,
+                        const std::vector<std::string>& frames) {
+        size_t next = 0;
+        for (int i = 0; i < RECORD_COUNT; ++i) {
+            const TestRecord& record = records[i];
+            CPPUNIT_ASSERT(next < results.size());
+            if (i == DAMAGED_CATEGORY || i == DAMAGED_HEADER) {
+                CPPUNIT_ASSERT_EQUAL(-(long)record.size, results[next++]);
+                continue;
+            }
+
+            CPPUNIT_ASSERT_EQUAL(record.category, frames[next]);
+            CPPUNIT_ASSERT_EQUAL((long)record.category.size(), results[next++]);
+            CPPUNIT_ASSERT(next < results.size());
+            if (i == DAMAGED_MESSAGE) {
+                long lost = record.size - CHECKSUMMED_FRAME_HEADER_SIZE -
+                    record.category.size();
+                CPPUNIT_ASSERT_EQUAL(-lost, results[next++]);
+            } else {
+                CPPUNIT_ASSERT_EQUAL(record.message, frames[next]);
+                CPPUNIT_ASSERT_EQUAL((long)record.message.size(),
+                                     results[next++]);
+            }
+        }
+        CPPUNIT_ASSERT_EQUAL(next, results.size());
+    }
+
+    void writeFile(boost::shared_ptr<FileInterface> file,
+                   const std::string& data) {
+        CPPUNIT_ASSERT(file->openWrite());
+        CPPUNIT_ASSERT(file->write(data));
+        CPPUNIT_ASSERT(file->flush());
+        file->close();
+    }
+
+    void readFile(boost::shared_ptr<FileInterface> file) {
+        std::vector<long> results;
+        std::vector<std::string> frames;
+        CPPUNIT_ASSERT(file->openRead());
+        long result;
+        std::string frame;
+        while ((result = file->readNext(frame)) != 0) {
+            results.push_back(result);
+            frames.push_back(frame);
+        }
+        file->close();
+        assertResynced(results, frames);
+    }
+
+    void testFindFrame() {
+        std::string data = makeFile();
+
+        // only good headers of frames that start a record are found
+        const TestRecord& damaged = records[DAMAGED_CATEGORY];
+        CPPUNIT_ASSERT_EQUAL((long)damaged.size,
+                             FileInterface::findChecksummedFrame(
+                               data.data() + damaged.offset + 1,
+                               data.size() - damaged.offset - 1) + 1);
+        const TestRecord& header = records[DAMAGED_HEADER];
+        CPPUNIT_ASSERT_EQUAL((long)header.size,
+                             FileInterface::findChecksummedFrame(
+                               data.data() + header.offset,
+                               data.size() - header.offset));
+
+        // nor a header cut short
+        const TestRecord& last = records[RECORD_COUNT - 1];
+        CPPUNIT_ASSERT_EQUAL(-1L, FileInterface::findChecksummedFrame(
+                               data.data() + last.offset,
+                               CHECKSUMMED_FRAME_HEADER_SIZE - 1));
+        CPPUNIT_ASSERT_EQUAL(-1L, FileInterface::findChecksummedFrame(
+                               data.data() + last.offset + 1,
+                               data.size() - last.offset - 1));
+    }
+
+    void testStdFile() {
+        std::string data = makeFile();
+        std::string name = path + "/file";
+        writeFile(FileInterface::createFileInterface("std", name, true), data);
+        readFile(FileInterface::createFileInterface("std", name, true));
+    }
+
+    void testPosixFile() {
+        std::string data = makeFile();
+        std::string name = path + "/file";
+        writeFile(FileInterface::createFileInterface("posix", name, true),
+                  data);
+        readFile(FileInterface::createFileInterface("posix", name, true));
+    }
+
+    void testCompressedFile() {
+        std::string data = makeFile();
+        std::string name = path + "/file.gz";
+        writeFile(makeCompressedFile(name), data);
+        readFile(makeCompressedFile(name));
+    }
+
+    boost::shared_ptr<FileInterface> makeCompressedFile(
+        const std::string& name) {
+        boost::shared_ptr<FileInterface> raw =
+            FileInterface::createFileInterface("std", name, false);
+        return boost::shared_ptr<FileInterface>(
+            new CompressedFile(raw, name, "gzip", -1, 0, true));
+    }
+
+    void testMappedReader() {
+        std::string data = makeFile();
+        std::string name = path + "/file";
+        writeFile(FileInterface::createFileInterface("std", name, true), data);
+
+        std::vector<long> results;
+        std::vector<std::string> frames;
+        MappedFrameReader reader(name);
+        CPPUNIT_ASSERT(reader.open());
+        long result;
+        const char* frame = NULL;
+        while ((result = reader.next(&frame)) != 0) {
+            results.push_back(result);
+            frames.push_back(result > 0 ? std::string(frame, result) : "");
+        }
+        CPPUNIT_ASSERT_EQUAL((unsigned long)data.size(), reader.tell());
+        reader.close();
+        assertResynced(results, frames);
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(FrameResyncTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef SCRIBE_MPSC_RING_H
+#define SCRIBE_MPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer/single-consumer ring buffer.
+ *
+ * Every cell carries a sequence number that tells producers and the
+ * consumer whose turn it is to touch the cell, so a push costs one
+ * compare-and-swap on the enqueue position plus one release store, and
+ * a pop costs one release store. push() never blocks; it returns false
+ * when the ring is full and leaves it to the caller to decide whether to
+ * wait or to do something else with the item.
+ *
+ * pop() must only ever be called by one thread at a time; callers that
+ * share the consumer role have to serialize it with a lock of their own.
+ */
+template <typename T>
+class MpscRing {
+ public:
+  // capacity is rounded up to the next power of two
+  explicit MpscRing(size_t capacity)
+    : mask(roundUp(capacity) - 1),
+      enqueuePos(0),
+      dequeuePos(0) {
+    cells = new Cell[mask + 1];
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].sequence = i;
+    }
+  }
+
+  ~MpscRing() {
+    delete[] cells;
+  }
+
+  bool push(const T& item) {
+    size_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    Cell* cell;
+    for (;;) {
+      cell = &cells[pos & mask];
+      size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+        // pos was reloaded by the failed compare-and-swap
+      } else if (dif < 0) {
+        // the consumer has not freed this cell yet
+        return false;
+      } else {
+        pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+      }
+    }
+    cell->data = item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // one consumer at a time
+  bool pop(T& item) {
+    Cell* cell = &cells[dequeuePos & mask];
+    size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if ((intptr_t)seq - (intptr_t)(dequeuePos + 1) < 0) {
+      // empty, or the producer that claimed this cell is still writing it
+      return false;
+    }
+    item = cell->data;
+    cell->data = T();
+    __atomic_store_n(&cell->sequence, dequeuePos + mask + 1, __ATOMIC_RELEASE);
+    ++dequeuePos;
+    return true;
+  }
+
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+ private:
+  struct Cell {
+    size_t sequence;
+    T data;
+  };
+
+  static size_t roundUp(size_t n) {
+    size_t size = 2;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  // keep producer and consumer positions on separate cache lines
+  enum { CACHE_LINE_SIZE = 64 };
+
+  const size_t mask;
+  Cell* cells;
+  char pad0[CACHE_LINE_SIZE];
+  size_t enqueuePos;
+  char pad1[CACHE_LINE_SIZE];
+  size_t dequeuePos;
+
+  // disallow copy and assignment
+  MpscRing(const MpscRing& rhs);
+  MpscRing& operator=(const MpscRing& rhs);
+};
+
+#endif // !defined SCRIBE_MPSC_RING_H
@@ -0,0 +1,129 @@
+#include "mpsc_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#define PRODUCERS 4
+#define ITEMS_PER_PRODUCER 100000
+
+static MpscRing<unsigned long>* sharedRing;
+
+// Pushes producer * ITEMS_PER_PRODUCER + i for every i, in order
+static void* produce(void* arg) {
+    unsigned long producer = (unsigned long)arg;
+    for (unsigned long i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+        while (!sharedRing->push(producer * ITEMS_PER_PRODUCER + i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+class MpscRingTest : public CppUnit::TestCase {
+public:
+    CPPUNIT_TEST_SUITE(MpscRingTest);
+    CPPUNIT_TEST(testCapacity);
+    CPPUNIT_TEST(testOrder);
+    CPPUNIT_TEST(testFull);
+    CPPUNIT_TEST(testWrapAround);
+    CPPUNIT_TEST(testProducers);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testCapacity() {
+        CPPUNIT_ASSERT_EQUAL((size_t)2, MpscRing<int>(0).capacity());
+        CPPUNIT_ASSERT_EQUAL((size_t)8, MpscRing<int>(8).capacity());
+        CPPUNIT_ASSERT_EQUAL((size_t)16, MpscRing<int>(9).capacity());
+    }
+
+    void testOrder() {
+        MpscRing<int> ring(8);
+        int item = -1;
+        CPPUNIT_ASSERT(!ring.pop(item));
+        for (int i = 0; i < 5; ++i) {
+            CPPUNIT_ASSERT(ring.push(i));
+        }
+        for (int i = 0; i < 5; ++i) {
+            CPPUNIT_ASSERT(ring.pop(item));
+            CPPUNIT_ASSERT_EQUAL(i, item);
+        }
+        CPPUNIT_ASSERT(!ring.pop(item));
+    }
+
+    void testFull() {
+        MpscRing<int> ring(4);
+        for (int i = 0; i < 4; ++i) {
+            CPPUNIT_ASSERT(ring.push(i));
+        }
+        CPPUNIT_ASSERT(!ring.push(4));
+
+        int item;
+        CPPUNIT_ASSERT(ring.pop(item));
+        CPPUNIT_ASSERT_EQUAL(0, item);
+        CPPUNIT_ASSERT(ring.push(4));
+        CPPUNIT_ASSERT(!ring.push(5));
+    }
+
+    void testWrapAround() {
+        MpscRing<int> ring(4);
+        int item;
+        for (int i = 0; i < 1000; ++i) {
+            CPPUNIT_ASSERT(ring.push(i));
+            CPPUNIT_ASSERT(ring.push(-i));
+            CPPUNIT_ASSERT(ring.pop(item));
+            CPPUNIT_ASSERT_EQUAL(i, item);
+            CPPUNIT_ASSERT(ring.pop(item));
+            CPPUNIT_ASSERT_EQUAL(-i, item);
+        }
+    }
+
+    void testProducers() {
+        // everything arrives once, and in order for each producer
+        MpscRing<unsigned long> ring(64);
+        sharedRing = &ring;
+
+        pthread_t producers[PRODUCERS];
+        for (unsigned long i = 0; i < PRODUCERS; ++i) {
+            CPPUNIT_ASSERT_EQUAL(0, pthread_create(&producers[i], NULL,
+                                                   produce, (void*)i));
+        }
+
+        std::vector<unsigned long> next(PRODUCERS, 0);
+        unsigned long received = 0;
+        while (received < PRODUCERS * ITEMS_PER_PRODUCER) {
+            unsigned long item;
+            if (!ring.pop(item)) {
+                sched_yield();
+                continue;
+            }
+            unsigned long producer = item / ITEMS_PER_PRODUCER;
+            CPPUNIT_ASSERT(producer < PRODUCERS);
+            CPPUNIT_ASSERT_EQUAL(next[producer], item % ITEMS_PER_PRODUCER);
+            ++next[producer];
+            ++received;
+        }
+
+        for (int i = 0; i < PRODUCERS; ++i) {
+            pthread_join(producers[i], NULL);
+        }
+        unsigned long item;
+        CPPUNIT_ASSERT(!ring.pop(item));
+        sharedRing = NULL;
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MpscRingTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
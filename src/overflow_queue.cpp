@@ -0,0 +1,242 @@
+#include "overflow_queue.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+#define CATEGORY_LENGTH_SIZE 4
+
+OverflowQueue::OverflowQueue(const string& path_, const string& base_name,
+                             unsigned long long segment_size)
+  : path(path_),
+    baseName(base_name),
+    segmentSize(segment_size),
+    writeSeq(0),
+    writeBytes(0),
+    nextSeq(0) {
+  recoverSegments();
+}
+
+OverflowQueue::~OverflowQueue() {
+  // whatever is left stays on disk for the next run
+  if (writer) {
+    writer->flush();
+    writer->close();
+  }
+  if (reader) {
+    reader->close();
+  }
+}
+
+string OverflowQueue::segmentName(unsigned long seq) const {
+  ostringstream name;
+  name << path << '/' << baseName << "_overflow_"
+       << setw(5) << setfill('0') << seq;
+  return name.str();
+}
+
+void OverflowQueue::recoverSegments() {
+  string prefix = baseName + "_overflow_";
+  vector<string> files = FileInterface::list(path, "std");
+
+  for (vector<string>::iterator iter = files.begin();
+       iter != files.end(); ++iter) {
+    if (iter->compare(0, prefix.size(), prefix) != 0 ||
+        iter->size() == prefix.size()) {
+      continue;
+    }
+    char* end;
+    unsigned long seq = strtoul(iter->c_str() + prefix.size(), &end, 10);
+    if (*end != '\0') {
+      continue;
+    }
+    segments.push_back(seq);
+    nextSeq = max(nextSeq, seq + 1);
+  }
+
+  if (!segments.empty()) {
+    sort(segments.begin(), segments.end());
+    LOG_OPER("[%s] found %lu overflow segments in <%s> from an earlier run",
+             baseName.c_str(), segments.size(), path.c_str());
+  }
+}
+
+bool OverflowQueue::empty() const {
+  return segments.empty() && !reader && writeBytes == 0;
+}
+
+// Either all of the entries are appended or none of them are, since the
+// caller keeps all of them in memory when this fails.
+bool OverflowQueue::append(const logentry_vector_t& entries) {
+  if (!writer && !openWriter()) {
+    return false;
+  }
+
+  unsigned long long start = writeBytes;
+  bool success = true;
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       success && iter != entries.end(); ++iter) {
+    success = appendOne(*iter);
+  }
+  if (success && !writer->flush()) {
+    LOG_OPER("[%s] failed to flush overflow segment <%s>",
+             baseName.c_str(), segmentName(writeSeq).c_str());
+    success = false;
+  }
+  if (!success) {
+    abortAppend(start);
+    return false;
+  }
+
+  if (writeBytes >= segmentSize) {
+    closeWriter();
+  }
+  return true;
+}
+
+bool OverflowQueue::append(const logentry_ptr_t& entry) {
+  return append(logentry_vector_t(1, entry));
+}
+
+bool OverflowQueue::appendOne(const logentry_ptr_t& entry) {
+  unsigned category_length = entry->category.size();
+  string data;
+  data.reserve(CATEGORY_LENGTH_SIZE + entry->category.size() +
+               entry->message.size());
+  for (int i = CATEGORY_LENGTH_SIZE - 1; i >= 0; --i) {
+    data.push_back((char)((category_length >> (i * 8)) & 0xff));
+  }
+  data.append(entry->category);
+  data.append(entry->message);
+
+  string frame = writer->getFrame(data.size());
+  if (!writer->write(frame) || !writer->write(data)) {
+    LOG_OPER("[%s] failed to write overflow segment <%s>",
+             baseName.c_str(), segmentName(writeSeq).c_str());
+    return false;
+  }
+
+  writeBytes += frame.size() + data.size();
+  return true;
+}
+
+// Cuts the segment being written back to its size before a failed append
+// and closes it, the stream can't be trusted after a failed write.
+void OverflowQueue::abortAppend(unsigned long long start) {
+  string name = segmentName(writeSeq);
+  writer->close();
+  if (truncate(name.c_str(), start) != 0) {
+    LOG_OPER("[%s] ERROR: failed to truncate overflow segment <%s>, messages "
+             "of a failed append may be read back twice: %s",
+             baseName.c_str(), name.c_str(), strerror(errno));
+  }
+  if (start > 0) {
+    segments.push_back(writeSeq);
+  } else {
+    writer->deleteFile();
+  }
+  writer.reset();
+  writeBytes = 0;
+}
+
+unsigned long long OverflowQueue::read(logentry_vector_t& entries,
+                                       unsigned long long max_bytes) {
+  unsigned long long bytes = 0;
+
+  while (bytes < max_bytes) {
+    if (!reader) {
+      if (segments.empty()) {
+        if (writeBytes == 0) {
+          break;
+        }
+        // everything else has been read, hand over the current segment
+        closeWriter();
+      }
+      if (!openReader()) {
+        continue;
+      }
+    }
+
+    string data;
+    long size = reader->readNext(data);
+    if (size <= 0) {
+      if (size < 0) {
+        LOG_OPER("[%s] lost %ld bytes reading overflow segment <%s>",
+                 baseName.c_str(), -size, segmentName(segments.front()).c_str());
+      }
+      closeReader();
+      continue;
+    }
+
+    unsigned category_length = 0;
+    if (data.size() >= CATEGORY_LENGTH_SIZE) {
+      for (int i = 0; i < CATEGORY_LENGTH_SIZE; ++i) {
+        category_length = (category_length << 8) | (unsigned char)data[i];
+      }
+    }
+    if (data.size() < CATEGORY_LENGTH_SIZE ||
+        data.size() - CATEGORY_LENGTH_SIZE < category_length) {
+      LOG_OPER("[%s] skipping corrupt message in overflow segment <%s>",
+               baseName.c_str(), segmentName(segments.front()).c_str());
+      continue;
+    }
+
+    logentry_ptr_t entry(new LogEntry);
+    entry->category = data.substr(CATEGORY_LENGTH_SIZE, category_length);
+    entry->message = data.substr(CATEGORY_LENGTH_SIZE + category_length);
+    bytes += entry->message.size();
+    entries.push_back(entry);
+  }
+  return bytes;
+}
+
+bool OverflowQueue::openWriter() {
+  writeSeq = nextSeq++;
+  writeBytes = 0;
+  writer = FileInterface::createFileInterface("std", segmentName(writeSeq),
+                                              true);
+  if (!writer || !writer->openWrite()) {
+    LOG_OPER("[%s] failed to open overflow segment <%s>",
+             baseName.c_str(), segmentName(writeSeq).c_str());
+    writer.reset();
+    return false;
+  }
+  return true;
+}
+
+void OverflowQueue::closeWriter() {
+  if (!writer) {
+    return;
+  }
+  writer->flush();
+  writer->close();
+  if (writeBytes > 0) {
+    segments.push_back(writeSeq);
+  } else {
+    writer->deleteFile();
+  }
+  writer.reset();
+  writeBytes = 0;
+}
+
+// Opens the oldest segment, dropping it if it can't be opened.
+bool OverflowQueue::openReader() {
+  reader = FileInterface::createFileInterface("std",
+                                              segmentName(segments.front()),
+                                              true);
+  if (!reader || !reader->openRead()) {
+    LOG_OPER("[%s] failed to open overflow segment <%s>, skipping it",
+             baseName.c_str(), segmentName(segments.front()).c_str());
+    reader.reset();
+    segments.pop_front();
+    return false;
+  }
+  return true;
+}
+
+// Done with the oldest segment, delete it.
+void OverflowQueue::closeReader() {
+  reader->close();
+  reader->deleteFile();
+  reader.reset();
+  segments.pop_front();
+}
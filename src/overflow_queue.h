@@ -0,0 +1,64 @@
+#ifndef SCRIBE_OVERFLOW_QUEUE_H
+#define SCRIBE_OVERFLOW_QUEUE_H
+
+#include "common.h"
+#include "file.h"
+
+/*
+ * Append-only on-disk queue of messages that a StoreQueue could not keep
+ * in memory.
+ *
+ * Messages are written as frames of <category length><category><message>
+ * to numbered segment files named <base name>_overflow_<number> in one
+ * directory, and read back in the order they were appended. A segment is
+ * only read once it has been closed for writing, so read() closes the
+ * segment being written when everything before it has been read. Segments
+ * are deleted once read. Segments left behind by an earlier run are found
+ * when the queue is created and read back first.
+ *
+ * Not thread safe, callers must serialize all calls.
+ */
+class OverflowQueue {
+ public:
+  OverflowQueue(const std::string& path, const std::string& base_name,
+                unsigned long long segment_size);
+  ~OverflowQueue();
+
+  // Appends all of the entries, or none of them if this returns false.
+  bool append(const logentry_vector_t& entries);
+  bool append(const logentry_ptr_t& entry);
+
+  // Appends messages to entries until at least max_bytes of messages have
+  // been read or the queue is empty. Returns the number of bytes read.
+  unsigned long long read(logentry_vector_t& entries,
+                          unsigned long long max_bytes);
+
+  bool empty() const;
+
+ private:
+  std::string segmentName(unsigned long seq) const;
+  void recoverSegments();
+  bool appendOne(const logentry_ptr_t& entry);
+  void abortAppend(unsigned long long start);
+  bool openWriter();
+  void closeWriter();
+  bool openReader();
+  void closeReader();
+
+  std::string path;
+  std::string baseName;
+  unsigned long long segmentSize;
+
+  std::deque<unsigned long> segments; // closed and not fully read, oldest first
+  boost::shared_ptr<FileInterface> reader; // open on segments.front()
+  boost::shared_ptr<FileInterface> writer;
+  unsigned long writeSeq;
+  unsigned long long writeBytes;      // written to writer so far
+  unsigned long nextSeq;
+
+  // disallow copy and assignment
+  OverflowQueue(const OverflowQueue& rhs);
+  OverflowQueue& operator=(const OverflowQueue& rhs);
+};
+
+#endif // !defined SCRIBE_OVERFLOW_QUEUE_H
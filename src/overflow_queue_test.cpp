@@ -0,0 +1,148 @@
+#include "overflow_queue.h"
+#include "test_util.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+class OverflowQueueTest : public TempDirTestCase {
+public:
+    CPPUNIT_TEST_SUITE(OverflowQueueTest);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testSegments);
+    CPPUNIT_TEST(testReadLimit);
+    CPPUNIT_TEST(testRecover);
+    CPPUNIT_TEST(testBaseNames);
+    CPPUNIT_TEST_SUITE_END();
+
+    unsigned long countFiles() {
+        return FileInterface::list(path, "std").size();
+    }
+
+    void testEmpty() {
+        OverflowQueue queue(path, "cat.0", 1024);
+        CPPUNIT_ASSERT(queue.empty());
+
+        logentry_vector_t entries;
+        CPPUNIT_ASSERT_EQUAL(0ULL, queue.read(entries, 1024));
+        CPPUNIT_ASSERT(entries.empty());
+    }
+
+    void testRoundTrip() {
+        OverflowQueue queue(path, "cat.0", 1024 * 1024);
+        logentry_vector_t written;
+        written.push_back(makeEntry("cat", "first"));
+        written.push_back(makeEntry("other", ""));
+        written.push_back(makeEntry("", "no category"));
+        CPPUNIT_ASSERT(queue.append(written));
+        CPPUNIT_ASSERT(queue.append(makeEntry("cat", "last")));
+        CPPUNIT_ASSERT(!queue.empty());
+
+        logentry_vector_t entries;
+        queue.read(entries, 1024 * 1024);
+        CPPUNIT_ASSERT(queue.empty());
+        written.push_back(makeEntry("cat", "last"));
+        assertEntries(written, entries);
+
+        // read segments are deleted
+        CPPUNIT_ASSERT_EQUAL(0UL, countFiles());
+    }
+
+    void testSegments() {
+        // every append fills a segment
+        OverflowQueue queue(path, "cat.0", 16);
+        for (int i = 0; i < 10; ++i) {
+            CPPUNIT_ASSERT(queue.append(makeEntry("cat", makeMessage(i))));
+        }
+        CPPUNIT_ASSERT_EQUAL(10UL, countFiles());
+
+        logentry_vector_t entries;
+        queue.read(entries, 1024 * 1024);
+        CPPUNIT_ASSERT_EQUAL((size_t)10, entries.size());
+        for (int i = 0; i < 10; ++i) {
+            CPPUNIT_ASSERT_EQUAL(makeMessage(i), entries[i]->message);
+        }
+        CPPUNIT_ASSERT(queue.empty());
+        CPPUNIT_ASSERT_EQUAL(0UL, countFiles());
+    }
+
+    void testReadLimit() {
+        OverflowQueue queue(path, "cat.0", 1024 * 1024);
+        for (int i = 0; i < 10; ++i) {
+            CPPUNIT_ASSERT(queue.append(makeEntry("cat", "0123456789")));
+        }
+
+        // stops once at least max_bytes of messages have been read
+        logentry_vector_t entries;
+        CPPUNIT_ASSERT_EQUAL(30ULL, queue.read(entries, 25));
+        CPPUNIT_ASSERT_EQUAL((size_t)3, entries.size());
+        CPPUNIT_ASSERT(!queue.empty());
+
+        // appending while reading goes after what is left
+        CPPUNIT_ASSERT(queue.append(makeEntry("cat", "last")));
+        entries.clear();
+        queue.read(entries, 1024 * 1024);
+        CPPUNIT_ASSERT_EQUAL((size_t)8, entries.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("last"), entries.back()->message);
+        CPPUNIT_ASSERT(queue.empty());
+    }
+
+    void testRecover() {
+        {
+            OverflowQueue queue(path, "cat.0", 32);
+            for (int i = 0; i < 5; ++i) {
+                CPPUNIT_ASSERT(queue.append(makeEntry("cat", makeMessage(i))));
+            }
+            logentry_vector_t entries;
+            queue.read(entries, 1);
+            CPPUNIT_ASSERT_EQUAL(makeMessage(0), entries[0]->message);
+        }
+
+        // a segment is only deleted once all of it has been read
+        OverflowQueue queue(path, "cat.0", 32);
+        CPPUNIT_ASSERT(!queue.empty());
+        CPPUNIT_ASSERT(queue.append(makeEntry("cat", "new")));
+
+        logentry_vector_t entries;
+        queue.read(entries, 1024 * 1024);
+        CPPUNIT_ASSERT(!entries.empty());
+        CPPUNIT_ASSERT_EQUAL(makeMessage(4), entries[entries.size() - 2]->message);
+        CPPUNIT_ASSERT_EQUAL(std::string("new"), entries.back()->message);
+        CPPUNIT_ASSERT(queue.empty());
+    }
+
+    void testBaseNames() {
+        // stores for the same category keep their messages apart
+        {
+            OverflowQueue first(path, "cat.0", 1024);
+            OverflowQueue second(path, "cat.1", 1024);
+            CPPUNIT_ASSERT(first.append(makeEntry("cat", "first")));
+            CPPUNIT_ASSERT(second.append(makeEntry("cat", "second")));
+        }
+
+        OverflowQueue second(path, "cat.1", 1024);
+        logentry_vector_t entries;
+        second.read(entries, 1024);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, entries.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("second"), entries[0]->message);
+
+        OverflowQueue first(path, "cat.0", 1024);
+        entries.clear();
+        first.read(entries, 1024);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, entries.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("first"), entries[0]->message);
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(OverflowQueueTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
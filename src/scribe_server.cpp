@@ -25,6 +25,8 @@ int debug_level = 0;
 #include "common.h"
 #include "scribe_server.h"
 #include "SourceConf.h"
+#include "store_scheduler.h"
+#include "compression_pool.h"
 #include <boost/foreach.hpp>
 
 using namespace apache::thrift::concurrency;
@@ -71,6 +73,16 @@ void scribeHandler::incCounter(string counter, long amount) {
   incrementCounter(counter, amount);
 }
 
+// Same as incCounter(category, counter, amount) without building the
+// counter name.
+void scribeHandler::incCounter(category_id_t category,
+                               CategoryTable::counter_t counter,
+                               long amount) {
+  incrementCounter(g_categoryTable.get(category).counterNames[counter],
+                   amount);
+  incrementCounter(CategoryTable::counterName(counter), amount);
+}
+
 void scribeHandler::setCounter(string counter, long amount) {
   FacebookBase::setCounter(counter, amount);
 }
@@ -138,6 +150,7 @@ int main(int argc, char **argv) {
 
     g_Handler = shared_ptr<scribeHandler>(new scribeHandler(port, config_file));
     g_Handler->initialize();
+    g_Handler->startStatusThread();
 
     scribe::startServer(); // never returns
 
@@ -159,22 +172,28 @@ scribeHandler::scribeHandler(unsigned long int server_port, const std::string& c
     configFilename(config_file),
     status(STARTING),
     statusDetails("initial state"),
-    numMsgLastSecond(0),
     maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
     maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
     maxConn(DEFAULT_MAX_CONN),
-    newThreadPerCategory(true)
+    newThreadPerCategory(true),
+    statusThreadRunning(false),
+    statusThreadStop(false)
 #ifdef USE_ZOOKEEPER
     , zkClient(NULL)        
 #endif
     {
-  time(&lastMsgTime);
   scribeHandlerLock = scribe::concurrency::createReadWriteMutex();
+  pthread_mutex_init(&statusThreadMutex, NULL);
+  pthread_cond_init(&statusThreadCond, NULL);
+  routes = category_routes_ptr_t(new CategoryRoutes);
 }
 
 scribeHandler::~scribeHandler() {
-  deleteCategoryMap(categories);
+  stopStatusThread();
+  clearCategories();
   deleteCategoryMap(category_prefixes);
+  pthread_mutex_destroy(&statusThreadMutex);
+  pthread_cond_destroy(&statusThreadCond);
 }
 
 // Returns the handler status, but overwrites it with WARNING if it's
@@ -185,8 +204,10 @@ fb_status scribeHandler::getStatus() {
 
   fb_status return_status(status);
   if (status == ALIVE) {
-    for (category_map_t::iterator cat_iter = categories.begin();
-        cat_iter != categories.end();
+    category_routes_ptr_t current_routes = boost::atomic_load(&routes);
+    for (category_map_t::const_iterator cat_iter =
+           current_routes->categories.begin();
+        cat_iter != current_routes->categories.end();
         ++cat_iter) {
       for (store_list_t::iterator store_iter = cat_iter->second->begin();
            store_iter != cat_iter->second->end();
@@ -215,8 +236,10 @@ void scribeHandler::getStatusDetails(std::string& _return) {
 
   _return = statusDetails;
   if (_return.empty()) {
-    for (category_map_t::iterator cat_iter = categories.begin();
-        cat_iter != categories.end();
+    category_routes_ptr_t current_routes = boost::atomic_load(&routes);
+    for (category_map_t::const_iterator cat_iter =
+           current_routes->categories.begin();
+        cat_iter != current_routes->categories.end();
         ++cat_iter) {
       for (store_list_t::iterator store_iter = cat_iter->second->begin();
           store_iter != cat_iter->second->end();
@@ -257,7 +280,8 @@ const char* scribeHandler::statusAsString(fb_status status) {
 }
 
 
-// Should be called while holding a writeLock on scribeHandlerLock
+// Should be called while holding categoryCreateMutex, or a writeLock on
+// scribeHandlerLock
 bool scribeHandler::createCategoryFromModel(
     const string &category, const boost::shared_ptr<StoreQueue> &model) {
 
@@ -291,42 +315,70 @@ bool scribeHandler::createCategoryFromModel(
              category.c_str(), model->getCategoryHandled().c_str());
   }
 
-  shared_ptr<store_list_t> pstores;
+  // readers may still be using the old list, so build a new one
+  shared_ptr<store_list_t> pstores(new store_list_t);
   category_map_t::iterator cat_iter = categories.find(category);
-  if (cat_iter == categories.end()) {
-    pstores = shared_ptr<store_list_t>(new store_list_t);
-    categories[category] = pstores;
-  } else {
-    pstores = cat_iter->second;
+  if (cat_iter != categories.end()) {
+    *pstores = *cat_iter->second;
   }
   pstores->push_back(pstore);
+  addCategory(category, pstores);
 
   return true;
 }
 
-void scribeHandler::setQueueSizeCounter(bool get_read_lock) {
-  if (get_read_lock) scribeHandlerLock->acquireRead();
-  unsigned long long queue_size = 0;
-  for (category_map_t::iterator cat_iter = categories.begin();
-      cat_iter != categories.end();
-      ++cat_iter) {
-    shared_ptr<store_list_t> pstores = cat_iter->second;
-    if (!pstores) {
-      throw std::logic_error("throttle check: iterator in category map holds null pointer");
-    }
-    for (store_list_t::iterator store_iter = pstores->begin();
-        store_iter != pstores->end();
-        ++store_iter) {
-      if (*store_iter == NULL) {
-        throw std::logic_error("throttle check: iterator in store map holds null pointer");
-      } else {
-        unsigned long long size = (*store_iter)->getSize();
-        queue_size += size;
-      }
+// The total is maintained by the store queues, so no lock is needed.
+// get_read_lock is only kept for existing callers.
+void scribeHandler::setQueueSizeCounter() {
+  g_Handler->setCounter("queue size", StoreQueue::getTotalSize());
+}
+
+void* statusThreadStatic(void* this_ptr) {
+  scribeHandler* handler_ptr = (scribeHandler*)this_ptr;
+  handler_ptr->statusThreadMember();
+  return NULL;
+}
+
+// Starts the thread that publishes counters every updateStatusInterval
+void scribeHandler::startStatusThread() {
+  pthread_mutex_lock(&statusThreadMutex);
+  if (!statusThreadRunning) {
+    statusThreadStop = false;
+    statusThreadRunning =
+      (0 == pthread_create(&statusThread, NULL, statusThreadStatic,
+                           (void*) this));
+    if (!statusThreadRunning) {
+      LOG_OPER("failed to create status thread");
     }
   }
-  g_Handler->setCounter("queue size", queue_size);
-  if (get_read_lock) scribeHandlerLock->release();
+  pthread_mutex_unlock(&statusThreadMutex);
+}
+
+void scribeHandler::stopStatusThread() {
+  pthread_mutex_lock(&statusThreadMutex);
+  bool running = statusThreadRunning;
+  statusThreadStop = true;
+  statusThreadRunning = false;
+  pthread_cond_signal(&statusThreadCond);
+  pthread_mutex_unlock(&statusThreadMutex);
+
+  if (running) {
+    pthread_join(statusThread, NULL);
+  }
+}
+
+void scribeHandler::statusThreadMember() {
+  pthread_mutex_lock(&statusThreadMutex);
+  while (!statusThreadStop) {
+    setQueueSizeCounter();
+
+    struct timespec abs_timeout;
+    abs_timeout.tv_sec = time(NULL) + updateStatusInterval;
+    abs_timeout.tv_nsec = 0;
+    pthread_cond_timedwait(&statusThreadCond, &statusThreadMutex,
+                           &abs_timeout);
+  }
+  pthread_mutex_unlock(&statusThreadMutex);
 }
 
 // Check if we need to deny this request due to throttling
@@ -354,8 +406,7 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
 
   // Deny messages if the total size of all queues, plus new messages,
   // would exceed maxQueueSize.
-  setQueueSizeCounter(false);
-  unsigned long long queue_size = getCounter("queue size");
+  unsigned long long queue_size = StoreQueue::getTotalSize();
   if ((queue_size + totalSize) > maxQueueSize) {
     LOG_OPER("Throttle denying <%lu> byte packet with <%lu> messages for queue size. ",
       totalSize, messages.size());
@@ -368,11 +419,22 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   return false;
 }
 
-// Should be called while holding a writeLock on scribeHandlerLock
+// Should be called while holding a readLock on scribeHandlerLock.
+// Other Log() calls keep routing with the current snapshot while the new
+// category's stores are being created, the new snapshot is published once
+// they are ready.
 shared_ptr<store_list_t> scribeHandler::createNewCategory(
     const string& category) {
 
-  shared_ptr<store_list_t> store_list;
+  Guard create_monitor(categoryCreateMutex);
+
+  // someone else may have created it while we waited for the mutex
+  category_id_t category_id;
+  shared_ptr<store_list_t> store_list =
+    findCategory(*boost::atomic_load(&routes), category, &category_id);
+  if (store_list != NULL) {
+    return store_list;
+  }
 
   // First, check the list of category prefixes for a model
   category_map_t::iterator cat_prefix_iter = category_prefixes.begin();
@@ -390,6 +452,12 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
 
       if (cat_iter != categories.end()) {
         store_list = cat_iter->second;
+        // all categories of a prefix share its limit
+        std::map<string, shared_ptr<CategoryRateLimit> >::iterator limit_iter =
+          prefixLimits.find(cat_prefix_iter->first);
+        if (limit_iter != prefixLimits.end()) {
+          setCategoryLimit(category, limit_iter->second);
+        }
       } else {
         LOG_OPER("failed to create new prefix store for category <%s>",
             category.c_str());
@@ -410,45 +478,104 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
     category_map_t::iterator cat_iter = categories.find(category);
     if (cat_iter != categories.end()) {
       store_list = cat_iter->second;
+      if (defaultLimit != NULL) {
+        setCategoryLimit(category, defaultLimit->clone());
+      }
     } else {
       LOG_OPER("failed to create new default store for category <%s>",
           category.c_str());
     }
   }
 
+  if (store_list != NULL) {
+    publishRoutes();
+  }
+
   return store_list;
 }
 
-// Add this message to every store in list
-void scribeHandler::addMessage(
+// Create the stores of every category that still has messages in the
+// write-ahead log of a model store, so they get replayed without waiting
+// for the category to show up again.
+void scribeHandler::createLoggedCategories() {
+  store_list_t models(defaultStores);
+  for (category_map_t::iterator cat_iter = category_prefixes.begin();
+       cat_iter != category_prefixes.end(); ++cat_iter) {
+    models.insert(models.end(), cat_iter->second->begin(),
+                  cat_iter->second->end());
+  }
+
+  set<string> logged;
+  for (store_list_t::iterator store_iter = models.begin();
+       store_iter != models.end(); ++store_iter) {
+    if ((*store_iter)->isModelStore()) {
+      vector<string> names = (*store_iter)->listLoggedCategories();
+      logged.insert(names.begin(), names.end());
+    }
+  }
+
+  for (set<string>::iterator iter = logged.begin();
+       iter != logged.end(); ++iter) {
+    category_id_t category_id;
+    if (findCategory(*boost::atomic_load(&routes), *iter, &category_id) == NULL &&
+        createNewCategory(*iter) != NULL) {
+      LOG_OPER("[%s] created category to replay its write-ahead log",
+               iter->c_str());
+    }
+  }
+}
+
+// Add this message to the batch of every store in list.
+// Returns false if the list has no stores.
+//
+// All stores share the same LogEntry. Stores treat the entries they are
+// handed as read-only, anything that needs a different category or
+// message (e.g. BucketStore) builds a new entry.
+bool scribeHandler::addMessage(
     const LogEntry& entry,
-    const shared_ptr<store_list_t>& store_list) {
+    const shared_ptr<store_list_t>& store_list,
+    queue_batch_map_t& batches) {
 
-  int numstores = 0;
+  if (store_list->empty()) {
+    return false;
+  }
+
+  boost::shared_ptr<LogEntry> ptr(new LogEntry);
+  ptr->category = entry.category;
+  ptr->message = entry.message;
 
   // Add message to store_list
   for (store_list_t::iterator store_iter = store_list->begin();
       store_iter != store_list->end();
       ++store_iter) {
-    ++numstores;
-    boost::shared_ptr<LogEntry> ptr(new LogEntry);
-    ptr->category = entry.category;
-    ptr->message = entry.message;
-
-    (*store_iter)->addMessage(ptr);
+    queue_batch_map_t::iterator batch_iter = batches.find(store_iter->get());
+    if (batch_iter == batches.end()) {
+      batch_iter = batches.insert(make_pair(store_iter->get(),
+                     make_pair(*store_iter, logentry_vector_t()))).first;
+    }
+    batch_iter->second.second.push_back(ptr);
   }
 
-  if (numstores) {
-    incCounter(entry.category, "received good");
-  } else {
-    incCounter(entry.category, "received bad");
-  }
+  return true;
 }
 
 
 ResultCode::type scribeHandler::Log(const vector<LogEntry>&  messages) {
   ResultCode::type result = ResultCode::TRY_LATER;
 
+  // Messages are only handed to the store queues once the whole request
+  // has been routed, so every queue is locked once per request.
+  queue_batch_map_t batches;
+  vector<pair<category_id_t, unsigned long> > received_good; // runs
+  vector<const LogEntry*> accepted;                         // for seqtest only
+  vector<RateLimitRun> rate_runs;
+  shared_ptr<store_list_t> store_list;
+  shared_ptr<CategoryRateLimit> limit;
+  const string* last_category = NULL;
+  category_id_t category_id = NO_CATEGORY_ID;
+  category_routes_ptr_t current_routes;
+  bool queued = true;
+
   scribeHandlerLock->acquireRead();
   if(status == STOPPING) {
     result = ResultCode::TRY_LATER;
@@ -460,6 +587,8 @@ ResultCode::type scribeHandler::Log(const vector<LogEntry>&  messages) {
     goto end;
   }
 
+  current_routes = boost::atomic_load(&routes);
+
   for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
       msg_iter != messages.end();
       ++msg_iter) {
@@ -472,34 +601,26 @@ ResultCode::type scribeHandler::Log(const vector<LogEntry>&  messages) {
       continue;
     }
 
-    shared_ptr<store_list_t> store_list;
-    string category = (*msg_iter).category;
+    const string& category = (*msg_iter).category;
 
-    category_map_t::iterator cat_iter;
-    // First look for an exact match of the category
-    if ((cat_iter = categories.find(category)) != categories.end()) {
-      store_list = cat_iter->second;
-    }
+    // clients usually send runs of the same category
+    if (last_category == NULL || *last_category != category) {
+      last_category = &category;
 
-    // Try creating a new store for this category if we didn't find one
-    if (store_list == NULL) {
-      // Need write lock to create a new category
-      scribeHandlerLock->release();
-      scribeHandlerLock->acquireWrite();
-
-      // This may cause some duplicate messages if some messages in this batch
-      // were already added to queues
-      if(status == STOPPING) {
-        result = ResultCode::TRY_LATER;
-        goto end;
-      }
+      // First look for an exact match of the category
+      store_list = findCategory(*current_routes, category, &category_id);
 
-      if ((cat_iter = categories.find(category)) != categories.end()) {
-        store_list = cat_iter->second;
-      } else {
+      // Try creating a new store for this category if we didn't find one
+      if (store_list == NULL) {
         store_list = createNewCategory(category);
+        current_routes = boost::atomic_load(&routes);
+        findCategory(*current_routes, category, &category_id);
       }
 
+      limit.reset();
+      if (category_id < current_routes->limitsById.size()) {
+        limit = current_routes->limitsById[category_id];
+      }
     }
 
     if (store_list == NULL) {
@@ -510,9 +631,63 @@ ResultCode::type scribeHandler::Log(const vector<LogEntry>&  messages) {
     }
 
     // Log this message
-    addMessage(*msg_iter, store_list);
+    if (!addMessage(*msg_iter, store_list, batches)) {
+      incCounter(category, "received bad");
+      continue;
+    }
+
+    if (category_id == NO_CATEGORY_ID) {
+      incCounter(category, "received good");
+    } else {
+      if (received_good.empty() ||
+          received_good.back().first != category_id) {
+        received_good.push_back(make_pair(category_id, 0UL));
+      }
+      ++received_good.back().second;
+    }
+
+    if (limit != NULL) {
+      if (rate_runs.empty() || rate_runs.back().category != category_id) {
+        RateLimitRun run = { limit, category_id, 0, 0 };
+        rate_runs.push_back(run);
+      }
+      ++rate_runs.back().messages;
+      rate_runs.back().bytes += msg_iter->message.size();
+    }
+
     if (! seqtestLogAccepts.empty())
-      seqtestAcceptsLogger.log(msg_iter->message);
+      accepted.push_back(&*msg_iter);
+  }
+
+  // All or nothing, the client will resend the whole request anyway
+  if (!rate_runs.empty() && !admitRequest(rate_runs)) {
+    result = ResultCode::TRY_LATER;
+    goto end;
+  }
+
+  // A queue that refuses its messages gets them again when the client
+  // resends the request, and so do the queues that took theirs.
+  for (queue_batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end(); ++batch_iter) {
+    if (!batch_iter->second.first->addMessages(batch_iter->second.second)) {
+      queued = false;
+    }
+  }
+  if (!queued) {
+    result = ResultCode::TRY_LATER;
+    goto end;
+  }
+
+  for (vector<pair<category_id_t, unsigned long> >::iterator good_iter =
+         received_good.begin();
+       good_iter != received_good.end(); ++good_iter) {
+    incCounter(good_iter->first, CategoryTable::RECEIVED_GOOD,
+               good_iter->second);
+  }
+
+  for (vector<const LogEntry*>::iterator accept_iter = accepted.begin();
+       accept_iter != accepted.end(); ++accept_iter) {
+    seqtestAcceptsLogger.log((*accept_iter)->message);
   }
 
   result = ResultCode::OK;
@@ -522,19 +697,59 @@ ResultCode::type scribeHandler::Log(const vector<LogEntry>&  messages) {
   return result;
 }
 
+// Takes what the request needs from every rate limit it touches.
+// Returns false and takes nothing if any of them is exhausted.
+bool scribeHandler::admitRequest(const vector<RateLimitRun>& runs) {
+  typedef map<CategoryRateLimit*, pair<unsigned long, unsigned long long> >
+    limit_totals_t;
+
+  // categories sharing a prefix limit are charged together
+  limit_totals_t totals;
+  for (vector<RateLimitRun>::const_iterator run_iter = runs.begin();
+       run_iter != runs.end(); ++run_iter) {
+    pair<unsigned long, unsigned long long>& total =
+      totals[run_iter->limit.get()];
+    total.first += run_iter->messages;
+    total.second += run_iter->bytes;
+  }
+
+  limit_totals_t::iterator total_iter;
+  for (total_iter = totals.begin(); total_iter != totals.end(); ++total_iter) {
+    if (!total_iter->first->tryAdmit(total_iter->second.first,
+                                     total_iter->second.second)) {
+      break;
+    }
+  }
+  if (total_iter == totals.end()) {
+    return true;
+  }
+
+  CategoryRateLimit* denied = total_iter->first;
+  for (limit_totals_t::iterator refund_iter = totals.begin();
+       refund_iter != total_iter; ++refund_iter) {
+    refund_iter->first->refund(refund_iter->second.first,
+                               refund_iter->second.second);
+  }
+
+  // per category counters count messages, the global one requests
+  for (vector<RateLimitRun>::const_iterator run_iter = runs.begin();
+       run_iter != runs.end(); ++run_iter) {
+    if (run_iter->limit.get() == denied) {
+      incrementCounter(g_categoryTable.get(run_iter->category).
+                         counterNames[CategoryTable::DENIED_FOR_RATE],
+                       run_iter->messages);
+    }
+  }
+  incCounter("denied for rate");
+  return false;
+}
+
 // Returns true if overloaded.
 // Allows a fixed number of messages per second.
 bool scribeHandler::throttleDeny(int num_messages) {
-  time_t now;
-  if (0 == maxMsgPerSecond)
+  if (msgRateBucket == NULL)
     return false;
 
-  time(&now);
-  if (now != lastMsgTime) {
-    lastMsgTime = now;
-    numMsgLastSecond = 0;
-  }
-
   // If we get a single huge packet it's not cool, but we'd better
   // accept it or we'll keep having to read it and deny it indefinitely
   if (num_messages > (int)maxMsgPerSecond/2) {
@@ -542,16 +757,81 @@ bool scribeHandler::throttleDeny(int num_messages) {
     return false;
   }
 
-  if (numMsgLastSecond + num_messages > maxMsgPerSecond) {
-    LOG_OPER("throttle denying request with <%d> messages. It would exceed max of <%lu> messages this second",
+  if (!msgRateBucket->tryConsume(num_messages)) {
+    LOG_OPER("throttle denying request with <%d> messages. It would exceed max of <%lu> messages per second",
         num_messages, maxMsgPerSecond);
     return true;
   } else {
-    numMsgLastSecond += num_messages;
     return false;
   }
 }
 
+shared_ptr<CategoryRateLimit> CategoryRateLimit::create(pStoreConf store_conf) {
+  unsigned long msgs_per_sec = 0;
+  unsigned long long bytes_per_sec = 0;
+  float burst_sec = 1.0;
+
+  store_conf->getUnsigned("rate_limit_msgs_per_sec", msgs_per_sec);
+  store_conf->getUnsignedLongLong("rate_limit_bytes_per_sec", bytes_per_sec);
+  store_conf->getFloat("rate_limit_burst_sec", burst_sec);
+
+  shared_ptr<CategoryRateLimit> limit;
+  if (msgs_per_sec == 0 && bytes_per_sec == 0) {
+    return limit;
+  }
+  if (burst_sec <= 0) {
+    burst_sec = 1.0;
+  }
+
+  limit = shared_ptr<CategoryRateLimit>(new CategoryRateLimit);
+  if (msgs_per_sec > 0) {
+    limit->msgBucket = shared_ptr<TokenBucket>(
+        new TokenBucket(msgs_per_sec, msgs_per_sec * burst_sec));
+  }
+  if (bytes_per_sec > 0) {
+    limit->byteBucket = shared_ptr<TokenBucket>(
+        new TokenBucket(bytes_per_sec, bytes_per_sec * burst_sec));
+  }
+  return limit;
+}
+
+shared_ptr<CategoryRateLimit> CategoryRateLimit::clone() const {
+  shared_ptr<CategoryRateLimit> limit(new CategoryRateLimit);
+  if (msgBucket != NULL) {
+    limit->msgBucket = shared_ptr<TokenBucket>(
+        new TokenBucket(msgBucket->getRate(), msgBucket->getBurst()));
+  }
+  if (byteBucket != NULL) {
+    limit->byteBucket = shared_ptr<TokenBucket>(
+        new TokenBucket(byteBucket->getRate(), byteBucket->getBurst()));
+  }
+  return limit;
+}
+
+bool CategoryRateLimit::tryAdmit(unsigned long messages,
+                                 unsigned long long bytes) {
+  if (msgBucket != NULL && !msgBucket->tryConsume(messages)) {
+    return false;
+  }
+  if (byteBucket != NULL && !byteBucket->tryConsume(bytes)) {
+    if (msgBucket != NULL) {
+      msgBucket->giveBack(messages);
+    }
+    return false;
+  }
+  return true;
+}
+
+void CategoryRateLimit::refund(unsigned long messages,
+                               unsigned long long bytes) {
+  if (msgBucket != NULL) {
+    msgBucket->giveBack(messages);
+  }
+  if (byteBucket != NULL) {
+    byteBucket->giveBack(bytes);
+  }
+}
+
 /*
  * Start all scribe sources.
  *
@@ -634,15 +914,21 @@ void scribeHandler::stopStores() {
     }
   }
   defaultStores.clear();
-  deleteCategoryMap(categories);
+  defaultLimit.reset();
+  clearCategories();
   deleteCategoryMap(category_prefixes);
+  prefixLimits.clear();
 
 }
 
 void scribeHandler::shutdown() {
+  stopStatusThread();
   RWGuard monitor(*scribeHandlerLock, true);
   stopSources();
   stopStores();
+  if (g_storeScheduler) {
+    g_storeScheduler->stop();
+  }
   if (! seqtestLogAccepts.empty())
     seqtestAcceptsLogger.flush(seqtestLogAccepts);
   if (0 != dbgMsgLog)
@@ -699,6 +985,12 @@ void scribeHandler::initialize() {
 
     // load the global config
     config.getUnsigned("max_msg_per_second", maxMsgPerSecond);
+    if (maxMsgPerSecond > 0) {
+      msgRateBucket = shared_ptr<TokenBucket>(
+          new TokenBucket(maxMsgPerSecond, maxMsgPerSecond));
+    } else {
+      msgRateBucket.reset();
+    }
     config.getUnsignedLongLong("max_queue_size", maxQueueSize);
     config.getUnsigned("check_interval", checkPeriod);
     config.getUnsigned("update_status_interval", updateStatusInterval);
@@ -721,6 +1013,43 @@ void scribeHandler::initialize() {
       newThreadPerCategory = true;
     }
 
+    // If store_thread_pool, StoreQueues share a fixed pool of threads
+    // instead of getting a thread each. All stores are stopped at this
+    // point, so it is safe to replace the pool.
+    unsigned long pool_size = 0;
+    temp.clear();
+    config.getString("store_thread_pool", temp);
+    if (temp == "yes") {
+      pool_size = sysconf(_SC_NPROCESSORS_ONLN);
+      config.getUnsigned("store_thread_pool_size", pool_size);
+      if (pool_size == 0) {
+        pool_size = 1;
+      }
+    }
+    if (g_storeScheduler &&
+        g_storeScheduler->getNumThreads() != pool_size) {
+      g_storeScheduler->stop();
+      g_storeScheduler.reset();
+    }
+    if (pool_size > 0 && !g_storeScheduler) {
+      g_storeScheduler =
+        shared_ptr<StoreScheduler>(new StoreScheduler(pool_size));
+      g_storeScheduler->start();
+    }
+
+    // compression_threads compress large batches of compressed file
+    // stores in parallel, see CompressedFile
+    unsigned long compression_threads = 0;
+    config.getUnsigned("compression_threads", compression_threads);
+    if (g_compressionPool &&
+        g_compressionPool->getNumThreads() != compression_threads) {
+      g_compressionPool.reset();
+    }
+    if (compression_threads > 0 && !g_compressionPool) {
+      g_compressionPool = shared_ptr<CompressionPool>(
+        new CompressionPool(compression_threads));
+    }
+
     unsigned long int old_port = port;
     config.getUnsigned("port", port);
     if (old_port != 0 && port != old_port) {
@@ -805,7 +1134,8 @@ void scribeHandler::initialize() {
         ++iter) {
       pStoreConf store_conf = (*iter);
 
-      bool success = configureStore(store_conf, &numstores);
+      bool success = configureStore(store_conf, iter - store_confs.begin(),
+                                    &numstores);
 
       if (!success) {
         perfect_config = false;
@@ -843,10 +1173,16 @@ void scribeHandler::initialize() {
   if (!enough_config_to_run) {
     // If the new configuration failed we'll run with
     // nothing configured and status set to WARNING
-    deleteCategoryMap(categories);
+    clearCategories();
     deleteCategoryMap(category_prefixes);
+    prefixLimits.clear();
   }
 
+  publishRoutes();
+
+  if (enough_config_to_run) {
+    createLoggedCategories();
+  }
 
   if (!perfect_config || !enough_config_to_run) {
     // perfect should be a subset of enough, but just in case
@@ -859,7 +1195,8 @@ void scribeHandler::initialize() {
 
 
 // Configures the store specified by the store configuration. Returns false if failed.
-bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
+bool scribeHandler::configureStore(pStoreConf store_conf, unsigned store_index,
+                                   int *numstores) {
   string category;
   shared_ptr<StoreQueue> pstore;
   vector<string> category_list;
@@ -895,7 +1232,8 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
   else if (single_category) {
     // configure single store
     shared_ptr<StoreQueue> result =
-        configureStoreCategory(store_conf, category_list[0], model);
+        configureStoreCategory(store_conf, store_index, category_list[0],
+                               model);
 
     if (result == NULL) {
       return false;
@@ -915,7 +1253,8 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
     }
 
     // create model so that we can create stores as copies of this model
-    model = configureStoreCategory(store_conf, categories, model, true);
+    model = configureStoreCategory(store_conf, store_index, categories, model,
+                                   true);
 
     if (model == NULL) {
       string errormsg("Bad config - could not create store for category: ");
@@ -928,7 +1267,7 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
     vector<string>::iterator iter;
     for (iter = category_list.begin(); iter < category_list.end(); iter++) {
       shared_ptr<StoreQueue> result =
-          configureStoreCategory(store_conf, *iter, model);
+          configureStoreCategory(store_conf, store_index, *iter, model);
 
       if (!result) {
         return false;
@@ -945,6 +1284,7 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
 // Configures the store specified by the store configuration and category.
 shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
     pStoreConf store_conf,                       //configuration for store
+    unsigned store_index,                        //position in the config
     const string &category,                      //category name
     const boost::shared_ptr<StoreQueue> &model,  //model to use (optional)
     bool category_list) {                        //is a list of stores?
@@ -1008,7 +1348,8 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
 
       pstore =
         shared_ptr<StoreQueue>(new StoreQueue(type, store_name, checkPeriod,
-                                              is_model, multi_category));
+                                              is_model, multi_category,
+                                              store_index));
     }
   } catch (...) {
     pstore.reset();
@@ -1031,9 +1372,14 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
   if (category_list) {
     return (pstore);
   }
+  shared_ptr<CategoryRateLimit> limit = CategoryRateLimit::create(store_conf);
+
   if (is_default) {
     LOG_OPER("Creating default store");
     defaultStores.push_back(pstore);
+    if (limit != NULL) {
+      defaultLimit = limit;
+    }
   } else if (is_prefix_category) {
     shared_ptr<store_list_t> pstores;
     category_map_t::iterator category_iter = category_prefixes.find(category);
@@ -1044,6 +1390,9 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
       category_prefixes[category] = pstores;
     }
     pstores->push_back(pstore);
+    if (limit != NULL) {
+      prefixLimits[category] = limit;
+    }
   } else if (!pstore->isModelStore()) {
     // push the new store onto the new map if it's not just a model
     shared_ptr<store_list_t> pstores;
@@ -1052,9 +1401,12 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
       pstores = category_iter->second;
     } else {
       pstores = shared_ptr<store_list_t>(new store_list_t);
-      categories[category] = pstores;
+      addCategory(category, pstores);
     }
     pstores->push_back(pstore);
+    if (limit != NULL) {
+      setCategoryLimit(category, limit);
+    }
   }
 
   return pstore;
@@ -1087,3 +1439,91 @@ void scribeHandler::deleteCategoryMap(category_map_t& cats) {
   } // for each category
   cats.clear();
 }
+
+// stop and forget every store in categories
+// Should be called while holding a writeLock on scribeHandlerLock
+void scribeHandler::clearCategories() {
+  deleteCategoryMap(categories);
+  categoryRoutes.clear();
+  categoryLimits.clear();
+  categoryIds.clear();
+  publishRoutes();
+}
+
+// Make the current categories visible to Log() and the status calls.
+// Should be called while holding categoryCreateMutex, or a writeLock on
+// scribeHandlerLock
+void scribeHandler::publishRoutes() {
+  shared_ptr<CategoryRoutes> new_routes(new CategoryRoutes);
+  new_routes->categories = categories;
+  new_routes->ids = categoryIds;
+  new_routes->byId = categoryRoutes;
+  new_routes->limitsById = categoryLimits;
+  boost::atomic_store(&routes, category_routes_ptr_t(new_routes));
+}
+
+// Does not publish the category, see publishRoutes().
+// Should be called while holding categoryCreateMutex, or a writeLock on
+// scribeHandlerLock
+void scribeHandler::addCategory(const string& category,
+                                const shared_ptr<store_list_t>& pstores) {
+  categories[category] = pstores;
+
+  category_id_t category_id = g_categoryTable.intern(category);
+  if (category_id != NO_CATEGORY_ID) {
+    categoryIds[category] = category_id;
+    if (category_id >= categoryRoutes.size()) {
+      categoryRoutes.resize(category_id + 1);
+    }
+    categoryRoutes[category_id] = pstores;
+  }
+}
+
+// Does not publish the limit, see publishRoutes().
+// Should be called while holding categoryCreateMutex, or a writeLock on
+// scribeHandlerLock
+void scribeHandler::setCategoryLimit(
+    const string& category, const shared_ptr<CategoryRateLimit>& limit) {
+
+  category_id_t category_id = g_categoryTable.intern(category);
+  if (category_id == NO_CATEGORY_ID) {
+    LOG_OPER("[%s] cannot rate limit category", category.c_str());
+    return;
+  }
+  categoryIds[category] = category_id;
+  if (category_id >= categoryLimits.size()) {
+    categoryLimits.resize(category_id + 1);
+  }
+  if (categoryLimits[category_id] != NULL &&
+      categoryLimits[category_id] != limit) {
+    LOG_OPER("[%s] more than one store sets a rate limit, using the last one",
+             category.c_str());
+  }
+  categoryLimits[category_id] = limit;
+}
+
+// Returns the stores for category in current_routes, or NULL if it has
+// none yet. Sets *category_id to the category's id, or to NO_CATEGORY_ID
+// if current_routes has neither stores nor a limit for it. Takes no locks.
+shared_ptr<store_list_t> scribeHandler::findCategory(
+    const CategoryRoutes& current_routes,
+    const string& category, category_id_t* category_id) {
+
+  category_id_map_t::const_iterator id_iter = current_routes.ids.find(category);
+  if (id_iter != current_routes.ids.end()) {
+    *category_id = id_iter->second;
+    if (*category_id < current_routes.byId.size()) {
+      return current_routes.byId[*category_id];
+    }
+    return shared_ptr<store_list_t>();
+  }
+  *category_id = NO_CATEGORY_ID;
+
+  // only happens if the category table filled up
+  category_map_t::const_iterator cat_iter =
+    current_routes.categories.find(category);
+  if (cat_iter != current_routes.categories.end()) {
+    return cat_iter->second;
+  }
+  return shared_ptr<store_list_t>();
+}
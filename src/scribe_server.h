@@ -30,6 +30,8 @@
 #include "common.h"
 #include "sequential_test.h"
 #include "dbg.h"
+#include "category_table.h"
+#include "token_bucket.h"
 
 #ifdef USE_ZOOKEEPER
 #include "zk_client.h"
@@ -37,7 +39,58 @@
 
 typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
 typedef std::map<std::string, boost::shared_ptr<store_list_t> > category_map_t;
+typedef boost::unordered_map<std::string, category_id_t> category_id_map_t;
 typedef std::vector<boost::shared_ptr<Source> > source_list_t;
+/*
+ * Admission limits for a category, or for all categories created from the
+ * same prefix store, taken from the rate_limit_* settings of its store:
+ *   rate_limit_msgs_per_sec   messages per second
+ *   rate_limit_bytes_per_sec  message bytes per second
+ *   rate_limit_burst_sec      seconds worth of traffic allowed in a burst
+ */
+class CategoryRateLimit {
+ public:
+  // returns NULL if store_conf sets no limits
+  static boost::shared_ptr<CategoryRateLimit> create(pStoreConf store_conf);
+  // new limit with the same settings that does not share its buckets
+  boost::shared_ptr<CategoryRateLimit> clone() const;
+
+  bool tryAdmit(unsigned long messages, unsigned long long bytes);
+  // gives back what a successful tryAdmit() took
+  void refund(unsigned long messages, unsigned long long bytes);
+
+ private:
+  CategoryRateLimit() {}
+
+  boost::shared_ptr<TokenBucket> msgBucket;
+  boost::shared_ptr<TokenBucket> byteBucket;
+};
+
+typedef std::vector<boost::shared_ptr<CategoryRateLimit> > rate_limit_list_t;
+
+// Immutable copy of the category routing tables. A new one is built and
+// swapped in whenever a category is added, so Log() and the status calls
+// can use whichever one is current without locking out category creation.
+struct CategoryRoutes {
+  category_map_t categories;
+  category_id_map_t ids;                              // of the ones below
+  std::vector<boost::shared_ptr<store_list_t> > byId; // by category id
+  rate_limit_list_t limitsById;                       // by category id
+};
+typedef boost::shared_ptr<const CategoryRoutes> category_routes_ptr_t;
+
+// messages of a single Log() request, grouped by the queue they go to
+typedef std::map<StoreQueue*,
+                 std::pair<boost::shared_ptr<StoreQueue>, logentry_vector_t> >
+  queue_batch_map_t;
+
+// messages of a single Log() request that count against one rate limit
+struct RateLimitRun {
+  boost::shared_ptr<CategoryRateLimit> limit;
+  category_id_t category;
+  unsigned long messages;
+  unsigned long long bytes;
+};
 
 std::string resultCodeToString(scribe::thrift::ResultCode::type rc);
 
@@ -59,7 +112,13 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   void getStatusDetails(std::string& _return);
   void setStatus(facebook::fb303::fb_status new_status);
   void setStatusDetails(const std::string& new_status_details);
-  void setQueueSizeCounter(bool get_read_lock);
+  void setQueueSizeCounter();
+  void startStatusThread();
+  void stopStatusThread();
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void statusThreadMember();
 
   unsigned long int port; // it's long because that's all I implemented in the conf class
 
@@ -80,6 +139,8 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   void incCounter(std::string category, std::string counter, long amount);
   void incCounter(std::string counter);
   void incCounter(std::string counter, long amount);
+  void incCounter(category_id_t category, CategoryTable::counter_t counter,
+                  long amount);
   void setCounter(std::string counter, long amount);
 
 	std::string resultCodeToString(scribe::thrift::ResultCode::type rc);
@@ -101,8 +162,29 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   // This map has an entry for each configured category.
   // Each of these entries is a map of type->StoreQueue.
   // The StoreQueue contains a store, which could contain additional stores.
+  // Store lists are not modified once published in routes; adding a store
+  // to an existing category replaces its list.
   category_map_t categories;
   category_map_t category_prefixes;
+  // the same store lists as categories, indexed by category id
+  std::vector<boost::shared_ptr<store_list_t> > categoryRoutes;
+  rate_limit_list_t categoryLimits;  // indexed by category id
+  // ids of the categories in categoryRoutes and categoryLimits, so Log()
+  // finds them in routes without going through g_categoryTable's lock
+  category_id_map_t categoryIds;
+  // limits shared by all categories created from a prefix store
+  std::map<std::string, boost::shared_ptr<CategoryRateLimit> > prefixLimits;
+  // limit copied for each category created from the default stores
+  boost::shared_ptr<CategoryRateLimit> defaultLimit;
+
+  // Snapshot of categories/categoryRoutes for readers. Only accessed with
+  // boost::atomic_load/atomic_store.
+  category_routes_ptr_t routes;
+
+  // Must be held to create a new category while holding scribeHandlerLock
+  // for reading. Guards categories and categoryRoutes against concurrent
+  // creators; readers use routes instead.
+  apache::thrift::concurrency::Mutex categoryCreateMutex;
 
   // the default stores
   store_list_t defaultStores;
@@ -112,13 +194,19 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   facebook::fb303::fb_status status;
   std::string statusDetails;
   apache::thrift::concurrency::Mutex statusLock;
-  time_t lastMsgTime;
-  unsigned long numMsgLastSecond;
   unsigned long maxMsgPerSecond;
+  boost::shared_ptr<TokenBucket> msgRateBucket; // NULL if no max_msg_per_second
   unsigned long long maxQueueSize;
   unsigned long maxConn;
   StoreConf config;
   bool newThreadPerCategory;
+
+  // thread publishing counters every updateStatusInterval seconds
+  pthread_t statusThread;
+  pthread_mutex_t statusThreadMutex; // Must be held to read/modify the below
+  pthread_cond_t statusThreadCond;   // signaled to stop the thread
+  bool statusThreadRunning;
+  bool statusThreadStop;
   
   std::string seqtestLogAccepts;
   seqtest::MsgLogger seqtestAcceptsLogger;
@@ -128,8 +216,8 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
 #endif
 
   /* mutex to syncronize access to scribeHandler.
-   * A single mutex is fine since it only needs to be locked in write mode
-   * during start/stop/reinitialize or when we need to create a new category.
+   * It is only locked in write mode during start/stop/reinitialize, new
+   * categories are created under categoryCreateMutex instead.
    */
   boost::shared_ptr<apache::thrift::concurrency::ReadWriteMutex>
     scribeHandlerLock;
@@ -142,23 +230,37 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
  protected:
   bool throttleDeny(int num_messages); // returns true if overloaded
   void deleteCategoryMap(category_map_t& cats);
+  void clearCategories();
+  void publishRoutes();
+  void createLoggedCategories();
+  static boost::shared_ptr<store_list_t>
+    findCategory(const CategoryRoutes& current_routes,
+                 const std::string& category, category_id_t* category_id);
+  void addCategory(const std::string& category,
+                   const boost::shared_ptr<store_list_t>& pstores);
+  void setCategoryLimit(const std::string& category,
+                        const boost::shared_ptr<CategoryRateLimit>& limit);
+  bool admitRequest(const std::vector<RateLimitRun>& runs);
   const char* statusAsString(facebook::fb303::fb_status new_status);
   bool createCategoryFromModel(const std::string &category,
                                const boost::shared_ptr<StoreQueue> &model);
   boost::shared_ptr<StoreQueue>
     configureStoreCategory(pStoreConf store_conf,
+                           unsigned store_index,
                            const std::string &category,
                            const boost::shared_ptr<StoreQueue> &model,
                            bool category_list=false);
-  bool configureStore(pStoreConf store_conf, int* num_stores);
+  bool configureStore(pStoreConf store_conf, unsigned store_index,
+                      int* num_stores);
   void startSources();
   void stopSources();
   void stopStores();
   bool throttleRequest(const std::vector<scribe::thrift::LogEntry>&  messages);
   boost::shared_ptr<store_list_t>
     createNewCategory(const std::string& category);
-  void addMessage(const scribe::thrift::LogEntry& entry,
-                  const boost::shared_ptr<store_list_t>& store_list);
+  bool addMessage(const scribe::thrift::LogEntry& entry,
+                  const boost::shared_ptr<store_list_t>& store_list,
+                  queue_batch_map_t& batches);
 };
 
 extern boost::shared_ptr<scribeHandler> g_Handler;
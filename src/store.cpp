@@ -28,6 +28,9 @@
 #include "common.h"
 #include "scribe_server.h"
 #include "network_dynamic_config.h"
+#include "file_syncer.h"
+#include "compressed_file.h"
+#include "file_worker.h"
 
 using namespace std;
 using namespace boost;
@@ -42,12 +45,20 @@ using namespace scribe::thrift;
 #define DEFAULT_FILESTORE_MAX_WRITE_SIZE          1000000
 #define DEFAULT_FILESTORE_ROLL_HOUR               1
 #define DEFAULT_FILESTORE_ROLL_MINUTE             15
+#define DEFAULT_FILESTORE_SYNC_INTERVAL_MS        1000
+#define DEFAULT_FILESTORE_SYNC_BYTES              (16 * 1024 * 1024)
+#define DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE  (1024 * 1024)
+#define DEFAULT_FILESTORE_PREOPEN_RATIO           0.9
 #define DEFAULT_BUFFERSTORE_SEND_RATE             1
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL    300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE  60
 #define DEFAULT_BUCKETSTORE_DELIMITER             ':'
 #define DEFAULT_NETWORKSTORE_CACHE_TIMEOUT        300
 #define DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO 0.75
+#define BUFFERSTORE_REPLAY_RETRY_MS               1000
+// replay_adaptive_rate never goes below 1/BUFFERSTORE_REPLAY_RATE_STEPS of
+// the configured rates, and gets back to them in as many good groups
+#define BUFFERSTORE_REPLAY_RATE_STEPS             16
 
 // magic threshold
 #define DEFAULT_NETWORKSTORE_DUMMY_THRESHOLD      4096
@@ -199,11 +210,23 @@ FileStoreBase::FileStoreBase(StoreQueue* storeq,
     storeTree(false),
     writeStats(true),
     lzoCompressionLevel(0),
+    compressionLevel(-1),
+    compressionBlockSize(DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE),
+    backgroundRotation(false),
+    frameChecksum(false),
     log_calls(false),
     rotateOnReopen(false),
+    preallocate(false),
+    syncPolicy(SYNC_NONE),
+    durability(DURABILITY_NONE),
+    syncIntervalMs(DEFAULT_FILESTORE_SYNC_INTERVAL_MS),
+    syncBytes(DEFAULT_FILESTORE_SYNC_BYTES),
     currentSize(0),
     lastRollTime(0),
-    eventsWritten(0) {
+    eventsWritten(0),
+    useFileIndex(false),
+    unsyncedBytes(0),
+    lastSyncMs(0) {
 }
 
 FileStoreBase::~FileStoreBase() {
@@ -324,6 +347,27 @@ void FileStoreBase::configure(pStoreConf configuration, pStoreConf parent) {
   configuration->getString("fs_type", fsType);
 
   configuration->getUnsigned("lzo_compression", lzoCompressionLevel);
+  if (configuration->getString("compression", tmp)) {
+    compression = (0 == tmp.compare("none")) ? string() : tmp;
+  }
+  unsigned long level;
+  if (configuration->getUnsigned("compression_level", level)) {
+    compressionLevel = level;
+  }
+  configuration->getUnsigned("compression_block_size", compressionBlockSize);
+  if (!compression.empty()) {
+    if (!CompressedFile::isSupported(compression)) {
+      LOG_OPER("[%s] Bad config - compression <%s> is not supported, "
+               "writing uncompressed files", categoryHandled.c_str(),
+               compression.c_str());
+      compression.clear();
+    } else if (0 != fsType.compare("std") && 0 != fsType.compare("posix")) {
+      LOG_OPER("[%s] Bad config - compression is only supported for local "
+               "files, not fs_type <%s>", categoryHandled.c_str(),
+               fsType.c_str());
+      compression.clear();
+    }
+  }
   if (configuration->getString("log_calls", tmp)) {
     if (0 == tmp.compare("yes")) {
       log_calls = true;
@@ -347,6 +391,63 @@ void FileStoreBase::configure(pStoreConf configuration, pStoreConf parent) {
       rotateOnReopen = false;
     }
   }
+
+  // only supported by fs_type=posix
+  if (configuration->getString("preallocate", tmp)) {
+    preallocate = (0 == tmp.compare("yes"));
+  }
+  if (configuration->getString("sync_policy", tmp)) {
+    if (0 == tmp.compare("writeback")) {
+      syncPolicy = SYNC_WRITEBACK;
+    } else if (0 == tmp.compare("fdatasync")) {
+      syncPolicy = SYNC_DATA;
+    } else {
+      if (0 != tmp.compare("none")) {
+        LOG_OPER("[%s] Bad config - unknown sync_policy <%s>, using none",
+                 categoryHandled.c_str(), tmp.c_str());
+      }
+      syncPolicy = SYNC_NONE;
+    }
+  }
+
+  configuration->getUnsigned("sync_interval_ms", syncIntervalMs);
+  configuration->getUnsignedLongLong("sync_bytes", syncBytes);
+  if (configuration->getString("durability", tmp)) {
+    if (0 == tmp.compare("interval_ms")) {
+      durability = DURABILITY_INTERVAL;
+    } else if (0 == tmp.compare("bytes")) {
+      durability = DURABILITY_BYTES;
+    } else if (0 == tmp.compare("every_batch")) {
+      durability = DURABILITY_EVERY_BATCH;
+    } else {
+      if (0 != tmp.compare("none")) {
+        LOG_OPER("[%s] Bad config - unknown durability <%s>, using none",
+                 categoryHandled.c_str(), tmp.c_str());
+      }
+      durability = DURABILITY_NONE;
+    }
+  }
+  if (durability != DURABILITY_NONE &&
+      0 != fsType.compare("std") && 0 != fsType.compare("posix")) {
+    LOG_OPER("[%s] Bad config - durability is only supported for local files, "
+             "not fs_type <%s>", categoryHandled.c_str(), fsType.c_str());
+    durability = DURABILITY_NONE;
+  }
+
+  if (configuration->getString("background_rotation", tmp)) {
+    backgroundRotation = (0 == tmp.compare("yes"));
+  }
+  if (backgroundRotation && durability != DURABILITY_NONE) {
+    // files have to be closed before they can be synced
+    LOG_OPER("[%s] Bad config - background_rotation can't be used with "
+             "durability, ignoring it", categoryHandled.c_str());
+    backgroundRotation = false;
+  }
+
+  // only makes a difference for framed files, i.e. buffer files
+  if (configuration->getString("frame_checksum", tmp)) {
+    frameChecksum = (0 == tmp.compare("yes"));
+  }
 }
 
 void FileStoreBase::copyCommon(const FileStoreBase *base) {
@@ -366,8 +467,18 @@ void FileStoreBase::copyCommon(const FileStoreBase *base) {
   storeTree = base->storeTree;
   writeStats = base->writeStats;
   lzoCompressionLevel = base->lzoCompressionLevel;
+  compression = base->compression;
+  compressionLevel = base->compressionLevel;
+  compressionBlockSize = base->compressionBlockSize;
   log_calls = base->log_calls;
   rotateOnReopen = base->rotateOnReopen;
+  preallocate = base->preallocate;
+  syncPolicy = base->syncPolicy;
+  durability = base->durability;
+  syncIntervalMs = base->syncIntervalMs;
+  syncBytes = base->syncBytes;
+  backgroundRotation = base->backgroundRotation;
+  frameChecksum = base->frameChecksum;
 
   /*
    * append the category name to the base file path and change the
@@ -429,6 +540,83 @@ void FileStoreBase::periodicCheck() {
   if (rotate && isOpen()) {
     close();
   }
+
+  // close() syncs on its own, this is for files that sit idle
+  if (isOpen() && !unsyncedFiles.empty() &&
+      durability == DURABILITY_INTERVAL &&
+      scribe::clock::monotonicNowInMsec() >= lastSyncMs + syncIntervalMs) {
+    flush();
+    syncWritten(false);
+  }
+}
+
+// Records that bytes were written to filename, and will need to be synced
+void FileStoreBase::noteWritten(const string& filename, unsigned long bytes) {
+  if (durability == DURABILITY_NONE) {
+    return;
+  }
+  unsyncedFiles.insert(filename);
+  unsyncedBytes += bytes;
+}
+
+/*
+ * Called once a batch has been written. Syncs whatever the durability
+ * setting asks for, returns false if a sync the batch has to wait for
+ * failed.
+ */
+bool FileStoreBase::commitWritten() {
+  if (unsyncedFiles.empty()) {
+    return true;
+  }
+
+  switch (durability) {
+    case DURABILITY_EVERY_BATCH:
+      flush();
+      if (!syncWritten(true)) {
+        LOG_OPER("[%s] Failed to sync written messages to disk",
+                 categoryHandled.c_str());
+        setStatus("File sync error");
+        return false;
+      }
+      break;
+    case DURABILITY_BYTES:
+      if (unsyncedBytes >= syncBytes) {
+        flush();
+        syncWritten(false);
+      }
+      break;
+    case DURABILITY_INTERVAL:
+      if (scribe::clock::monotonicNowInMsec() >= lastSyncMs + syncIntervalMs) {
+        flush();
+        syncWritten(false);
+      }
+      break;
+    case DURABILITY_NONE:
+      break;
+  }
+  return true;
+}
+
+// Hands every file written since the last sync to its FileSyncer
+bool FileStoreBase::syncWritten(bool wait) {
+  bool success = true;
+  for (set<string>::iterator iter = unsyncedFiles.begin();
+       iter != unsyncedFiles.end(); ++iter) {
+    shared_ptr<FileSyncer> syncer = FileSyncer::get(*iter);
+    if (wait) {
+      success = syncer->sync(*iter) && success;
+    } else {
+      syncer->syncLater(*iter);
+    }
+  }
+
+  // failed files stay unsynced, for the next try
+  if (success) {
+    unsyncedFiles.clear();
+    unsyncedBytes = 0;
+  }
+  lastSyncMs = scribe::clock::monotonicNowInMsec();
+  return success;
 }
 
 void FileStoreBase::rotateFile(time_t currentTime) {
@@ -457,6 +645,8 @@ string FileStoreBase::makeFullFilename(int suffix, struct tm* creation_time) {
   string fullFilename = filename.str();
   if(lzoCompressionLevel > 0)
     fullFilename += ".lzo";
+  else if (!compression.empty())
+    fullFilename += CompressedFile::extension(compression);
 
   return fullFilename;
 }
@@ -542,6 +732,10 @@ string FileStoreBase::makeBaseFilename(struct tm* creation_time) {
 
 // returns the suffix of the newest file matching base_filename
 int FileStoreBase::findNewestFile(const string& base_filename) {
+  if (useFileIndex) {
+    file_index_t& files = indexedFiles(base_filename);
+    return files.empty() ? -1 : files.rbegin()->first;
+  }
 
   /// do not use filePath when we are using the tree store.
   string currentPath;
@@ -570,6 +764,10 @@ int FileStoreBase::findNewestFile(const string& base_filename) {
 }
 
 int FileStoreBase::findOldestFile(const string& base_filename) {
+  if (useFileIndex) {
+    file_index_t& files = indexedFiles(base_filename);
+    return files.empty() ? -1 : files.begin()->first;
+  }
 
   std::vector<std::string> files = FileInterface::list(filePath, fsType);
 
@@ -588,6 +786,82 @@ int FileStoreBase::findOldestFile(const string& base_filename) {
   return min_suffix;
 }
 
+// Like findOldestFile(), but returns the full name of the file as it is,
+// which may be compressed differently than the files written now
+string FileStoreBase::findOldestFilename(const string& base_filename) {
+  if (useFileIndex) {
+    file_index_t& files = indexedFiles(base_filename);
+    return files.empty() ? string() : filePath + '/' + files.begin()->second;
+  }
+  std::vector<std::string> files = FileInterface::list(filePath, fsType);
+
+  int min_suffix = -1;
+  std::string oldest;
+  for (std::vector<std::string>::iterator iter = files.begin();
+       iter != files.end();
+       ++iter) {
+
+    int suffix = getFileSuffix(*iter, base_filename);
+    if (suffix >= 0 &&
+        (min_suffix == -1 || suffix < min_suffix)) {
+      min_suffix = suffix;
+      oldest = *iter;
+    }
+  }
+  return oldest.empty() ? oldest : filePath + '/' + oldest;
+}
+
+// The index for base_filename, listing the directory if there is none yet
+FileStoreBase::file_index_t&
+FileStoreBase::indexedFiles(const string& base_filename) {
+  map<string, file_index_t>::iterator found = fileIndex.find(base_filename);
+  if (found != fileIndex.end()) {
+    return found->second;
+  }
+
+  file_index_t& files = fileIndex[base_filename];
+  std::vector<std::string> names = FileInterface::list(filePath, fsType);
+  for (std::vector<std::string>::iterator iter = names.begin();
+       iter != names.end();
+       ++iter) {
+    int suffix = getFileSuffix(*iter, base_filename);
+    if (suffix >= 0) {
+      files[suffix] = *iter;
+    }
+  }
+  return files;
+}
+
+void FileStoreBase::indexFile(const string& base_filename,
+                              const string& filename) {
+  if (!useFileIndex) {
+    return;
+  }
+  string name = filename.substr(filename.find_last_of('/') + 1);
+  int suffix = getFileSuffix(name, base_filename);
+  if (suffix >= 0) {
+    indexedFiles(base_filename)[suffix] = name;
+  }
+}
+
+void FileStoreBase::unindexFile(const string& base_filename,
+                                const string& filename) {
+  if (!useFileIndex) {
+    return;
+  }
+  string name = filename.substr(filename.find_last_of('/') + 1);
+  int suffix = getFileSuffix(name, base_filename);
+  map<string, file_index_t>::iterator found = fileIndex.find(base_filename);
+  if (suffix >= 0 && found != fileIndex.end()) {
+    found->second.erase(suffix);
+  }
+}
+
+// Drops the index, the next lookup lists the directory again
+void FileStoreBase::invalidateFileIndex() {
+  fileIndex.clear();
+}
+
 int FileStoreBase::getFileSuffix(const string& filename,
                                 const string& base_filename) {
   int suffix = -1;
@@ -607,15 +881,19 @@ int FileStoreBase::getFileSuffix(const string& filename,
   if (string::npos != suffix_pos &&
       filename.length() > suffix_pos &&
       retVal) {
-    stringstream stream;
-    string::size_type lzo_suffix = filename.rfind(".lzo");
-
-    if(lzo_suffix != string::npos) {
-      stream << filename.substr(suffix_pos + 1, filename.length() - lzo_suffix+1);
+    // the number may only be followed by a compression extension
+    string::size_type end = filename.find_first_not_of("0123456789",
+                                                       suffix_pos + 1);
+    string extension = end == string::npos ? string() : filename.substr(end);
+    if (end == suffix_pos + 1 ||
+        !(extension.empty() || extension == ".lzo" ||
+          extension == CompressedFile::extension(
+            CompressedFile::codecFromFilename(extension)))) {
+      return -1;
     }
-    else
-      stream << filename.substr(suffix_pos + 1);
 
+    stringstream stream;
+    stream << filename.substr(suffix_pos + 1, end - suffix_pos - 1);
     stream >> suffix;
   }
   return suffix;
@@ -631,12 +909,9 @@ void FileStoreBase::printStats() {
 
   boost::shared_ptr<FileInterface> stats_file =
       FileInterface::createFileInterface(fsType, filename);
-  if (!stats_file ||
-      !stats_file->createDirectory(filePath) ||
-      !stats_file->openWrite()) {
+  if (!stats_file) {
     LOG_OPER("[%s] Failed to open stats file <%s> of type <%s> for writing",
              categoryHandled.c_str(), filename.c_str(), fsType.c_str());
-    // This isn't enough of a problem to change our status
     return;
   }
 
@@ -654,8 +929,19 @@ void FileStoreBase::printStats() {
   msg << " wrote <" << currentSize << "> bytes in <" << eventsWritten
       << "> events to file <" << currentFilename << ">" << endl;
 
-  stats_file->write(msg.str());
-  stats_file->close();
+  shared_ptr<AppendFileTask> task(
+    new AppendFileTask(stats_file, filePath, msg.str()));
+  if (backgroundRotation) {
+    FileWorker::get()->submit(task);
+    return;
+  }
+
+  task->run();
+  if (!task->success) {
+    LOG_OPER("[%s] Failed to write stats file <%s> of type <%s>",
+             categoryHandled.c_str(), filename.c_str(), fsType.c_str());
+    // This isn't enough of a problem to change our status
+  }
 }
 
 // Returns the number of bytes to pad to align to the specified chunk size
@@ -710,10 +996,20 @@ FileStore::FileStore(StoreQueue* storeq,
   : FileStoreBase(storeq, category, "file", multi_category),
     isBufferFile(is_buffer_file),
     addNewlines(false),
+    readBatchSize(0),
+    readStart(0),
+    readToEnd(false),
     lostBytes_(0) {
+  pthread_mutex_init(&preparedMutex, NULL);
 }
 
 FileStore::~FileStore() {
+  // let files being closed or opened in the background finish first
+  dropNextFile();
+  if (lastFileTask) {
+    FileWorker::get()->wait(lastFileTask);
+  }
+  pthread_mutex_destroy(&preparedMutex);
 }
 
 void FileStore::configure(pStoreConf configuration, pStoreConf parent) {
@@ -746,6 +1042,21 @@ void FileStore::configure(pStoreConf configuration, pStoreConf parent) {
   unsigned long inttemp = 0;
   configuration->getUnsigned("add_newlines", inttemp);
   addNewlines = inttemp ? true : false;
+
+  // only used for uncompressed local files, others are read whole
+  configuration->getUnsigned("read_batch_size", readBatchSize);
+
+  if (isBufferFile && backgroundRotation) {
+    // the buffer has to be able to read a file as soon as it is rotated
+    LOG_OPER("[%s] Bad config - background_rotation is not supported for "
+             "buffer files, ignoring it", categoryHandled.c_str());
+    backgroundRotation = false;
+  }
+
+  // Buffer files are looked up over and over while the buffer is sent,
+  // and no one else should be adding or removing them.
+  useFileIndex = isBufferFile && !storeTree &&
+    (0 == fsType.compare("std") || 0 == fsType.compare("posix"));
 }
 
 bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
@@ -759,18 +1070,26 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
   }
 
   try {
-    int suffix = findNewestFile(makeBaseFilename(current_time));
+    // A file opened ahead of time is the newest file, whether or not we
+    // are incrementing.
+    string file;
+    shared_ptr<FileInterface> next_file =
+      takeNextFile(makeBaseFilename(current_time), file);
 
-    if (incrementFilename) {
-      ++suffix;
-    }
+    if (!next_file) {
+      int suffix = findNewestFile(makeBaseFilename(current_time));
 
-    // this is the case where there's no file there and we're not incrementing
-    if (suffix < 0) {
-      suffix = 0;
-    }
+      if (incrementFilename) {
+        ++suffix;
+      }
 
-    string file = makeFullFilename(suffix, current_time);
+      // this is the case where there's no file there and we're not incrementing
+      if (suffix < 0) {
+        suffix = 0;
+      }
+
+      file = makeFullFilename(suffix, current_time);
+    }
 
     switch (rollPeriod) {
       case ROLL_DAILY:
@@ -790,34 +1109,38 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       if (writeMeta) {
         writeFile->write(meta_logfile_prefix + file);
       }
-      writeFile->close();
+      retireFile(writeFile);
     }
 
-    writeFile = FileInterface::createFileInterface(fsType, file, isBufferFile);
-    if (!writeFile) {
-      LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
-               categoryHandled.c_str(), file.c_str(), fsType.c_str());
-      setStatus("file open error");
-      return false;
-    }
-    writeFile->setShouldLZOCompress(lzoCompressionLevel);
-    writeFile->setShouldLogCalls(log_calls);
+    if (next_file) {
+      // opened ahead of time by preopenNextFile()
+      writeFile = next_file;
+      success = true;
+    } else {
+      writeFile = createWriteFile(file);
+      if (!writeFile) {
+        LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
+                 categoryHandled.c_str(), file.c_str(), fsType.c_str());
+        setStatus("file open error");
+        return false;
+      }
 
-    success = writeFile->createDirectory(baseFilePath);
+      success = writeFile->createDirectory(baseFilePath);
 
-    // If we created a subdirectory, we need to create two directories
-    if (success && !subDirectory.empty()) {
-      success = writeFile->createDirectory(filePath);
-    }
+      // If we created a subdirectory, we need to create two directories
+      if (success && !subDirectory.empty()) {
+        success = writeFile->createDirectory(filePath);
+      }
 
-    if (!success) {
-      LOG_OPER("[%s] Failed to create directory for file <%s>",
-               categoryHandled.c_str(), file.c_str());
-      setStatus("File open error");
-      return false;
-    }
+      if (!success) {
+        LOG_OPER("[%s] Failed to create directory for file <%s>",
+                 categoryHandled.c_str(), file.c_str());
+        setStatus("File open error");
+        return false;
+      }
 
-    success = writeFile->openWrite();
+      success = writeFile->openWrite();
+    }
 
 
     if (!success) {
@@ -840,6 +1163,7 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       LOG_OPER("[%s] Opened file <%s> for writing", categoryHandled.c_str(),
               file.c_str());
 
+      indexFile(makeBaseFilename(current_time), file);
       currentSize = writeFile->fileSize();
       currentFilename = file;
       eventsWritten = 0;
@@ -857,16 +1181,147 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
   return success;
 }
 
+shared_ptr<FileInterface> FileStore::createFile(const string& name) {
+  string codec = CompressedFile::codecFromFilename(name);
+  shared_ptr<FileInterface> file;
+  if (codec.empty() || 0 == fsType.compare("hdfs")) {
+    file = FileInterface::createFileInterface(fsType, name, isBufferFile);
+  } else {
+    // the compressed file does the framing
+    shared_ptr<FileInterface> raw =
+      FileInterface::createFileInterface(fsType, name, false);
+    if (raw) {
+      file.reset(new CompressedFile(raw, name, codec, compressionLevel,
+                                    compressionBlockSize, isBufferFile));
+    }
+  }
+
+  if (file) {
+    file->setFrameChecksum(frameChecksum);
+  }
+  return file;
+}
+
+// A file to write to, set up but not opened yet
+shared_ptr<FileInterface> FileStore::createWriteFile(const string& name) {
+  shared_ptr<FileInterface> file = createFile(name);
+  if (file) {
+    file->setShouldLZOCompress(lzoCompressionLevel);
+    file->setShouldLogCalls(log_calls);
+    file->setPreallocateSize(preallocate && maxSize != ULONG_MAX ?
+                             maxSize : 0);
+    file->setSyncPolicy(syncPolicy);
+  }
+  return file;
+}
+
+// Closes a file that is no longer written to, in the background if
+// background_rotation is on
+void FileStore::retireFile(shared_ptr<FileInterface> file) {
+  if (!backgroundRotation) {
+    file->close();
+    return;
+  }
+  lastFileTask.reset(new CloseFileTask(file, false));
+  if (file == writeFile) {
+    writeFile.reset();
+  }
+  FileWorker::get()->submit(lastFileTask);
+}
+
+/*
+ * Starts opening the file the next size based rotation will switch to, so
+ * the rotation itself does not have to wait for it.
+ */
+void FileStore::preopenNextFile() {
+  if (nextFile || !backgroundRotation || maxSize == 0 ||
+      currentSize < maxSize * DEFAULT_FILESTORE_PREOPEN_RATIO) {
+    return;
+  }
+
+  time_t rawtime = time(NULL);
+  struct tm timeinfo;
+  localtime_r(&rawtime, &timeinfo);
+
+  nextBase = makeBaseFilename(&timeinfo);
+  nextFilename = makeFullFilename(findNewestFile(nextBase) + 1, &timeinfo);
+  nextFile = createWriteFile(nextFilename);
+  if (!nextFile) {
+    return;
+  }
+
+  vector<string> directories;
+  directories.push_back(baseFilePath);
+  if (!subDirectory.empty()) {
+    directories.push_back(filePath);
+  }
+  nextOpen.reset(new OpenFileTask(nextFile, directories));
+  lastFileTask = nextOpen;
+  FileWorker::get()->submit(nextOpen);
+}
+
+/*
+ * Returns the file opened by preopenNextFile() if it is the next file for
+ * base_filename, waiting for it to be open if need be, and sets filename
+ * to its name. A file opened for another base file name, because the
+ * time based name changed since, is closed and deleted instead.
+ */
+shared_ptr<FileInterface> FileStore::takeNextFile(const string& base_filename,
+                                                  string& filename) {
+  shared_ptr<FileInterface> file = nextFile;
+  shared_ptr<OpenFileTask> open_task = nextOpen;
+  nextFile.reset();
+  nextOpen.reset();
+  if (!file) {
+    return file;
+  }
+
+  if (nextBase != base_filename) {
+    nextFile = file;
+    dropNextFile();
+    return shared_ptr<FileInterface>();
+  }
+
+  FileWorker::get()->wait(open_task);
+  if (!open_task->success) {
+    LOG_OPER("[%s] Failed to open file <%s> ahead of time",
+             categoryHandled.c_str(), nextFilename.c_str());
+    return shared_ptr<FileInterface>();
+  }
+  filename = nextFilename;
+  return file;
+}
+
+// Closes the file opened by preopenNextFile(), and deletes it unless
+// something was written to it.
+void FileStore::dropNextFile() {
+  if (!nextFile) {
+    return;
+  }
+  lastFileTask.reset(new CloseFileTask(nextFile, true));
+  FileWorker::get()->submit(lastFileTask);
+  nextFile.reset();
+  nextOpen.reset();
+}
+
 bool FileStore::isOpen() {
   return writeFile && writeFile->isOpen();
 }
 
 void FileStore::close() {
   if (isOpen())
-    writeFile->close();
+    retireFile(writeFile);
+  if (nextFile) {
+    // gone before anyone looks for the newest file again
+    dropNextFile();
+    FileWorker::get()->wait(lastFileTask);
+  }
+  if (!unsyncedFiles.empty()) {
+    syncWritten(durability == DURABILITY_EVERY_BATCH);
+  }
 }
 
-// TODO fdatasync option
+// durability decides when this also syncs, see commitWritten()
 bool FileStore::flush() {
   return writeFile ? writeFile->flush() : false;
 }
@@ -877,7 +1332,9 @@ shared_ptr<Store> FileStore::copy(const std::string &category) {
   shared_ptr<Store> copied = shared_ptr<Store>(store);
 
   store->addNewlines = addNewlines;
+  store->readBatchSize = readBatchSize;
   store->copyCommon(this);
+  store->useFileIndex = useFileIndex;
   return copied;
 }
 
@@ -891,18 +1348,167 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
     return false;
   }
 
-  return writeMessages(messages);
+  if (!writeMessages(messages) || !commitWritten()) {
+    return false;
+  }
+  preopenNextFile();
+  return true;
+}
+
+// Points data at what a frame holds for text, returns how many buffers
+// that took
+static int setFrameData(struct iovec* data, const string& text,
+                        bool newline) {
+  data[0].iov_base = (void*)text.data();
+  data[0].iov_len = text.length();
+  if (!newline) {
+    return 1;
+  }
+  data[1].iov_base = (void*)"\n";
+  data[1].iov_len = 1;
+  return 2;
+}
+
+/*
+ * Frame the messages of the next batch while the current one is being
+ * written, which with frame checksums is most of the work besides the
+ * write itself. Only the frame headers are built, the messages are still
+ * written from where they are. Padding depends on where a message lands
+ * in the file, so this only helps without chunks.
+ */
+void FileStore::prepareBatch(boost::shared_ptr<logentry_vector_t> messages) {
+  if (chunkSize != 0 ||
+      (0 != fsType.compare("std") && 0 != fsType.compare("posix"))) {
+    return;
+  }
+  if (!frameFile) {
+    frameFile = FileInterface::createFileInterface(fsType, categoryHandled,
+                                                   isBufferFile);
+    frameFile->setFrameChecksum(frameChecksum);
+  }
+
+  string frames;
+  vector<unsigned> frame_lengths;
+  frame_lengths.reserve(messages->size() * (writeCategory ? 2 : 1));
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end(); ++iter) {
+    struct iovec data[2];
+    string frame;
+    if (writeCategory) {
+      setFrameData(data, (*iter)->category, true);
+      frame = frameFile->getFrame(data, 2);
+      frames += frame;
+      frame_lengths.push_back(frame.length());
+    }
+    frame = frameFile->getFrame(data, setFrameData(data, (*iter)->message,
+                                                   addNewlines),
+                                writeCategory);
+    frames += frame;
+    frame_lengths.push_back(frame.length());
+  }
+
+  pthread_mutex_lock(&preparedMutex);
+  preparedMessages = messages;
+  preparedFrames.swap(frames);
+  preparedFrameLengths.swap(frame_lengths);
+  pthread_mutex_unlock(&preparedMutex);
+}
+
+// Takes the frames prepareBatch() built for messages, if it did.
+bool FileStore::takePreparedFrames(
+    boost::shared_ptr<logentry_vector_t> messages, string& frames,
+    vector<unsigned>& frame_lengths) {
+  bool found = false;
+  pthread_mutex_lock(&preparedMutex);
+  if (preparedMessages == messages && chunkSize == 0 &&
+      preparedFrameLengths.size() ==
+      messages->size() * (writeCategory ? 2 : 1)) {
+    frames.swap(preparedFrames);
+    frame_lengths.swap(preparedFrameLengths);
+    found = true;
+  }
+  preparedMessages.reset();
+  preparedFrames.clear();
+  preparedFrameLengths.clear();
+  pthread_mutex_unlock(&preparedMutex);
+  return found;
 }
 
+/*
+ * The pieces of one write, handed to FileInterface::writev() without
+ * copying the messages. Frames, newlines and padding are copied into a
+ * small arena, everything else is pointed at where it is and must stay
+ * alive until write().
+ */
+class WriteBatch {
+ public:
+  void add(const char* data, size_t length) {
+    if (length > 0) {
+      Piece piece = {data, 0, length};
+      pieces.push_back(piece);
+    }
+  }
+
+  void copy(const char* data, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    // extend the last piece if it ends where this one starts
+    if (!pieces.empty() && pieces.back().base == NULL &&
+        pieces.back().offset + pieces.back().length == arena.size()) {
+      pieces.back().length += length;
+    } else {
+      Piece piece = {NULL, arena.size(), length};
+      pieces.push_back(piece);
+    }
+    arena.append(data, length);
+  }
+
+  void copy(const string& data) {
+    copy(data.data(), data.size());
+  }
+
+  void pad(size_t length) {
+    copy(string(length, 0));
+  }
+
+  bool write(FileInterface* file) {
+    vector<struct iovec> iov(pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      const char* base = pieces[i].base ? pieces[i].base :
+                                          arena.data() + pieces[i].offset;
+      iov[i].iov_base = const_cast<char*>(base);
+      iov[i].iov_len = pieces[i].length;
+    }
+    return iov.empty() || file->writev(&iov[0], iov.size());
+  }
+
+  void clear() {
+    pieces.clear();
+    arena.clear();
+  }
+
+ private:
+  // at base, or at offset in arena if base is NULL
+  struct Piece {
+    const char* base;
+    size_t offset;
+    size_t length;
+  };
+
+  vector<Piece> pieces;
+  string arena;
+};
+
 // writes messages to either the specified file or the the current writeFile
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                               boost::shared_ptr<FileInterface> file) {
-  // Data is written to a buffer first, then sent to disk in one call to write.
-  // This costs an extra copy of the data, but dramatically improves latency with
-  // network based files. (nfs, etc)
-  string        write_buffer;
+  // Data is gathered into a WriteBatch first, then sent to disk in one call
+  // to writev. This dramatically improves latency with network based files
+  // (nfs, etc), and the messages themselves are never copied.
+  WriteBatch    write_batch;
   bool          success = true;
-  unsigned long current_size_buffered = 0; // size of data in write_buffer
+  unsigned long current_size_buffered = 0; // size of data in write_batch
   unsigned long num_buffered = 0;
   unsigned long num_written = 0;
   boost::shared_ptr<FileInterface> write_file;
@@ -915,6 +1521,14 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
     write_file = writeFile;
   }
 
+  // use the frames from prepareBatch() if these messages were prepared
+  string prepared_frames;
+  vector<unsigned> frame_lengths;
+  bool prepared = !file &&
+    takePreparedFrames(messages, prepared_frames, frame_lengths);
+  size_t frame_offset = 0;
+  vector<unsigned>::iterator frame_length = frame_lengths.begin();
+
   try {
     for (logentry_vector_t::iterator iter = messages->begin();
          iter != messages->end();
@@ -925,6 +1539,7 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       unsigned long length = 0;
       unsigned long message_length = (*iter)->message.length();
       string frame, category_frame;
+      struct iovec frame_data[2];
 
       if (addNewlines) {
         ++message_length;
@@ -937,12 +1552,25 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
         unsigned long category_length = (*iter)->category.length() + 1;
         length += category_length;
 
-        category_frame = write_file->getFrame(category_length);
+        if (prepared) {
+          category_frame.assign(prepared_frames, frame_offset, *frame_length);
+          frame_offset += *frame_length++;
+        } else {
+          setFrameData(frame_data, (*iter)->category, true);
+          category_frame = write_file->getFrame(frame_data, 2);
+        }
         length += category_frame.length();
       }
 
       // frame is a header that the underlying file class can add to each message
-      frame = write_file->getFrame(message_length);
+      if (prepared) {
+        frame.assign(prepared_frames, frame_offset, *frame_length);
+        frame_offset += *frame_length++;
+      } else {
+        frame = write_file->getFrame(
+          frame_data, setFrameData(frame_data, (*iter)->message, addNewlines),
+          writeCategory);
+      }
 
       length += frame.length();
 
@@ -952,19 +1580,20 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       length += padding;
 
       if (padding) {
-        write_buffer += string(padding, 0);
+        write_batch.pad(padding);
       }
 
       if (writeCategory) {
-        write_buffer += category_frame;
-        write_buffer += (*iter)->category + "\n";
+        write_batch.copy(category_frame);
+        write_batch.add((*iter)->category.data(), (*iter)->category.length());
+        write_batch.copy("\n", 1);
       }
 
-      write_buffer += frame;
-      write_buffer += (*iter)->message;
+      write_batch.copy(frame);
+      write_batch.add((*iter)->message.data(), (*iter)->message.length());
 
       if (addNewlines) {
-        write_buffer += "\n";
+        write_batch.copy("\n", 1);
       }
 
       current_size_buffered += length;
@@ -973,7 +1602,7 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // Write buffer if processing last message or if larger than allowed
       if ((current_size_buffered > max_write_size && maxSize != 0) ||
           messages->end() == iter + 1 ) {
-        if (!write_file->write(write_buffer)) {
+        if (!write_batch.write(write_file.get())) {
           LOG_OPER("[%s] File store failed to write (%lu) messages to file",
                    categoryHandled.c_str(), messages->size());
           setStatus("File write error");
@@ -981,11 +1610,14 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
           break;
         }
 
+        if (!file) {
+          noteWritten(currentFilename, current_size_buffered);
+        }
         num_written += num_buffered;
         currentSize += current_size_buffered;
         num_buffered = 0;
         current_size_buffered = 0;
-        write_buffer = "";
+        write_batch.clear();
       }
 
       // rotate file if large enough and not writing to a separate file
@@ -1026,36 +1658,116 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
 // currently gets invoked from within a bufferstore
 void FileStore::deleteOldest(struct tm* now) {
 
-  int index = findOldestFile(makeBaseFilename(now));
-  if (index < 0) {
+  string filename = findOldestFilename(makeBaseFilename(now));
+  if (filename.empty()) {
+    forgetRead();
+    return;
+  }
+
+  // a batch from the middle of the file only moves the cursor
+  if (filename == readFilename && !readToEnd) {
+    unsigned long offset = readOffsets.empty() ? readStart : readOffsets.back();
+    forgetRead();
+    if (!saveCursor(filename, offset)) {
+      LOG_OPER("[%s] Failed to save read cursor for <%s>, "
+               "messages after it will be sent again",
+               categoryHandled.c_str(), filename.c_str());
+    }
     return;
   }
+  forgetRead();
+
   shared_ptr<FileInterface> deletefile = FileInterface::createFileInterface(fsType,
-                                            makeFullFilename(index, now));
+                                            filename);
   if (lostBytes_) {
     g_Handler->incCounter(categoryHandled, "bytes lost", lostBytes_);
     lostBytes_ = 0;
   }
   deletefile->deleteFile();
+  deleteCursor(filename);
+  unindexFile(makeBaseFilename(now), filename);
+}
+
+string FileStore::cursorFilename(const string& filename) {
+  return filename + ".cursor";
+}
+
+unsigned long FileStore::loadCursor(const string& filename) {
+  unsigned long offset = 0;
+  std::ifstream cursor_file(cursorFilename(filename).c_str());
+  if (cursor_file.good()) {
+    cursor_file >> offset;
+  }
+  return cursor_file.fail() ? 0 : offset;
+}
+
+// Writes a temporary file and renames it over the cursor, so a crash
+// leaves either the old or the new offset.
+// The cursor is only moved once the messages before it are sent, so it
+// has to be on disk before anyone can rely on it.
+bool FileStore::saveCursor(const string& filename, unsigned long offset) {
+  ostringstream cursor;
+  cursor << offset << endl;
+  return FileInterface::replaceLocalFile(cursorFilename(filename),
+                                         cursor.str());
+}
+
+void FileStore::deleteCursor(const string& filename) {
+  // cursors are only kept for local files
+  if (0 == fsType.compare("std") || 0 == fsType.compare("posix")) {
+    unlink(cursorFilename(filename).c_str());
+  }
+}
+
+void FileStore::forgetRead() {
+  readFilename.clear();
+  readEntries.clear();
+  readOffsets.clear();
+  readStart = 0;
+  readToEnd = false;
 }
 
 // Replace the messages in the oldest file at this timestamp with the input messages
 bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                               struct tm* now) {
   string base_name = makeBaseFilename(now);
-  int index = findOldestFile(base_name);
-  if (index < 0) {
+  string filename = findOldestFilename(base_name);
+  if (filename.empty()) {
+    forgetRead();
     LOG_OPER("[%s] Could not find files <%s>", categoryHandled.c_str(), base_name.c_str());
     return false;
   }
 
-  string filename = makeFullFilename(index, now);
+  // If the messages left are the tail of the last batch read, which is
+  // what a primary store that handled some of them leaves, moving the
+  // cursor past the others is all it takes.
+  if (filename == readFilename && !messages->empty() &&
+      messages->size() <= readEntries.size() &&
+      messages->front() == readEntries[readEntries.size() - messages->size()]) {
+    unsigned long handled = readEntries.size() - messages->size();
+    unsigned long offset = handled ? readOffsets[handled - 1] : readStart;
+    forgetRead();
+    if (saveCursor(filename, offset)) {
+      return true;
+    }
+    LOG_OPER("[%s] Failed to save read cursor for <%s>, rewriting it",
+             categoryHandled.c_str(), filename.c_str());
+  }
+  bool partial = (filename == readFilename && !readToEnd);
+  unsigned long start = readStart;
+  forgetRead();
+  if (partial) {
+    // Rewriting would drop the rest of the file, so send the whole batch
+    // again instead.
+    LOG_OPER("[%s] Can't replace messages in the middle of <%s>, "
+             "will resend them", categoryHandled.c_str(), filename.c_str());
+    return saveCursor(filename, start);
+  }
 
   // Need to close and reopen store in case we already have this file open
   close();
 
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType,
-                                          filename, isBufferFile);
+  shared_ptr<FileInterface> infile = createFile(filename);
 
   // overwrite the old contents of the file
   bool success;
@@ -1070,67 +1782,131 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
 
   // close this file and re-open store
   infile->close();
+  deleteCursor(filename);
   open();
 
   return success;
 }
 
+// Next frame for readOldest(), from whichever reader it uses
+static long readFrame(MappedFrameReader* mapped, FileInterface* infile,
+                      string& buffer, const char** data) {
+  if (mapped) {
+    return mapped->next(data);
+  }
+  long result = infile->readNext(buffer);
+  *data = buffer.data();
+  return result;
+}
+
 bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                            struct tm* now) {
 
   long loss;
 
-  int index = findOldestFile(makeBaseFilename(now));
-  if (index < 0) {
+  forgetRead();
+  std::string filename = findOldestFilename(makeBaseFilename(now));
+  if (filename.empty()) {
     // This isn't an error. It's legit to call readOldest when there aren't any
     // files left, in which case the call succeeds but returns messages empty.
     return true;
   }
-  std::string filename = makeFullFilename(index, now);
 
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType,
-                                              filename, isBufferFile);
+  // Uncompressed local files are read through a mapping, which saves
+  // copying every frame into a buffer before it goes into its LogEntry.
+  shared_ptr<FileInterface> infile;
+  shared_ptr<MappedFrameReader> mapped;
+  bool success;
+  if (CompressedFile::codecFromFilename(filename).empty() &&
+      (0 == fsType.compare("std") || 0 == fsType.compare("posix"))) {
+    mapped.reset(new MappedFrameReader(filename));
+    success = mapped->open();
+    if (success) {
+      readStart = loadCursor(filename);
+      if (!mapped->seek(readStart)) {
+        LOG_OPER("[%s] Read cursor of <%s> is past its end, ignoring it",
+                 categoryHandled.c_str(), filename.c_str());
+        readStart = 0;
+      }
+      if (readBatchSize > 0) {
+        readFilename = filename;
+      }
+    }
+  } else {
+    infile = createFile(filename);
+    success = infile->openRead();
+  }
 
-  if (!infile->openRead()) {
+  if (!success) {
     LOG_OPER("[%s] Failed to open file <%s> for reading",
             categoryHandled.c_str(), filename.c_str());
+    // maybe the file is gone and the index out of date
+    invalidateFileIndex();
+    forgetRead();
     return false;
   }
 
-  uint32_t bsize = 0;
-  std::string message;
-  while ((loss = infile->readNext(message)) > 0) {
-    if (!message.empty()) {
-      logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
-
-      // check whether a category is stored with the message
-      if (writeCategory) {
-        // get category without trailing \n
-        entry->category = message.substr(0, message.length() - 1);
+  // Local files skip damaged checksummed frames and go on with the next
+  // good one, and return 0 after anything else that is lost.
+  bool resumes = (0 == fsType.compare("std") || 0 == fsType.compare("posix"));
+  long lost = 0;
 
-        if ((loss = infile->readNext(message)) <= 0) {
-          LOG_OPER("[%s] category not stored with message <%s> "
-              "corruption?, incompatible config change?",
-              categoryHandled.c_str(), entry->category.c_str());
-          break;
+  uint32_t bsize = 0;
+  std::string buffer;
+  const char* data = NULL;
+  while ((loss = readFrame(mapped.get(), infile.get(), buffer, &data)) != 0) {
+    if (loss < 0) {
+      lost -= loss;
+      if (resumes) {
+        continue;
+      }
+      break;
+    }
+    logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+
+    // check whether a category is stored with the message
+    if (writeCategory) {
+      // get category without trailing \n
+      entry->category.assign(data, loss - 1);
+
+      if ((loss = readFrame(mapped.get(), infile.get(), buffer, &data)) <= 0) {
+        LOG_OPER("[%s] category not stored with message <%s> "
+            "corruption?, incompatible config change?",
+            categoryHandled.c_str(), entry->category.c_str());
+        if (loss < 0) {
+          lost -= loss;
+          if (resumes) {
+            continue;
+          }
         }
-      } else {
-        entry->category = categoryHandled;
+        break;
       }
+    } else {
+      entry->category = categoryHandled;
+    }
+
+    entry->message.assign(data, loss);
 
-      entry->message = message;
+    messages->push_back(entry);
+    bsize += entry->category.size();
+    bsize += entry->message.size();
 
-      messages->push_back(entry);
-      bsize += entry->category.size();
-      bsize += entry->message.size();
+    if (!readFilename.empty()) {
+      readEntries.push_back(entry);
+      readOffsets.push_back(mapped->tell());
+      if (mapped->tell() - readStart >= readBatchSize) {
+        break;
+      }
     }
   }
-  if (loss < 0) {
-    lostBytes_ = -loss;
+  // the batch ended at the end of the file, or at corruption
+  readToEnd = (loss <= 0);
+  lostBytes_ = lost;
+  if (mapped) {
+    mapped->close();
   } else {
-    lostBytes_ = 0;
+    infile->close();
   }
-  infile->close();
 
   LOG_OPER("[%s] read <%lu> entries of <%d> bytes from file <%s>",
         categoryHandled.c_str(), messages->size(), bsize, filename.c_str());
@@ -1138,15 +1914,37 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
 }
 
 bool FileStore::empty(struct tm* now) {
-  std::vector<std::string> files = FileInterface::list(filePath, fsType);
-
   std::string base_filename = makeBaseFilename(now);
+
+  if (useFileIndex) {
+    file_index_t& indexed = indexedFiles(base_filename);
+    bool consistent = true;
+    for (file_index_t::iterator iter = indexed.begin();
+         iter != indexed.end();
+         ++iter) {
+      struct stat st;
+      if (stat((filePath + '/' + iter->second).c_str(), &st) != 0) {
+        consistent = false;
+        break;
+      }
+      if (st.st_size > 0) {
+        return false;
+      }
+    }
+    if (consistent) {
+      return true;
+    }
+    // a file went away behind our back, look at the directory instead
+    invalidateFileIndex();
+  }
+
+  std::vector<std::string> files = FileInterface::list(filePath, fsType);
   for (std::vector<std::string>::iterator iter = files.begin();
        iter != files.end();
        ++iter) {
     int suffix =  getFileSuffix(*iter, base_filename);
     if (-1 != suffix) {
-      std::string fullname = makeFullFilename(suffix, now);
+      std::string fullname = filePath + '/' + *iter;
       shared_ptr<FileInterface> file = FileInterface::createFileInterface(fsType,
                                                                       fullname);
       if (file->fileSize()) {
@@ -1371,15 +2169,34 @@ BufferStore::BufferStore(StoreQueue* storeq,
     numContSuccess(0),
     state(DISCONNECTED),
     flushStreaming(false),
-    maxByPassRatio(DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO) {
+    maxByPassRatio(DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO),
+    replayThread(false),
+    replayerStarted(false),
+    replayerStopping(false),
+    replaying(false),
+    replayResult(REPLAY_MORE),
+    replaySent(0),
+    replayInFlight(false),
+    replayMsgsPerSec(0),
+    replayBytesPerSec(0),
+    replayBurstSec(1.0),
+    replayAdaptiveRate(false) {
 
     lastOpenAttempt = time(NULL);
+    pthread_mutex_init(&replayMutex, NULL);
+    pthread_cond_init(&replayCond, NULL);
+    pthread_mutex_init(&secondaryMutex, NULL);
+    pthread_cond_init(&replayInFlightCond, NULL);
 
   // we can't open the client conection until we get configured
 }
 
 BufferStore::~BufferStore() {
-
+  stopReplayThread();
+  pthread_mutex_destroy(&replayMutex);
+  pthread_cond_destroy(&replayCond);
+  pthread_mutex_destroy(&secondaryMutex);
+  pthread_cond_destroy(&replayInFlightCond);
 }
 
 void BufferStore::configure(pStoreConf configuration, pStoreConf parent) {
@@ -1434,6 +2251,23 @@ void BufferStore::configure(pStoreConf configuration, pStoreConf parent) {
     adaptiveBackoff = true;
   }
 
+  if (configuration->getString("replay_thread", tmp) && tmp == "yes") {
+    replayThread = replayBuffer;
+  }
+
+  configuration->getUnsigned("replay_msgs_per_sec", replayMsgsPerSec);
+  configuration->getUnsignedLongLong("replay_bytes_per_sec", replayBytesPerSec);
+  configuration->getFloat("replay_burst_sec", replayBurstSec);
+  if (replayBurstSec <= 0) {
+    LOG_OPER("[%s] Bad config - replay_burst_sec must be positive, using 1",
+             categoryHandled.c_str());
+    replayBurstSec = 1.0;
+  }
+  if (configuration->getString("replay_adaptive_rate", tmp) && tmp == "yes") {
+    replayAdaptiveRate = true;
+  }
+  createReplayBuckets();
+
   if (retryIntervalRange > avgRetryInterval) {
     LOG_OPER("[%s] Bad config - retry_interval_range must be less than retry_interval. Using <%d> as range instead of <%d>",
              categoryHandled.c_str(), (int)avgRetryInterval,
@@ -1487,8 +2321,26 @@ void BufferStore::configure(pStoreConf configuration, pStoreConf parent) {
       primaryStore = createStore(storeQueue, type, categoryHandled, false,
                                   multiCategory);
       primaryStore->configure(primary_store_conf, storeConf);
+
+      // Two stores writing the same files would get in each other's way,
+      // but two connections to the same server don't. The replay primary
+      // never uses the connection pool, which would put it on the same
+      // connection as primaryStore.
+      if (replayThread && 0 == type.compare("network")) {
+        pStoreConf replay_store_conf(new StoreConf(*primary_store_conf));
+        replay_store_conf->setString("use_conn_pool", "no");
+        replayPrimary = createStore(storeQueue, type, categoryHandled, false,
+                                    multiCategory);
+        replayPrimary->configure(replay_store_conf, storeConf);
+      } else if (replayThread) {
+        LOG_OPER("[%s] Bad config - replay_thread needs a network primary "
+                 "store, not <%s>", categoryHandled.c_str(), type.c_str());
+      }
     }
   }
+  if (!replayPrimary) {
+    replayThread = false;
+  }
 
   // If the config is bad we'll still try to write the data to a
   // default location on local disk.
@@ -1505,9 +2357,13 @@ void BufferStore::configure(pStoreConf configuration, pStoreConf parent) {
 bool BufferStore::isOpen() {
   if (!primaryStore || !secondaryStore) {
     return false;
-  } else {
-    return primaryStore->isOpen() || secondaryStore->isOpen();
+  } else if (primaryStore->isOpen()) {
+    return true;
   }
+  pthread_mutex_lock(&secondaryMutex);
+  bool open = secondaryStore->isOpen();
+  pthread_mutex_unlock(&secondaryMutex);
+  return open;
 }
 
 bool BufferStore::open() {
@@ -1524,7 +2380,9 @@ bool BufferStore::open() {
       changeState(STREAMING);
     }
   } else {
+    pthread_mutex_lock(&secondaryMutex);
     secondaryStore->open();
+    pthread_mutex_unlock(&secondaryMutex);
     changeState(DISCONNECTED);
   }
 
@@ -1532,22 +2390,36 @@ bool BufferStore::open() {
 }
 
 void BufferStore::close() {
+  // the replay thread is done with replayPrimary once it has exited
+  stopReplayThread();
+  if (replayPrimary && replayPrimary->isOpen()) {
+    replayPrimary->flush();
+    replayPrimary->close();
+  }
+
   if (primaryStore->isOpen()) {
     primaryStore->flush();
     primaryStore->close();
   }
+  pthread_mutex_lock(&secondaryMutex);
   if (secondaryStore->isOpen()) {
     secondaryStore->flush();
     secondaryStore->close();
   }
+  pthread_mutex_unlock(&secondaryMutex);
 }
 
 bool BufferStore::flush() {
   if (primaryStore->isOpen()) {
     primaryStore->flush();
   }
-  if (secondaryStore->isOpen()) {
-    secondaryStore->flush();
+  // the secondary store is closed while streaming
+  if (state != STREAMING) {
+    pthread_mutex_lock(&secondaryMutex);
+    if (secondaryStore->isOpen()) {
+      secondaryStore->flush();
+    }
+    pthread_mutex_unlock(&secondaryMutex);
   }
   return true;  // FIXME
 }
@@ -1566,15 +2438,26 @@ shared_ptr<Store> BufferStore::copy(const std::string &category) {
   store->maxRetryInterval = maxRetryInterval;
   store->maxRandomOffset = maxRandomOffset;
   store->adaptiveBackoff = adaptiveBackoff;
+  store->replayThread = replayThread;
+  store->replayMsgsPerSec = replayMsgsPerSec;
+  store->replayBytesPerSec = replayBytesPerSec;
+  store->replayBurstSec = replayBurstSec;
+  store->replayAdaptiveRate = replayAdaptiveRate;
+  store->createReplayBuckets();
 
   store->primaryStore = primaryStore->copy(category);
   store->secondaryStore = secondaryStore->copy(category);
+  if (replayPrimary) {
+    store->replayPrimary = replayPrimary->copy(category);
+  }
   return copied;
 }
 
 bool BufferStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
 
-  if (state == STREAMING || (flushStreaming && state == SENDING_BUFFER)) {
+  // the replay thread sends the buffer, so new messages don't have to wait
+  if (state == STREAMING ||
+      ((flushStreaming || replayThread) && state == SENDING_BUFFER)) {
     if (primaryStore->handleMessages(messages)) {
       if (adaptiveBackoff) {
         setNewRetryInterval(true);
@@ -1586,8 +2469,16 @@ bool BufferStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
   }
 
   if (state != STREAMING) {
-    // If this fails there's nothing else we can do here.
-    return secondaryStore->handleMessages(messages);
+    // Wait for the group being sent, the replay thread deletes it from
+    // the secondary store once it is through and must not take these
+    // along with it. If this fails there's nothing else we can do here.
+    pthread_mutex_lock(&secondaryMutex);
+    while (replayInFlight) {
+      pthread_cond_wait(&replayInFlightCond, &secondaryMutex);
+    }
+    bool success = secondaryStore->handleMessages(messages);
+    pthread_mutex_unlock(&secondaryMutex);
+    return success;
   }
 
   return false;
@@ -1595,6 +2486,7 @@ bool BufferStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
 
 // handles entry and exit conditions for states
 void BufferStore::changeState(buffer_state_t new_state) {
+  pthread_mutex_lock(&secondaryMutex);
 
   // leaving this state
   switch (state) {
@@ -1607,6 +2499,9 @@ void BufferStore::changeState(buffer_state_t new_state) {
     setStatus("");
     break;
   case SENDING_BUFFER:
+    if (replayThread) {
+      stopReplay();
+    }
     break;
   default:
     break;
@@ -1634,10 +2529,14 @@ void BufferStore::changeState(buffer_state_t new_state) {
     if (!secondaryStore->isOpen()) {
       secondaryStore->open();
     }
+    if (replayThread) {
+      startReplay();
+    }
     break;
   default:
     break;
   }
+  pthread_mutex_unlock(&secondaryMutex);
 
   LOG_OPER("[%s] Changing state from <%s> to <%s>",
       categoryHandled.c_str(), stateAsString(state), stateAsString(new_state));
@@ -1648,7 +2547,11 @@ void BufferStore::periodicCheck() {
 
   // This class is responsible for checking its children
   primaryStore->periodicCheck();
-  secondaryStore->periodicCheck();
+  if (state != STREAMING) {
+    pthread_mutex_lock(&secondaryMutex);
+    secondaryStore->periodicCheck();
+    pthread_mutex_unlock(&secondaryMutex);
+  }
 
   time_t now = time(NULL);
   struct tm nowinfo;
@@ -1666,6 +2569,11 @@ void BufferStore::periodicCheck() {
 
   // send data in case of backup
   if (state == SENDING_BUFFER) {
+    if (replayThread) {
+      checkReplay();
+      return;
+    }
+
     // if queue size is getting large return so that there is time to forward
     // incoming messages directly to the primary store without buffering to
     // secondary store.
@@ -1677,78 +2585,341 @@ void BufferStore::periodicCheck() {
       }
     }
 
-    // Read a group of messages from the secondary store and send them to
-    // the primary store. Note that the primary store could tell us to try
-    // again later, so this isn't very efficient if it reads too many
-    // messages at once. (if the secondary store is a file, the number of
-    // messages read is controlled by the max file size)
-    // parameter max_size for filestores in the configuration
-    unsigned sent = 0;
-    try {
-      for (sent = 0; sent < bufferSendRate; ++sent) {
-        boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
-        // Reads come complete buffered file
-        // this file size is controlled by max_size in the configuration
-        if (secondaryStore->readOldest(messages, &nowinfo)) {
-
-          unsigned long size = messages->size();
-          if (size) {
-            if (primaryStore->handleMessages(messages)) {
-              secondaryStore->deleteOldest(&nowinfo);
-              if (adaptiveBackoff) {
-                setNewRetryInterval(true);
-              }
-            } else {
-
-              if (messages->size() != size) {
-                // We were only able to process some, but not all of this batch
-                // of messages.  Replace this batch of messages with
-                // just the messages that were not processed.
-                LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
-                    categoryHandled.c_str(), size - messages->size(), size);
-
-                // Put back un-handled messages
-                if (!secondaryStore->replaceOldest(messages, &nowinfo)) {
-                  // Nothing we can do but try to remove oldest messages and
-                  // report a loss
-                  LOG_OPER("[%s] buffer store secondary store lost %lu messages",
-                      categoryHandled.c_str(), messages->size());
-                  g_Handler->incCounter(categoryHandled, "lost", messages->size());
-                  secondaryStore->deleteOldest(&nowinfo);
-                }
-              }
-              changeState(DISCONNECTED);
-              break;
-            }
-          }  else {
-            // else it's valid for read to not find anything but not error
-            secondaryStore->deleteOldest(&nowinfo);
-          }
-        } else {
-          // This is bad news. We'll stay in the sending state
-          // and keep trying to read.
-          setStatus("Failed to read from secondary store");
-          LOG_OPER("[%s] WARNING: buffer store can't read from secondary store",
-              categoryHandled.c_str());
+    unsigned long sent = 0;
+    replay_result_t result = replayFiles(primaryStore, &nowinfo, sent);
+    if (adaptiveBackoff) {
+      for (; sent > 0; --sent) {
+        setNewRetryInterval(true);
+      }
+    }
+    if (result == REPLAY_DONE) {
+      LOG_OPER("[%s] No more buffer files to send, switching to streaming mode",
+          categoryHandled.c_str());
+      changeState(STREAMING);
+    } else if (result == REPLAY_FAILED) {
+      changeState(DISCONNECTED);
+    }
+  }// if state == SENDING_BUFFER
+}
+
+/*
+ * Sends up to bufferSendRate groups of messages from the secondary store
+ * to primary, and sets sent to how many made it. secondaryMutex is only
+ * held around the calls to secondaryStore, not while a group is being
+ * sent, but replayInFlight keeps new messages out of the secondary store
+ * until the group has been deleted from it. Like changeState(), it may
+ * take replayMutex while holding secondaryMutex, never the other way.
+ */
+BufferStore::replay_result_t
+BufferStore::replayFiles(shared_ptr<Store> primary, struct tm* now,
+                         unsigned long& sent) {
+  replay_result_t result = REPLAY_MORE;
+  sent = 0;
+
+  // Read a group of messages from the secondary store and send them to
+  // the primary store. Note that the primary store could tell us to try
+  // again later, so this isn't very efficient if it reads too many
+  // messages at once. (if the secondary store is a file, the number of
+  // messages read is controlled by the max file size)
+  // parameter max_size for filestores in the configuration
+  try {
+    for (unsigned long i = 0; i < bufferSendRate; ++i) {
+      if (replayWaitMs() > 0) {
+        // out of budget until the buckets fill up again
+        break;
+      }
+      if (primary == replayPrimary) {
+        // stop if the store thread asked to
+        pthread_mutex_lock(&replayMutex);
+        bool stop = !replaying;
+        pthread_mutex_unlock(&replayMutex);
+        if (stop) {
           break;
         }
+      }
 
-        if (secondaryStore->empty(&nowinfo)) {
-          LOG_OPER("[%s] No more buffer files to send, switching to streaming mode",
-              categoryHandled.c_str());
-          changeState(STREAMING);
+      boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+      // Reads come complete buffered file
+      // this file size is controlled by max_size in the configuration
+      pthread_mutex_lock(&secondaryMutex);
+      bool read = secondaryStore->readOldest(messages, now);
+      replayInFlight = read && !messages->empty();
+      pthread_mutex_unlock(&secondaryMutex);
+
+      if (read) {
+
+        unsigned long size = messages->size();
+        if (size) {
+          unsigned long long bytes = 0;
+          for (logentry_vector_t::iterator iter = messages->begin();
+               iter != messages->end(); ++iter) {
+            bytes += (*iter)->message.size();
+          }
 
-          break;
+          bool handled = primary->handleMessages(messages);
+
+          pthread_mutex_lock(&secondaryMutex);
+          if (handled) {
+            secondaryStore->deleteOldest(now);
+          } else if (messages->size() != size) {
+            // We were only able to process some, but not all of this batch
+            // of messages.  Replace this batch of messages with
+            // just the messages that were not processed.
+            LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
+                categoryHandled.c_str(), size - messages->size(), size);
+
+            // Put back un-handled messages
+            if (!secondaryStore->replaceOldest(messages, now)) {
+              // Nothing we can do but try to remove oldest messages and
+              // report a loss
+              LOG_OPER("[%s] buffer store secondary store lost %lu messages",
+                  categoryHandled.c_str(), messages->size());
+              g_Handler->incCounter(categoryHandled, "lost", messages->size());
+              secondaryStore->deleteOldest(now);
+            }
+          }
+          pthread_mutex_unlock(&secondaryMutex);
+          endReplayGroup();
+
+          if (handled) {
+            ++sent;
+            chargeReplay(size, bytes);
+            adjustReplayRate(true);
+          } else {
+            adjustReplayRate(false);
+            result = REPLAY_FAILED;
+            break;
+          }
+        }  else {
+          // else it's valid for read to not find anything but not error
+          pthread_mutex_lock(&secondaryMutex);
+          secondaryStore->deleteOldest(now);
+          pthread_mutex_unlock(&secondaryMutex);
         }
+      } else {
+        // This is bad news. We'll stay in the sending state
+        // and keep trying to read.
+        setStatus("Failed to read from secondary store");
+        LOG_OPER("[%s] WARNING: buffer store can't read from secondary store",
+            categoryHandled.c_str());
+        break;
+      }
+
+      pthread_mutex_lock(&secondaryMutex);
+      bool empty = secondaryStore->empty(now);
+      pthread_mutex_unlock(&secondaryMutex);
+      if (empty) {
+        result = REPLAY_DONE;
+        break;
       }
-    } catch(const std::exception& e) {
-      LOG_OPER("[%s] Failed in secondary to primary transfer ",
-          categoryHandled.c_str());
-      LOG_OPER("Exception: %s", e.what());
-      setStatus("bufferstore sending_buffer failure");
-      changeState(DISCONNECTED);
     }
-  }// if state == SENDING_BUFFER
+  } catch(const std::exception& e) {
+    LOG_OPER("[%s] Failed in secondary to primary transfer ",
+        categoryHandled.c_str());
+    LOG_OPER("Exception: %s", e.what());
+    setStatus("bufferstore sending_buffer failure");
+    result = REPLAY_FAILED;
+    endReplayGroup();
+  }
+
+  return result;
+}
+
+// Lets new messages into the secondary store again
+void BufferStore::endReplayGroup() {
+  pthread_mutex_lock(&secondaryMutex);
+  replayInFlight = false;
+  pthread_cond_broadcast(&replayInFlightCond);
+  pthread_mutex_unlock(&secondaryMutex);
+}
+
+static void* replayStatic(void* this_ptr) {
+  BufferStore* store = (BufferStore*)this_ptr;
+  store->replayMember();
+  return NULL;
+}
+
+// Sends the buffer for as long as replaying is set. Called by changeState(),
+// so secondaryMutex is held.
+void BufferStore::startReplay() {
+  pthread_mutex_lock(&replayMutex);
+  if (!replayerStarted) {
+    replayerStopping = false;
+    if (pthread_create(&replayer, NULL, replayStatic, (void*) this) != 0) {
+      LOG_OPER("[%s] Failed to create replay thread, sending the buffer from "
+               "the store thread instead", categoryHandled.c_str());
+      replayThread = false;
+      pthread_mutex_unlock(&replayMutex);
+      return;
+    }
+    replayerStarted = true;
+  }
+  replaying = true;
+  replayResult = REPLAY_MORE;
+  pthread_cond_signal(&replayCond);
+  pthread_mutex_unlock(&replayMutex);
+}
+
+// Stops after the groups being sent. Called by changeState(), so
+// secondaryMutex is held.
+void BufferStore::stopReplay() {
+  pthread_mutex_lock(&replayMutex);
+  replaying = false;
+  pthread_mutex_unlock(&replayMutex);
+}
+
+// Moves on from SENDING_BUFFER once the replay thread is done
+void BufferStore::checkReplay() {
+  pthread_mutex_lock(&replayMutex);
+  unsigned long sent = replaySent;
+  replaySent = 0;
+  replay_result_t result = replaying ? REPLAY_MORE : replayResult;
+  pthread_mutex_unlock(&replayMutex);
+
+  if (adaptiveBackoff) {
+    for (; sent > 0; --sent) {
+      setNewRetryInterval(true);
+    }
+  }
+  if (result == REPLAY_DONE) {
+    LOG_OPER("[%s] No more buffer files to send, switching to streaming mode",
+        categoryHandled.c_str());
+    changeState(STREAMING);
+  } else if (result == REPLAY_FAILED) {
+    changeState(DISCONNECTED);
+  }
+}
+
+void BufferStore::stopReplayThread() {
+  pthread_mutex_lock(&replayMutex);
+  if (!replayerStarted) {
+    pthread_mutex_unlock(&replayMutex);
+    return;
+  }
+  replayerStopping = true;
+  replaying = false;
+  pthread_cond_signal(&replayCond);
+  pthread_mutex_unlock(&replayMutex);
+
+  pthread_join(replayer, NULL);
+  replayerStarted = false;
+}
+
+void BufferStore::replayMember() {
+  pthread_mutex_lock(&replayMutex);
+  while (!replayerStopping) {
+    if (!replaying) {
+      pthread_cond_wait(&replayCond, &replayMutex);
+      continue;
+    }
+    pthread_mutex_unlock(&replayMutex);
+
+    time_t now = time(NULL);
+    struct tm nowinfo;
+    localtime_r(&now, &nowinfo);
+
+    replayPrimary->periodicCheck();
+    unsigned long sent = 0;
+    replay_result_t result = replayFiles(replayPrimary, &nowinfo, sent);
+
+    // wait for the budget to allow more, or after failing to read
+    unsigned long wait_ms = replayWaitMs();
+    if (wait_ms == 0 && sent == 0) {
+      wait_ms = BUFFERSTORE_REPLAY_RETRY_MS;
+    }
+
+    pthread_mutex_lock(&replayMutex);
+    replaySent += sent;
+    if (result != REPLAY_MORE && replaying) {
+      // periodicCheck() takes it from here
+      replaying = false;
+      replayResult = result;
+    } else if (result == REPLAY_MORE && wait_ms > 0 && !replayerStopping) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += wait_ms / 1000;
+      deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&replayCond, &replayMutex, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&replayMutex);
+}
+
+void BufferStore::createReplayBuckets() {
+  replayMsgBucket.reset();
+  replayByteBucket.reset();
+  if (replayMsgsPerSec > 0) {
+    replayMsgBucket.reset(new TokenBucket(replayMsgsPerSec,
+                                          replayMsgsPerSec * replayBurstSec));
+  }
+  if (replayBytesPerSec > 0) {
+    replayByteBucket.reset(new TokenBucket(replayBytesPerSec,
+                                           replayBytesPerSec * replayBurstSec));
+  }
+}
+
+// How long until the replay budget allows another group, 0 if it does now
+unsigned long BufferStore::replayWaitMs() {
+  double seconds = 0;
+  if (replayMsgBucket) {
+    seconds = max(seconds, replayMsgBucket->secondsUntilAvailable());
+  }
+  if (replayByteBucket) {
+    seconds = max(seconds, replayByteBucket->secondsUntilAvailable());
+  }
+  return (unsigned long)ceil(seconds * 1000);
+}
+
+void BufferStore::chargeReplay(unsigned long messages,
+                               unsigned long long bytes) {
+  if (replayMsgBucket) {
+    replayMsgBucket->consume(messages);
+  }
+  if (replayByteBucket) {
+    replayByteBucket->consume(bytes);
+  }
+}
+
+/*
+ * Additive increase, multiplicative decrease of the replay rates, like
+ * the retry interval with adaptive_backoff: many buffer stores that come
+ * back at once back off together when their primary is overwhelmed, and
+ * only then ramp up again.
+ */
+void BufferStore::adjustReplayRate(bool success) {
+  if (!replayAdaptiveRate) {
+    return;
+  }
+
+  shared_ptr<TokenBucket> buckets[] = { replayMsgBucket, replayByteBucket };
+  double limits[] = { (double)replayMsgsPerSec, (double)replayBytesPerSec };
+  for (int i = 0; i < 2; ++i) {
+    if (!buckets[i]) {
+      continue;
+    }
+    double step = limits[i] / BUFFERSTORE_REPLAY_RATE_STEPS;
+    double rate = buckets[i]->getRate();
+    double new_rate = success ? min(rate + step, limits[i]) :
+                                max(rate / 2, step);
+    if (new_rate != rate) {
+      buckets[i]->setRate(new_rate);
+    }
+  }
+
+  if (!success && replayMsgBucket) {
+    LOG_OPER("[%s] primary store failed, sending the buffer at <%.0f> "
+             "messages per second at most", categoryHandled.c_str(),
+             replayMsgBucket->getRate());
+  }
+  if (!success && replayByteBucket) {
+    LOG_OPER("[%s] primary store failed, sending the buffer at <%.0f> "
+             "bytes per second at most", categoryHandled.c_str(),
+             replayByteBucket->getRate());
+  }
 }
 
 /*
@@ -3060,17 +4231,23 @@ void CategoryStore::close() {
   }
 }
 
+// Messages are handed to the per-category stores in runs of the same
+// category, so the store lookup is done once per run instead of once per
+// message.
 bool CategoryStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
-  shared_ptr<logentry_vector_t> singleMessage(new logentry_vector_t);
+  shared_ptr<logentry_vector_t> runMessages(new logentry_vector_t);
   shared_ptr<logentry_vector_t> failed_messages(new logentry_vector_t);
-  logentry_vector_t::iterator message_iter;
+  logentry_vector_t::iterator run_begin = messages->begin();
+
+  while (run_begin != messages->end()) {
+    const string& category = (*run_begin)->category;
+    logentry_vector_t::iterator run_end = run_begin + 1;
+    while (run_end != messages->end() && (*run_end)->category == category) {
+      ++run_end;
+    }
 
-  for (message_iter = messages->begin();
-      message_iter != messages->end();
-      ++message_iter) {
     map<string, shared_ptr<Store> >::iterator store_iter;
     shared_ptr<Store> store;
-    string category = (*message_iter)->category;
 
     store_iter = stores.find(category);
 
@@ -3086,20 +4263,23 @@ bool CategoryStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages
     if (store == NULL || !store->isOpen()) {
       LOG_OPER("[%s] Failed to open store for category <%s>",
                categoryHandled.c_str(), category.c_str());
-      failed_messages->push_back(*message_iter);
+      failed_messages->insert(failed_messages->end(), run_begin, run_end);
+      run_begin = run_end;
       continue;
     }
 
-    // send this message to the store that handles this category
-    singleMessage->clear();
-    singleMessage->push_back(*message_iter);
+    // send this run to the store that handles this category
+    runMessages->assign(run_begin, run_end);
 
-    if (!store->handleMessages(singleMessage)) {
-      LOG_OPER("[%s] Failed to handle message for category <%s>",
-               categoryHandled.c_str(), category.c_str());
-      failed_messages->push_back(*message_iter);
-      continue;
+    if (!store->handleMessages(runMessages)) {
+      // the store leaves only the messages it did not handle in runMessages
+      LOG_OPER("[%s] Failed to handle %lu messages for category <%s>",
+               categoryHandled.c_str(), runMessages->size(),
+               category.c_str());
+      failed_messages->insert(failed_messages->end(),
+                              runMessages->begin(), runMessages->end());
     }
+    run_begin = run_end;
   }
 
   if (!failed_messages->empty()) {
@@ -32,9 +32,11 @@
 #include "common.h" // includes std libs, thrift, and stl typedefs
 #include "conf.h"
 #include "file.h"
+#include "file_worker.h"
 #include "conn_pool.h"
 #include "store_queue.h"
 #include "network_dynamic_config.h"
+#include "token_bucket.h"
 
 class StoreQueue;
 
@@ -46,6 +48,14 @@ enum roll_period_t {
   ROLL_OTHER
 };
 
+// when a file store syncs what it wrote to disk
+enum durability_t {
+  DURABILITY_NONE,        // never, the OS writes it back whenever
+  DURABILITY_INTERVAL,    // at most sync_interval_ms after writing it
+  DURABILITY_BYTES,       // once sync_bytes have been written
+  DURABILITY_EVERY_BATCH  // before a batch is reported as written
+};
+
 
 /*
  * Abstract class to define the interface for a store
@@ -72,6 +82,11 @@ class Store {
   // Attempts to store messages and returns true if successful.
   // On failure, returns false and messages contains any un-processed messages
   virtual bool handleMessages(boost::shared_ptr<logentry_vector_t> messages) = 0;
+  // Called in pipelined mode with the batch that will be passed to
+  // handleMessages() next, while another thread may be in handleMessages()
+  // with the current batch. Can do any work that doesn't touch state used
+  // by handleMessages().
+  virtual void prepareBatch(boost::shared_ptr<logentry_vector_t> messages) {}
   virtual void periodicCheck() {}
   virtual bool flush() = 0;
 
@@ -135,6 +150,11 @@ class FileStoreBase : public Store {
   // directory
   virtual void printStats();
 
+  // durability, see FileSyncer
+  void noteWritten(const std::string& filename, unsigned long bytes);
+  bool commitWritten();
+  bool syncWritten(bool wait);
+
   // Returns the number of bytes to pad to align to the specified block size
   unsigned long bytesToPad(unsigned long next_message_length,
                            unsigned long current_file_size,
@@ -147,6 +167,17 @@ class FileStoreBase : public Store {
   std::string makeBaseSymlink();
   std::string makeFullSymlink();
   int  findOldestFile(const std::string& base_filename);
+  std::string findOldestFilename(const std::string& base_filename);
+
+  // In-memory index of the files of this store, by base file name and
+  // suffix. Only used when useFileIndex is set, otherwise every lookup
+  // lists the directory. Files opened and deleted through the store keep
+  // it up to date, anything that looks out of date drops it.
+  typedef std::map<int, std::string> file_index_t; // suffix -> file name
+  file_index_t& indexedFiles(const std::string& base_filename);
+  void indexFile(const std::string& base_filename, const std::string& filename);
+  void unindexFile(const std::string& base_filename, const std::string& filename);
+  void invalidateFileIndex();
   int  findNewestFile(const std::string& base_filename);
   int  getFileSuffix(const std::string& filename,
                      const std::string& base_filename);
@@ -172,8 +203,18 @@ class FileStoreBase : public Store {
   bool storeTree;
   bool writeStats;
   unsigned long lzoCompressionLevel;
+  std::string compression;      // codec for local files, see CompressedFile
+  int compressionLevel;         // -1 for the codec's default
+  unsigned long compressionBlockSize;
+  bool backgroundRotation;      // see FileWorker
+  bool frameChecksum;           // see FileInterface::setFrameChecksum()
   bool log_calls;
   bool rotateOnReopen;
+  bool preallocate;             // reserve max_size for every new file
+  file_sync_policy_t syncPolicy;
+  durability_t durability;
+  unsigned long syncIntervalMs;
+  unsigned long long syncBytes;
 
   // State
   unsigned long currentSize;
@@ -184,6 +225,11 @@ class FileStoreBase : public Store {
   unsigned long eventsWritten; // This is how many events this process has
                                // written to the currently open file. It is NOT
                                // necessarily the number of lines in the file
+  bool useFileIndex;
+  std::map<std::string, file_index_t> fileIndex;
+  std::set<std::string> unsyncedFiles; // written to since the last sync
+  unsigned long long unsyncedBytes;
+  unsigned long long lastSyncMs;
 
  private:
   // disallow copy, assignment, and empty construction
@@ -204,6 +250,7 @@ class FileStore : public FileStoreBase {
 
   boost::shared_ptr<Store> copy(const std::string &category);
   bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void prepareBatch(boost::shared_ptr<logentry_vector_t> messages);
   bool isOpen();
   void configure(pStoreConf configuration, pStoreConf parent);
   void close();
@@ -222,17 +269,63 @@ class FileStore : public FileStoreBase {
  protected:
   // Implement FileStoreBase virtual function
   bool openInternal(bool incrementFilename, struct tm* current_time);
+  // compressed according to the file name's extension
+  boost::shared_ptr<FileInterface> createFile(const std::string& name);
+  boost::shared_ptr<FileInterface> createWriteFile(const std::string& name);
+  void retireFile(boost::shared_ptr<FileInterface> file);
+  void preopenNextFile();
+  void dropNextFile();
+  boost::shared_ptr<FileInterface> takeNextFile(const std::string& base_filename,
+                                                std::string& filename);
   bool writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                      boost::shared_ptr<FileInterface> write_file =
                      boost::shared_ptr<FileInterface>());
 
   bool isBufferFile;
   bool addNewlines;
+  unsigned long readBatchSize;  // bytes per readOldest(), 0 for whole files
 
   // State
   boost::shared_ptr<FileInterface> writeFile;
 
+  // background_rotation: the file opened ahead of time for the next
+  // rotation, and the last task handed to the FileWorker
+  boost::shared_ptr<FileInterface> nextFile;
+  std::string nextFilename;
+  std::string nextBase;
+  boost::shared_ptr<OpenFileTask> nextOpen;
+  boost::shared_ptr<FileTask> lastFileTask;
+
+  // The frame headers of preparedMessages one after the other, built by
+  // prepareBatch(), and the length of each. With writeCategory each
+  // message has a category frame before its own.
+  pthread_mutex_t preparedMutex;
+  boost::shared_ptr<logentry_vector_t> preparedMessages;
+  std::string preparedFrames;
+  std::vector<unsigned> preparedFrameLengths;
+  boost::shared_ptr<FileInterface> frameFile; // only used for getFrame()
+
  private:
+  bool takePreparedFrames(boost::shared_ptr<logentry_vector_t> messages,
+                          std::string& frames,
+                          std::vector<unsigned>& frame_lengths);
+
+  // Read cursors, for reading files readBatchSize at a time. The cursor of
+  // a file is the offset of the first message not handled yet, kept in a
+  // sidecar file next to it.
+  std::string cursorFilename(const std::string& filename);
+  unsigned long loadCursor(const std::string& filename);
+  bool saveCursor(const std::string& filename, unsigned long offset);
+  void deleteCursor(const std::string& filename);
+  void forgetRead();
+
+  // What the last readOldest() returned, when it read a batch
+  std::string readFilename;
+  logentry_vector_t readEntries;
+  std::vector<unsigned long> readOffsets; // end of each entry in the file
+  unsigned long readStart;
+  bool readToEnd;               // the batch ends at the end of the file
+
   // disallow copy, assignment, and empty construction
   FileStore(FileStore& rhs);
   FileStore& operator=(FileStore& rhs);
@@ -303,6 +396,8 @@ class BufferStore : public Store {
 
   std::string getStatus();
 
+  void replayMember();
+
  protected:
   // Store we're trying to get the messages to
   boost::shared_ptr<Store> primaryStore;
@@ -318,10 +413,29 @@ class BufferStore : public Store {
     SENDING_BUFFER,  // connected to primary and sending data from secondary
   };
 
+  // how far sending the buffer got
+  enum replay_result_t {
+    REPLAY_MORE,     // there is more to send
+    REPLAY_DONE,     // the secondary store is empty
+    REPLAY_FAILED,   // the primary store failed
+  };
+
   // handles state pre and post conditions
   void changeState(buffer_state_t new_state);
   const char* stateAsString(buffer_state_t state);
 
+  replay_result_t replayFiles(boost::shared_ptr<Store> primary,
+                              struct tm* now, unsigned long& sent);
+  void startReplay();
+  void stopReplay();
+  void checkReplay();
+  void stopReplayThread();
+  void endReplayGroup();
+  void createReplayBuckets();
+  unsigned long replayWaitMs();
+  void chargeReplay(unsigned long messages, unsigned long long bytes);
+  void adjustReplayRate(bool success);
+
   void setNewRetryInterval(bool);
 
   // configuration
@@ -363,6 +477,42 @@ class BufferStore : public Store {
                                   // multiple max_queue_size with
                                   // buffer_bypass_max_ratio.
 
+  // With replay_thread=yes the buffer is sent by a thread of its own,
+  // through a primary store of its own, while new messages keep streaming
+  // to primaryStore. The StoreQueue thread still owns the state machine,
+  // and picks up the outcome in periodicCheck().
+  bool replayThread;
+  boost::shared_ptr<Store> replayPrimary;
+  pthread_t replayer;
+  bool replayerStarted;           // the thread exists
+  bool replayerStopping;          // the thread should exit
+  bool replaying;                 // the thread should send the buffer
+  replay_result_t replayResult;   // how the last replay ended
+  unsigned long replaySent;       // files sent, not reported to
+                                  // setNewRetryInterval() yet
+  pthread_mutex_t replayMutex;    // Must be held for the replay state above
+  pthread_cond_t replayCond;      // signaled when it changes
+
+  // Must be held to use secondaryStore, which both threads do, but not
+  // while sending to a primary store
+  pthread_mutex_t secondaryMutex;
+  bool replayInFlight;            // a group read from secondaryStore is
+                                  // being sent, and new messages must
+                                  // wait before going into secondaryStore
+  pthread_cond_t replayInFlightCond; // signaled when that is over
+
+  // Limits on how fast the buffer is sent, 0 for none. Groups are only
+  // read while both buckets have tokens left, and pay for what they held
+  // once sent. With replay_adaptive_rate the rates are cut in half when
+  // the primary fails to take a group, and grow back with every group
+  // that gets through.
+  unsigned long replayMsgsPerSec;
+  unsigned long long replayBytesPerSec;
+  float replayBurstSec;
+  bool replayAdaptiveRate;
+  boost::shared_ptr<TokenBucket> replayMsgBucket;
+  boost::shared_ptr<TokenBucket> replayByteBucket;
+
  private:
   // disallow copy, assignment, and empty construction
   BufferStore();
@@ -23,6 +23,9 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "store_scheduler.h"
+#include "overflow_queue.h"
+#include "write_ahead_log.h"
 
 #include <boost/foreach.hpp>
 
@@ -31,7 +34,12 @@ using namespace boost;
 using namespace scribe::thrift;
 
 #define DEFAULT_TARGET_WRITE_SIZE  16384LL
-#define DEFAULT_MAX_WRITE_INTERVAL 1
+#define DEFAULT_MAX_WRITE_INTERVAL_MS 1000
+#define DEFAULT_RING_QUEUE_SIZE    65536
+#define DEFAULT_OVERFLOW_SEGMENT_SIZE 67108864LL
+#define DEFAULT_WAL_SEGMENT_SIZE   67108864LL
+
+unsigned long long StoreQueue::totalQueueSize = 0;
 
 void* threadStatic(void *this_ptr) {
   StoreQueue *queue_ptr = (StoreQueue*)this_ptr;
@@ -39,18 +47,50 @@ void* threadStatic(void *this_ptr) {
   return NULL;
 }
 
+static void* writerStatic(void *this_ptr) {
+  StoreQueue *queue_ptr = (StoreQueue*)this_ptr;
+  queue_ptr->writerMember();
+  return NULL;
+}
+
 StoreQueue::StoreQueue(const string& type, const string& category,
-                       unsigned check_period, bool is_model, bool multi_category)
+                       unsigned check_period, bool is_model, bool multi_category,
+                       unsigned store_index)
   : msgQueueSize(0),
+    ringDrainedSize(0),
+    storeThreadIdle(0),
+    spilling(false),
+    unspilledSize(0),
+    overflowPending(false),
+    walQueuedSeq(0),
+    failedWalSeq(0),
     hasWork(false),
+    writerRunning(false),
+    writerStop(false),
+    inFlightWalSeq(0),
+    inFlightDone(false),
+    inFlightSuccess(false),
     stopping(false),
     isModel(is_model),
     multiCategory(multi_category),
     categoryHandled(category),
-    checkPeriod(check_period),
+    storeIndex(store_index),
+    categoryId(NO_CATEGORY_ID),
+    checkPeriodMs(check_period * 1000ULL),
     targetWriteSize(DEFAULT_TARGET_WRITE_SIZE),
-    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL),
-    mustSucceed(true) {
+    maxWriteIntervalMs(DEFAULT_MAX_WRITE_INTERVAL_MS),
+    mustSucceed(true),
+    pipelined(false),
+    ringQueueSize(0),
+    maxQueueMemory(0),
+    overflowSegmentSize(DEFAULT_OVERFLOW_SEGMENT_SIZE),
+    walSegmentSize(DEFAULT_WAL_SEGMENT_SIZE),
+    scheduled(false),
+    finishing(false),
+    finished(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    stopReceived(false) {
 
   store = Store::createStore(this, type, category,
                             false, multiCategory);
@@ -63,15 +103,42 @@ StoreQueue::StoreQueue(const string& type, const string& category,
 StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
                        const std::string &category)
   : msgQueueSize(0),
+    ringDrainedSize(0),
+    storeThreadIdle(0),
+    spilling(false),
+    unspilledSize(0),
+    overflowPending(false),
+    walQueuedSeq(0),
+    failedWalSeq(0),
     hasWork(false),
+    writerRunning(false),
+    writerStop(false),
+    inFlightWalSeq(0),
+    inFlightDone(false),
+    inFlightSuccess(false),
     stopping(false),
     isModel(false),
     multiCategory(example->multiCategory),
     categoryHandled(category),
-    checkPeriod(example->checkPeriod),
+    storeIndex(example->storeIndex),
+    categoryId(NO_CATEGORY_ID),
+    checkPeriodMs(example->checkPeriodMs),
     targetWriteSize(example->targetWriteSize),
-    maxWriteInterval(example->maxWriteInterval),
-    mustSucceed(example->mustSucceed) {
+    maxWriteIntervalMs(example->maxWriteIntervalMs),
+    mustSucceed(example->mustSucceed),
+    pipelined(example->pipelined),
+    ringQueueSize(example->ringQueueSize),
+    maxQueueMemory(example->maxQueueMemory),
+    overflowPath(example->overflowPath),
+    overflowSegmentSize(example->overflowSegmentSize),
+    walPath(example->walPath),
+    walSegmentSize(example->walSegmentSize),
+    scheduled(false),
+    finishing(false),
+    finished(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    stopReceived(false) {
 
   store = example->copyStore(category);
   if (!store) {
@@ -83,40 +150,129 @@ StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
 
 StoreQueue::~StoreQueue() {
   if (!isModel) {
+    // the scheduler must not run or time out a queue that no longer exists
+    if (scheduler) {
+      stop();
+    }
+
+    // anything still queued no longer counts against max_queue_size
+    __atomic_sub_fetch(&totalQueueSize, getSize(), __ATOMIC_RELAXED);
+
     pthread_mutex_destroy(&cmdMutex);
     pthread_mutex_destroy(&msgMutex);
     pthread_mutex_destroy(&hasWorkMutex);
     pthread_cond_destroy(&hasWorkCond);
+    pthread_mutex_destroy(&writerMutex);
+    pthread_cond_destroy(&writerCond);
   }
 }
 
-void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
+bool StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
+  return addMessages(logentry_vector_t(1, entry));
+}
+
+// Takes msgMutex and checks whether to wake the store thread only once
+// for the whole batch. Returns false if the messages could not be logged
+// to the write-ahead log, or spilled behind older spilled messages, in
+// which case the caller should have them sent again.
+bool StoreQueue::addMessages(const logentry_vector_t& entries) {
   if (isModel) {
-    LOG_OPER("ERROR: called addMessage on model store");
-  } else {
-    bool waitForWork = false;
+    LOG_OPER("ERROR: called addMessages on model store");
+    return false;
+  }
+  if (entries.empty()) {
+    return true;
+  }
 
-    pthread_mutex_lock(&msgMutex);
-    msgQueue->push_back(entry);
-    msgQueueSize += entry->message.size();
+  unsigned long long batch_size = 0;
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end(); ++iter) {
+    batch_size += (*iter)->message.size();
+  }
 
-    waitForWork = (msgQueueSize >= targetWriteSize) ? true : false;
-    pthread_mutex_unlock(&msgMutex);
+  bool waitForWork = false;
+  unsigned long long wal_seq = 0;
 
-    // Wake up store thread if we have enough messages
-    if (waitForWork == true) {
-      // signal that there is work to do if not already signaled
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-        hasWork = true;
-        pthread_cond_signal(&hasWorkCond);
+  if (msgRing) {
+    unsigned long long size = __atomic_add_fetch(&msgQueueSize, batch_size,
+                                                 __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&totalQueueSize, batch_size, __ATOMIC_RELAXED);
+    for (logentry_vector_t::const_iterator iter = entries.begin();
+         iter != entries.end(); ++iter) {
+      if (!msgRing->push(*iter)) {
+        // The ring is full. Rather than wait for the store thread, make
+        // room here the way the locked path would; everything pushed
+        // before this entry is moved ahead of it.
+        pthread_mutex_lock(&msgMutex);
+        do {
+          drainRing();
+        } while (!msgRing->push(*iter));
+        pthread_mutex_unlock(&msgMutex);
       }
-      pthread_mutex_unlock(&hasWorkMutex);
     }
+    waitForWork = size >= targetWriteSize &&
+      __atomic_load_n(&storeThreadIdle, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&storeThreadIdle, 0, __ATOMIC_SEQ_CST);
+  } else {
+    pthread_mutex_lock(&msgMutex);
+    if (wal) {
+      wal_seq = wal->write(entries);
+      if (wal_seq == 0) {
+        // not queued either, the client sends them again
+        pthread_mutex_unlock(&msgMutex);
+        LOG_OPER("[%s] ERROR: failed to log %lu messages, refusing them",
+                 categoryHandled.c_str(), entries.size());
+        g_Handler->incCounter(categoryHandled, "wal errors");
+        return false;
+      }
+      walQueuedSeq = wal_seq;
+    }
+    bool spilled = false;
+    if (overflow &&
+        (spilling || msgQueueSize + batch_size > maxQueueMemory)) {
+      spilled = spillMessages(entries);
+      if (!spilled && spilling) {
+        // older messages are on disk, queueing these would overtake them
+        pthread_mutex_unlock(&msgMutex);
+        g_Handler->incCounter(categoryHandled, "spill errors");
+        return false;
+      }
+    }
+    if (spilled) {
+      waitForWork = true;
+    } else {
+      msgQueue->insert(msgQueue->end(), entries.begin(), entries.end());
+      msgQueueSize += batch_size;
+      __atomic_add_fetch(&totalQueueSize, batch_size, __ATOMIC_RELAXED);
+      waitForWork = msgQueueSize >= targetWriteSize;
+    }
+    pthread_mutex_unlock(&msgMutex);
+  }
+
+  // Wake up store thread if we have enough messages
+  if (waitForWork) {
+    signalHasWork();
+  }
+
+  // Only return once the messages are safe on disk. They are queued
+  // already, so if the client sends them again they are stored twice,
+  // which is better than acknowledging messages a crash would lose.
+  if (wal_seq != 0 && !wal->sync(wal_seq)) {
+    LOG_OPER("[%s] ERROR: %lu messages are queued without being logged",
+             categoryHandled.c_str(), entries.size());
+    g_Handler->incCounter(categoryHandled, "wal errors");
+    return false;
   }
+  return true;
 }
 
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
+  // The queue type is decided here rather than in the store thread since
+  // producers may start adding messages as soon as we return.
+  configureWal(configuration);
+  configureRing(configuration);
+  configureOverflow(configuration);
+
   // model store has to handle this inline since it has no queue
   if (isModel) {
     configureInline(configuration);
@@ -127,12 +283,7 @@ void StoreQueue::configureAndOpen(pStoreConf configuration) {
     pthread_mutex_unlock(&cmdMutex);
 
     // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalHasWork();
   }
 }
 
@@ -148,14 +299,18 @@ void StoreQueue::stop() {
     pthread_mutex_unlock(&cmdMutex);
 
     // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalHasWork();
 
-    pthread_join(storeThread, NULL);
+    if (scheduler) {
+      // there is no thread to join, runScheduled() says when it is done
+      pthread_mutex_lock(&hasWorkMutex);
+      while (!finished) {
+        pthread_cond_wait(&hasWorkCond, &hasWorkMutex);
+      }
+      pthread_mutex_unlock(&hasWorkMutex);
+    } else {
+      pthread_join(storeThread, NULL);
+    }
   }
 }
 
@@ -169,12 +324,7 @@ void StoreQueue::open() {
     pthread_mutex_unlock(&cmdMutex);
 
     // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalHasWork();
   }
 }
 
@@ -206,110 +356,359 @@ void StoreQueue::threadMember() {
     return;
   }
 
-  // init time of last periodic check to time of 0
-  time_t last_periodic_check = 0;
+  while (runOnce()) {
+    if (!stopReceived) {
+      waitForWork();
+    }
+  }
 
-  time_t last_handle_messages;
-  time(&last_handle_messages);
+  closeStore();
+}
 
-  struct timespec abs_timeout;
+// Called by a StoreScheduler worker instead of running threadMember().
+// Does one pass of the store loop, then either reschedules the queue or
+// leaves a timer for its next deadline.
+void StoreQueue::runScheduled() {
+  pthread_mutex_lock(&hasWorkMutex);
+  hasWork = false;
+  if (msgRing) {
+    __atomic_store_n(&storeThreadIdle, 0, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&hasWorkMutex);
 
-  bool stop = false;
-  while (!stop || (mustSucceed && (failedMessages || msgQueueSize > 0))) {
+  if (runOnce()) {
+    pthread_mutex_lock(&hasWorkMutex);
+    bool ring_backlog = false;
+    if (msgRing) {
+      // see waitForWork()
+      __atomic_store_n(&storeThreadIdle, 1, __ATOMIC_SEQ_CST);
+      ring_backlog =
+        __atomic_load_n(&msgQueueSize, __ATOMIC_SEQ_CST) >= targetWriteSize;
+    }
 
-    // handle commands
-    //
-    pthread_mutex_lock(&cmdMutex);
-    while (!cmdQueue.empty()) {
-      StoreCommand cmd = cmdQueue.front();
-      cmdQueue.pop();
-
-      switch (cmd.command) {
-      case CMD_CONFIGURE:
-        configureInline(cmd.configuration);
-        break;
-      case CMD_OPEN:
-        openInline();
-        break;
-      case CMD_STOP:
-        stop = true;
-        break;
-      default:
-        LOG_OPER("LOGIC ERROR: unknown command to store queue");
-        break;
-      }
+    if (hasWork || ring_backlog || overflowPending || stopReceived) {
+      // more to do already, go to the back of the run queue
+      pthread_mutex_unlock(&hasWorkMutex);
+      scheduler->schedule(this);
+      return;
     }
 
-    // handle periodic tasks
-    time_t this_loop;
-    time(&this_loop);
-    if (!stop && ((this_loop - last_periodic_check) >= checkPeriod)) {
-      if (store->isOpen()) {
-        store->periodicCheck();
-      }
-      last_periodic_check = this_loop;
+    unsigned long long now = scribe::clock::monotonicNowInMsec();
+    unsigned long long deadline = nextDeadline();
+    scheduler->scheduleAfter(this, deadline > now ? deadline - now : 0);
+    scheduled = false;
+    pthread_mutex_unlock(&hasWorkMutex);
+    return;
+  }
+
+  closeStore();
+
+  // ignore any further wakeups, then make sure the timer is done with us
+  pthread_mutex_lock(&hasWorkMutex);
+  finishing = true;
+  pthread_mutex_unlock(&hasWorkMutex);
+  scheduler->cancel(this);
+
+  pthread_mutex_lock(&hasWorkMutex);
+  finished = true;
+  pthread_cond_broadcast(&hasWorkCond);
+  pthread_mutex_unlock(&hasWorkMutex);
+}
+
+// One pass of the store loop: handle commands, periodic checks and queued
+// messages. Returns false once the queue has stopped and has nothing
+// left to write.
+bool StoreQueue::runOnce() {
+
+  // handle commands
+  //
+  pthread_mutex_lock(&cmdMutex);
+  if (!cmdQueue.empty()) {
+    // commands may reconfigure or reopen the store
+    finishWrite(true);
+  }
+  while (!cmdQueue.empty()) {
+    StoreCommand cmd = cmdQueue.front();
+    cmdQueue.pop();
+
+    switch (cmd.command) {
+    case CMD_CONFIGURE:
+      configureInline(cmd.configuration);
+      break;
+    case CMD_OPEN:
+      openInline();
+      break;
+    case CMD_STOP:
+      stopReceived = true;
+      break;
+    default:
+      LOG_OPER("LOGIC ERROR: unknown command to store queue");
+      break;
     }
+  }
 
-    pthread_mutex_lock(&msgMutex);
-    pthread_mutex_unlock(&cmdMutex);
+  // handle periodic tasks
+  unsigned long long this_loop = scribe::clock::monotonicNowInMsec();
+  if (!stopReceived && ((this_loop - lastPeriodicCheck) >= checkPeriodMs)) {
+    finishWrite(true);
+    if (store->isOpen()) {
+      store->periodicCheck();
+    }
+    lastPeriodicCheck = this_loop;
+  }
+
+  pthread_mutex_lock(&msgMutex);
+  pthread_mutex_unlock(&cmdMutex);
 
-    boost::shared_ptr<logentry_vector_t> messages;
+  boost::shared_ptr<logentry_vector_t> messages;
+  unsigned long long wal_seq = 0;
 
-    // handle messages if stopping, enough time has passed, or queue is large
-    //
-    if (stop ||
-        (this_loop - last_handle_messages >= maxWriteInterval) ||
-        msgQueueSize >= targetWriteSize) {
+  if (msgRing) {
+    drainRing();
+  }
+
+  // once msgQueue is empty the oldest messages are the spilled ones
+  if (spilling && msgQueue->empty()) {
+    readOverflow();
+  }
+  bool spill_backlog = spilling;
+
+  // handle messages if stopping, enough time has passed, queue is large,
+  // or there are spilled messages to catch up on
+  //
+  if (stopReceived || spill_backlog ||
+      (this_loop - lastHandleMessages >= maxWriteIntervalMs) ||
+      getSize() >= targetWriteSize) {
 
-      if (failedMessages) {
-        // process any messages we were not able to process last time
-        messages = failedMessages;
-        failedMessages = boost::shared_ptr<logentry_vector_t>();
-      } else if (msgQueueSize > 0) {
-        // process message in queue
+    if (failedMessages) {
+      // process any messages we were not able to process last time, topped
+      // up with what has been queued since
+      messages = failedMessages;
+      failedMessages = boost::shared_ptr<logentry_vector_t>();
+      wal_seq = failedWalSeq;
+      mergeQueued(*messages, wal_seq);
+    } else if (msgRing) {
+      if (!msgQueue->empty()) {
         messages = msgQueue;
         msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
-        msgQueueSize = 0;
+        __atomic_sub_fetch(&msgQueueSize, ringDrainedSize, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&totalQueueSize, ringDrainedSize,
+                           __ATOMIC_RELAXED);
+        ringDrainedSize = 0;
       }
+    } else if (msgQueueSize > 0) {
+      // process message in queue
+      messages = msgQueue;
+      wal_seq = walQueuedSeq;
+      msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      __atomic_sub_fetch(&totalQueueSize, msgQueueSize, __ATOMIC_RELAXED);
+      msgQueueSize = 0;
+    }
+
+    // reset timer
+    lastHandleMessages = this_loop;
+  }
 
-      // reset timer
-      last_handle_messages = this_loop;
+  // the rest of the spilled messages stays on disk, these have to join them
+  if (stopReceived && !unspilled.empty()) {
+    if (spillMessages(unspilled)) {
+      __atomic_sub_fetch(&msgQueueSize, unspilledSize, __ATOMIC_SEQ_CST);
+      __atomic_sub_fetch(&totalQueueSize, unspilledSize, __ATOMIC_RELAXED);
+      unspilled.clear();
+      unspilledSize = 0;
+    } else {
+      LOG_OPER("[%s] ERROR: %lu messages are still waiting to be spilled",
+               categoryHandled.c_str(), unspilled.size());
     }
+  }
 
-    pthread_mutex_unlock(&msgMutex);
+  pthread_mutex_unlock(&msgMutex);
 
-    if (messages) {
-      if (!store->handleMessages(messages) || !store->flush()) {
-        // Store could not handle these messages
-        processFailedMessages(messages);
-      }
-      else
-      {
-        // now we assume that messages were succesfully committed to the underlying recepient
-        g_Handler->incCounter(categoryHandled, "committed", messages->size());
-        BOOST_FOREACH(boost::shared_ptr<scribe::thrift::LogEntry> message, *messages)
-        {
-          g_Handler->dbgMsgLog->log("committed", message->category, message->message);
-        }
-      }
+  if (messages && pipelined) {
+    // get this batch ready while the previous one is being written
+    store->prepareBatch(messages);
+    if (finishWrite(true)) {
+      startWrite(messages, wal_seq);
+    } else {
+      // the previous batch is retried first, this one goes back behind it
+      requeueFront(messages);
     }
+  } else if (messages) {
+    bool success = store->handleMessages(messages) && store->flush();
+    finishBatch(messages, success, wal_seq);
+  } else {
+    finishWrite(false);
+  }
 
-    if (!stop) {
-      // set timeout to when we need to handle messages or do a periodic check
-      abs_timeout.tv_sec = min(last_periodic_check + checkPeriod,
-          last_handle_messages + maxWriteInterval);
-      abs_timeout.tv_nsec = 0;
+  if (stopReceived) {
+    finishWrite(true);
+  }
 
-      // wait until there's some work to do or we timeout
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-	pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
-      }
-      hasWork = false;
-      pthread_mutex_unlock(&hasWorkMutex);
+  // keep going while catching up on spilled messages, unless the store is
+  // failing. What is left of them on stop stays on disk for the next run.
+  overflowPending = spill_backlog && !failedMessages;
+
+  return !stopReceived || (mustSucceed && (failedMessages || getSize() > 0));
+}
+
+// when we need to handle messages or do a periodic check next
+unsigned long long StoreQueue::nextDeadline() {
+  return min(lastPeriodicCheck + checkPeriodMs,
+             lastHandleMessages + maxWriteIntervalMs);
+}
+
+// wait until there's some work to do or the next deadline
+void StoreQueue::waitForWork() {
+  unsigned long long deadline = nextDeadline();
+  struct timespec abs_timeout;
+  abs_timeout.tv_sec = deadline / 1000;
+  abs_timeout.tv_nsec = (deadline % 1000) * 1000000;
+
+  pthread_mutex_lock(&hasWorkMutex);
+  bool ring_backlog = false;
+  if (msgRing) {
+    // advertise that we are idle before looking at the size, producers
+    // do the opposite (see addMessages)
+    __atomic_store_n(&storeThreadIdle, 1, __ATOMIC_SEQ_CST);
+    ring_backlog =
+      __atomic_load_n(&msgQueueSize, __ATOMIC_SEQ_CST) >= targetWriteSize;
+  }
+  if (!hasWork && !ring_backlog && !overflowPending) {
+    pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
+  }
+  if (msgRing) {
+    __atomic_store_n(&storeThreadIdle, 0, __ATOMIC_SEQ_CST);
+  }
+  hasWork = false;
+  pthread_mutex_unlock(&hasWorkMutex);
+}
+
+// Accounting once the store is done with a batch. Returns false if the
+// batch is kept in failedMessages to be retried.
+bool StoreQueue::finishBatch(shared_ptr<logentry_vector_t> messages,
+                             bool success, unsigned long long wal_seq) {
+  if (!success) {
+    // Store could not handle these messages
+    processFailedMessages(messages);
+    failedWalSeq = wal_seq;
+  }
+  else
+  {
+    // now we assume that messages were succesfully committed to the underlying recepient
+    incCounter(CategoryTable::COMMITTED, messages->size());
+    BOOST_FOREACH(boost::shared_ptr<scribe::thrift::LogEntry> message, *messages)
+    {
+      g_Handler->dbgMsgLog->log("committed", message->category, message->message);
     }
+  }
+
+  // done with them unless they are being retried
+  if (wal && !failedMessages) {
+    wal->release(wal_seq);
+  }
+  return !failedMessages;
+}
 
-  } // while (!stop)
+// Hands a batch to the writer thread, starting it if needed.
+// Nothing may be in flight.
+void StoreQueue::startWrite(shared_ptr<logentry_vector_t> messages,
+                            unsigned long long wal_seq) {
+  pthread_mutex_lock(&writerMutex);
+  if (!writerRunning) {
+    writerRunning = true;
+    writerStop = false;
+    pthread_create(&writerThread, NULL, writerStatic, (void*) this);
+  }
+  inFlight = messages;
+  inFlightWalSeq = wal_seq;
+  inFlightDone = false;
+  pthread_cond_broadcast(&writerCond);
+  pthread_mutex_unlock(&writerMutex);
+}
+
+// Does the accounting for the batch in flight once the writer thread is
+// done with it, waiting for that if wait is set. Returns false if the
+// batch failed and is kept to be retried.
+bool StoreQueue::finishWrite(bool wait) {
+  pthread_mutex_lock(&writerMutex);
+  if (!inFlight || (!wait && !inFlightDone)) {
+    pthread_mutex_unlock(&writerMutex);
+    return true;
+  }
+  while (!inFlightDone) {
+    pthread_cond_wait(&writerCond, &writerMutex);
+  }
+  shared_ptr<logentry_vector_t> messages = inFlight;
+  bool success = inFlightSuccess;
+  unsigned long long wal_seq = inFlightWalSeq;
+  inFlight.reset();
+  pthread_mutex_unlock(&writerMutex);
+
+  return finishBatch(messages, success, wal_seq);
+}
+
+// Put a batch that was taken from msgQueue back at its front.
+void StoreQueue::requeueFront(shared_ptr<logentry_vector_t> messages) {
+  unsigned long long size = 0;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end(); ++iter) {
+    size += (*iter)->message.size();
+  }
+
+  pthread_mutex_lock(&msgMutex);
+  msgQueue->insert(msgQueue->begin(), messages->begin(), messages->end());
+  if (msgRing) {
+    ringDrainedSize += size;
+    __atomic_add_fetch(&msgQueueSize, size, __ATOMIC_SEQ_CST);
+  } else {
+    msgQueueSize += size;
+  }
+  __atomic_add_fetch(&totalQueueSize, size, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&msgMutex);
+}
+
+// Writes whatever the store thread hands over with startWrite().
+void StoreQueue::writerMember() {
+  pthread_mutex_lock(&writerMutex);
+  for (;;) {
+    while (!writerStop && (!inFlight || inFlightDone)) {
+      pthread_cond_wait(&writerCond, &writerMutex);
+    }
+    if (writerStop) {
+      break;
+    }
+
+    shared_ptr<logentry_vector_t> messages = inFlight;
+    pthread_mutex_unlock(&writerMutex);
+    bool success = store->handleMessages(messages) && store->flush();
+    pthread_mutex_lock(&writerMutex);
+
+    inFlightSuccess = success;
+    inFlightDone = true;
+    pthread_cond_broadcast(&writerCond);
+
+    // let the store thread do the accounting
+    pthread_mutex_unlock(&writerMutex);
+    signalHasWork();
+    pthread_mutex_lock(&writerMutex);
+  }
+  pthread_mutex_unlock(&writerMutex);
+}
+
+// Waits for the writer thread to finish and stops it before closing the
+// store.
+void StoreQueue::closeStore() {
+  finishWrite(true);
+
+  pthread_mutex_lock(&writerMutex);
+  bool join = writerRunning;
+  writerStop = true;
+  writerRunning = false;
+  pthread_cond_broadcast(&writerCond);
+  pthread_mutex_unlock(&writerMutex);
+  if (join) {
+    pthread_join(writerThread, NULL);
+  }
 
   store->close();
 }
@@ -324,35 +723,360 @@ void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
 
     LOG_OPER("[%s] WARNING: Re-queueing %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incCounter(categoryHandled, "requeue", messages->size());
+    incCounter(CategoryTable::REQUEUE, messages->size());
   } else {
     // record messages as being lost
     LOG_OPER("[%s] WARNING: Lost %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incCounter(categoryHandled, "lost", messages->size());
+    incCounter(CategoryTable::LOST, messages->size());
+  }
+}
+
+// Move messages from the front of msgQueue to the end of a batch that is
+// being retried, until the batch reaches targetWriteSize. Everything in
+// msgQueue is newer than the retried batch, so order is preserved.
+// Must be called from the store thread with msgMutex held.
+void StoreQueue::mergeQueued(logentry_vector_t& messages,
+                             unsigned long long& wal_seq) {
+  unsigned long long size = 0;
+  for (logentry_vector_t::iterator iter = messages.begin();
+       iter != messages.end(); ++iter) {
+    size += (*iter)->message.size();
+  }
+
+  size_t count = 0;
+  unsigned long long merged = 0;
+  while (count < msgQueue->size() && size + merged < targetWriteSize) {
+    merged += (*msgQueue)[count]->message.size();
+    ++count;
+  }
+
+  // the last sequence number is only known for the whole of msgQueue
+  if (count == 0 || (wal && count < msgQueue->size())) {
+    return;
+  }
+
+  messages.insert(messages.end(), msgQueue->begin(),
+                  msgQueue->begin() + count);
+  msgQueue->erase(msgQueue->begin(), msgQueue->begin() + count);
+  if (msgRing) {
+    ringDrainedSize -= merged;
+    __atomic_sub_fetch(&msgQueueSize, merged, __ATOMIC_SEQ_CST);
+  } else {
+    msgQueueSize -= merged;
+  }
+  __atomic_sub_fetch(&totalQueueSize, merged, __ATOMIC_RELAXED);
+  if (wal) {
+    wal_seq = walQueuedSeq;
+  }
+}
+
+// Move everything the producers have pushed so far into msgQueue.
+// Must be called with msgMutex held, which makes callers take turns as
+// the ring's single consumer. Usually the store thread, or a producer
+// that found the ring full.
+void StoreQueue::drainRing() {
+  logentry_vector_t spilled;
+  unsigned long long spilled_size = 0;
+
+  logentry_ptr_t entry;
+  while (msgRing->pop(entry)) {
+    if (overflow && (spilling || !spilled.empty() ||
+                     ringDrainedSize + entry->message.size() > maxQueueMemory)) {
+      spilled.push_back(entry);
+      spilled_size += entry->message.size();
+    } else {
+      ringDrainedSize += entry->message.size();
+      msgQueue->push_back(entry);
+    }
+  }
+
+  if (spilled.empty()) {
+    return;
+  }
+  // retry what failed to spill last time ahead of the new messages
+  if (!unspilled.empty()) {
+    spilled.insert(spilled.begin(), unspilled.begin(), unspilled.end());
+    spilled_size += unspilledSize;
+    unspilled.clear();
+    unspilledSize = 0;
+  }
+  if (spillMessages(spilled)) {
+    __atomic_sub_fetch(&msgQueueSize, spilled_size, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&totalQueueSize, spilled_size, __ATOMIC_RELAXED);
+  } else if (spilling) {
+    // producers were answered already, keep these behind the spilled ones
+    g_Handler->incCounter(categoryHandled, "spill errors");
+    unspilled.swap(spilled);
+    unspilledSize = spilled_size;
+  } else {
+    ringDrainedSize += spilled_size;
+    msgQueue->insert(msgQueue->end(), spilled.begin(), spilled.end());
+  }
+}
+
+// Write messages to overflow instead of msgQueue, with msgMutex held.
+// Returns false if they could not be written.
+bool StoreQueue::spillMessages(const logentry_vector_t& entries) {
+  if (!overflow->append(entries)) {
+    LOG_OPER("[%s] ERROR: could not spill %lu messages to <%s>",
+             categoryHandled.c_str(), entries.size(), overflowPath.c_str());
+    return false;
+  }
+  if (!spilling) {
+    LOG_OPER("[%s] queue is over %llu bytes, spilling messages to <%s>",
+             categoryHandled.c_str(), maxQueueMemory, overflowPath.c_str());
+    spilling = true;
+  }
+  return true;
+}
+
+// Move up to targetWriteSize bytes of spilled messages back into msgQueue.
+// Must be called from the store thread with msgMutex held.
+void StoreQueue::readOverflow() {
+  unsigned long long size = overflow->read(*msgQueue, targetWriteSize);
+  if (msgRing) {
+    __atomic_add_fetch(&msgQueueSize, size, __ATOMIC_SEQ_CST);
+    ringDrainedSize += size;
+  } else {
+    msgQueueSize += size;
+  }
+  __atomic_add_fetch(&totalQueueSize, size, __ATOMIC_RELAXED);
+
+  if (overflow->empty()) {
+    LOG_OPER("[%s] read back all spilled messages", categoryHandled.c_str());
+    spilling = false;
+
+    // still counted in msgQueueSize, only ever set while draining msgRing
+    msgQueue->insert(msgQueue->end(), unspilled.begin(), unspilled.end());
+    ringDrainedSize += unspilledSize;
+    unspilled.clear();
+    unspilledSize = 0;
+  }
+}
+
+void StoreQueue::signalHasWork() {
+  bool schedule_now = false;
+
+  pthread_mutex_lock(&hasWorkMutex);
+  if (scheduler) {
+    // runScheduled() checks hasWork before it gives up being scheduled
+    if (!finishing) {
+      hasWork = true;
+      if (!scheduled) {
+        scheduled = schedule_now = true;
+      }
+    }
+  } else if (!hasWork) {
+    hasWork = true;
+    pthread_cond_signal(&hasWorkCond);
+  }
+  pthread_mutex_unlock(&hasWorkMutex);
+
+  if (schedule_now) {
+    scheduler->schedule(this);
+  }
+}
+
+void StoreQueue::incCounter(CategoryTable::counter_t counter,
+                            unsigned long amount) {
+  if (categoryId != NO_CATEGORY_ID) {
+    g_Handler->incCounter(categoryId, counter, amount);
+  } else {
+    g_Handler->incCounter(categoryHandled,
+                          CategoryTable::counterName(counter), amount);
   }
 }
 
 void StoreQueue::storeInitCommon() {
   // model store doesn't need this stuff
   if (!isModel) {
+    categoryId = g_categoryTable.intern(categoryHandled);
     msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+    if (ringQueueSize > 0) {
+      msgRing = boost::shared_ptr<msg_ring_t>(new msg_ring_t(ringQueueSize));
+    }
+    if (maxQueueMemory > 0) {
+      openOverflow();
+    }
+    if (!walPath.empty()) {
+      openWal();
+    }
     pthread_mutex_init(&cmdMutex, NULL);
     pthread_mutex_init(&msgMutex, NULL);
     pthread_mutex_init(&hasWorkMutex, NULL);
-    pthread_cond_init(&hasWorkCond, NULL);
+    pthread_mutex_init(&writerMutex, NULL);
+    pthread_cond_init(&writerCond, NULL);
+
+    // deadlines are in CLOCK_MONOTONIC, so wait on that clock too
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hasWorkCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    lastHandleMessages = scribe::clock::monotonicNowInMsec();
+
+    // with a store thread pool the queue runs whenever it is woken up
+    scheduler = g_storeScheduler;
+    if (!scheduler) {
+      pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    }
+  }
+}
+
+void StoreQueue::configureRing(pStoreConf configuration) {
+  string tmp;
+  if (!configuration->getString("ring_queue", tmp) || tmp != "yes") {
+    return;
+  }
+  if (!walPath.empty()) {
+    LOG_OPER("[%s] ring_queue can not be used with wal_path, ignoring it",
+             categoryHandled.c_str());
+    return;
+  }
 
-    pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+  ringQueueSize = DEFAULT_RING_QUEUE_SIZE;
+  configuration->getUnsigned("ring_queue_size", ringQueueSize);
+  if (ringQueueSize == 0) {
+    ringQueueSize = DEFAULT_RING_QUEUE_SIZE;
+  }
+
+  // model stores only pass the setting on to their copies
+  if (!isModel) {
+    // Switching a queue that is already in use is not supported, it would
+    // strand messages in whichever queue is no longer looked at.
+    pthread_mutex_lock(&msgMutex);
+    if (!msgRing && msgQueue->empty()) {
+      msgRing = boost::shared_ptr<msg_ring_t>(new msg_ring_t(ringQueueSize));
+    }
+    pthread_mutex_unlock(&msgMutex);
   }
 }
 
+void StoreQueue::configureOverflow(pStoreConf configuration) {
+  unsigned long long max_memory = 0;
+  string path;
+  configuration->getUnsignedLongLong("max_queue_memory", max_memory);
+  configuration->getString("overflow_path", path);
+  if (max_memory > 0 && path.empty()) {
+    LOG_OPER("[%s] Bad config - max_queue_memory needs an overflow_path, not limiting queue memory",
+             categoryHandled.c_str());
+    max_memory = 0;
+  }
+  if (max_memory > 0 && !walPath.empty()) {
+    LOG_OPER("[%s] max_queue_memory can not be used with wal_path, not limiting queue memory",
+             categoryHandled.c_str());
+    max_memory = 0;
+  }
+
+  // model stores only pass the settings on to their copies
+  if (!isModel) {
+    pthread_mutex_lock(&msgMutex);
+  }
+  maxQueueMemory = max_memory;
+  overflowPath = path;
+  overflowSegmentSize = DEFAULT_OVERFLOW_SEGMENT_SIZE;
+  configuration->getUnsignedLongLong("overflow_segment_size",
+                                     overflowSegmentSize);
+  if (!isModel) {
+    if (maxQueueMemory > 0 && !overflow) {
+      openOverflow();
+    }
+    pthread_mutex_unlock(&msgMutex);
+  }
+}
+
+// Messages spilled by an earlier run are read back before any new ones.
+void StoreQueue::openOverflow() {
+  overflow = boost::shared_ptr<OverflowQueue>(
+    new OverflowQueue(overflowPath, logBaseName(), overflowSegmentSize));
+  spilling = !overflow->empty();
+}
+
+void StoreQueue::configureWal(pStoreConf configuration) {
+  configuration->getString("wal_path", walPath);
+  configuration->getUnsignedLongLong("wal_segment_size", walSegmentSize);
+  if (walSegmentSize == 0) {
+    walSegmentSize = DEFAULT_WAL_SEGMENT_SIZE;
+  }
+
+  // model stores only pass the settings on to their copies
+  if (!isModel && !walPath.empty()) {
+    pthread_mutex_lock(&msgMutex);
+    if (!wal) {
+      openWal();
+    }
+    pthread_mutex_unlock(&msgMutex);
+  }
+}
+
+// Messages an earlier run logged but never handed to the store are queued
+// before any new ones.
+void StoreQueue::openWal() {
+  wal = boost::shared_ptr<WriteAheadLog>(
+    new WriteAheadLog(walPath, logBaseName(), walSegmentSize));
+
+  logentry_vector_t replayed;
+  walQueuedSeq = wal->recover(replayed);
+
+  unsigned long long size = 0;
+  for (logentry_vector_t::iterator iter = replayed.begin();
+       iter != replayed.end(); ++iter) {
+    size += (*iter)->message.size();
+  }
+  msgQueue->insert(msgQueue->begin(), replayed.begin(), replayed.end());
+  msgQueueSize += size;
+  __atomic_add_fetch(&totalQueueSize, size, __ATOMIC_RELAXED);
+}
+
+// Base name of the files the write-ahead log and overflow queue keep.
+// Several stores can handle the same category, e.g. with two default
+// stores, and must not share them.
+string StoreQueue::logBaseName() const {
+  ostringstream name;
+  name << categoryHandled << '.' << storeIndex;
+  return name.str();
+}
+
+// Categories with write-ahead logs left behind by this store
+vector<string> StoreQueue::listLoggedCategories() {
+  vector<string> categories;
+  if (walPath.empty()) {
+    return categories;
+  }
+
+  ostringstream suffix;
+  suffix << '.' << storeIndex;
+  vector<string> names = WriteAheadLog::listLogs(walPath);
+  for (vector<string>::iterator iter = names.begin();
+       iter != names.end(); ++iter) {
+    if (iter->size() > suffix.str().size() &&
+        iter->compare(iter->size() - suffix.str().size(), string::npos,
+                      suffix.str()) == 0) {
+      categories.push_back(iter->substr(0, iter->size() - suffix.str().size()));
+    }
+  }
+  return categories;
+}
+
 void StoreQueue::configureInline(pStoreConf configuration) {
   // Constructor defaults are fine if these don't exist
   configuration->getUnsignedLongLong("target_write_size", targetWriteSize);
-  configuration->getUnsigned("max_write_interval",
-                            (unsigned long&) maxWriteInterval);
-  if (maxWriteInterval == 0) {
-    maxWriteInterval = 1;
+  // the _ms variants take precedence over the ones in whole seconds
+  unsigned long seconds;
+  if (configuration->getUnsigned("max_write_interval", seconds)) {
+    maxWriteIntervalMs = seconds * 1000ULL;
+  }
+  configuration->getUnsignedLongLong("max_write_interval_ms",
+                                     maxWriteIntervalMs);
+  if (maxWriteIntervalMs == 0) {
+    maxWriteIntervalMs = DEFAULT_MAX_WRITE_INTERVAL_MS;
+  }
+  unsigned long long check_period_ms = 0;
+  if (configuration->getUnsignedLongLong("check_period_ms", check_period_ms) &&
+      check_period_ms > 0) {
+    checkPeriodMs = check_period_ms;
   }
 
   string tmp;
@@ -360,6 +1084,9 @@ void StoreQueue::configureInline(pStoreConf configuration) {
     LOG_OPER("[%s] Setting mustSucceed to false.", categoryHandled.c_str());
     mustSucceed = false;
   }
+  if (configuration->getString("pipeline", tmp)) {
+    pipelined = (tmp == "yes");
+  }
 
   store->configure(configuration, pStoreConf());
 }
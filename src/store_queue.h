@@ -25,8 +25,13 @@
 #define SCRIBE_STORE_QUEUE_H
 
 #include "common.h"
+#include "mpsc_ring.h"
+#include "category_table.h"
 
 class Store;
+class StoreScheduler;
+class OverflowQueue;
+class WriteAheadLog;
 
 /*
  * This class implements a queue and a thread for dispatching
@@ -36,12 +41,15 @@ class Store;
 class StoreQueue {
  public:
   StoreQueue(const std::string& type, const std::string& category,
-             unsigned check_period, bool is_model=false, bool multi_category=false);
+             unsigned check_period, bool is_model=false, bool multi_category=false,
+             unsigned store_index=0);
   StoreQueue(const boost::shared_ptr<StoreQueue> example,
              const std::string &category);
   virtual ~StoreQueue();
 
-  void addMessage(logentry_ptr_t entry);
+  bool addMessage(logentry_ptr_t entry);
+  // appends in order, false if the messages must be sent again
+  bool addMessages(const logentry_vector_t& entries);
   void configureAndOpen(pStoreConf configuration); // closes first if already open
   void open();                                     // closes first if already open
   void stop();
@@ -50,21 +58,57 @@ class StoreQueue {
   std::string getBaseType();
   std::string getCategoryHandled();
   bool isModelStore() { return isModel;}
+  // categories with messages in the write-ahead logs of this model store
+  std::vector<std::string> listLoggedCategories();
 
   // this needs to be public for the thread creation to get to it,
   // but no one else should ever call it.
   void threadMember();
 
+  // used by StoreScheduler instead of threadMember() when the queue has
+  // no thread of its own
+  void runScheduled();
+  void writerMember();
+  void wakeUp() { signalHasWork(); }
+
   // WARNING: don't expect this to be exact, because it could change after you check.
   //          This is only for hueristics to decide when we're overloaded.
   inline unsigned long long getSize() {
-    return msgQueueSize;
+    return __atomic_load_n(&msgQueueSize, __ATOMIC_RELAXED);
+  }
+
+  // Sum of getSize() over all queues, maintained as messages are added and
+  // handed to the stores. Same caveat as getSize().
+  static inline unsigned long long getTotalSize() {
+    return __atomic_load_n(&totalQueueSize, __ATOMIC_RELAXED);
   }
  private:
   void storeInitCommon();
+  void configureRing(pStoreConf configuration);
+  void configureOverflow(pStoreConf configuration);
+  void configureWal(pStoreConf configuration);
+  void openWal();
+  std::string logBaseName() const;
+  void openOverflow();
+  bool spillMessages(const logentry_vector_t& entries);
+  void readOverflow();
   void configureInline(pStoreConf configuration);
   void openInline();
   void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void mergeQueued(logentry_vector_t& messages, unsigned long long& wal_seq);
+  bool finishBatch(boost::shared_ptr<logentry_vector_t> messages,
+                   bool success, unsigned long long wal_seq);
+  void startWrite(boost::shared_ptr<logentry_vector_t> messages,
+                  unsigned long long wal_seq);
+  bool finishWrite(bool wait);
+  void requeueFront(boost::shared_ptr<logentry_vector_t> messages);
+  void closeStore();
+  bool runOnce();
+  void waitForWork();
+  unsigned long long nextDeadline();
+  void drainRing();
+  void incCounter(CategoryTable::counter_t counter, unsigned long amount);
+  void signalHasWork();
 
   // implementation of queues and thread
   enum store_command_t {
@@ -91,6 +135,41 @@ class StoreQueue {
   boost::shared_ptr<logentry_vector_t> msgQueue;
   boost::shared_ptr<logentry_vector_t> failedMessages;
   unsigned long long msgQueueSize;   // in bytes
+  static unsigned long long totalQueueSize; // in bytes, see getTotalSize()
+
+  // When ring_queue is configured, producers push into msgRing without
+  // taking msgMutex and only touch hasWorkMutex to wake an idle store
+  // thread. The store thread moves entries from msgRing to msgQueue, as
+  // does a producer that finds the ring full.
+  // msgQueueSize is then updated atomically and also counts the bytes
+  // still sitting in the ring.
+  typedef MpscRing<logentry_ptr_t> msg_ring_t;
+  boost::shared_ptr<msg_ring_t> msgRing;
+  unsigned long long ringDrainedSize; // bytes moved to msgQueue, under msgMutex
+  int storeThreadIdle;                // set while store thread waits for work
+
+  // With max_queue_memory set, messages that would take msgQueue over
+  // that size go to overflow on disk instead. Once spilling, all new
+  // messages go there until the store thread has read it all back, so
+  // they are still handed to the store in order. Guarded by msgMutex.
+  // Producers spill in the locked path, otherwise whoever drains msgRing
+  // spills.
+  boost::shared_ptr<OverflowQueue> overflow;
+  bool spilling;
+  // Drained from msgRing but failed to spill while spilling. Producers
+  // have been answered already, so these wait for the spilled messages
+  // to be read back rather than overtake them.
+  logentry_vector_t unspilled;
+  unsigned long long unspilledSize;
+  bool overflowPending; // spilled messages to read back, store thread only
+
+  // With wal_path set every message is written to wal under msgMutex, so
+  // sequence numbers follow msgQueue order, and synced before addMessages
+  // returns. Batches are released once the store has handled them.
+  // Always uses the locked msgQueue and never spills.
+  boost::shared_ptr<WriteAheadLog> wal;
+  unsigned long long walQueuedSeq; // last in msgQueue, guarded by msgMutex
+  unsigned long long failedWalSeq; // last in failedMessages, store thread only
   pthread_t storeThread;
 
   // Mutexes
@@ -103,16 +182,56 @@ class StoreQueue {
   bool hasWork;  // whether there are messages or commands queued
   pthread_cond_t hasWorkCond; // cond variable to wait on for hasWork
 
+  // With pipeline=yes writerThread runs handleMessages() and flush() on
+  // inFlight while the store thread gets the next batch ready. The store
+  // thread waits for inFlight before it takes another batch, runs
+  // commands or periodicCheck(), and does all the accounting, so batches
+  // are still committed one at a time and in order.
+  pthread_t writerThread;
+  pthread_mutex_t writerMutex; // Must be held to read/modify the fields below
+  pthread_cond_t writerCond;   // signaled when any of them change
+  bool writerRunning;
+  bool writerStop;
+  boost::shared_ptr<logentry_vector_t> inFlight;
+  unsigned long long inFlightWalSeq;
+  bool inFlightDone;
+  bool inFlightSuccess;
+
   bool stopping;
   bool isModel;
   bool multiCategory; // Whether multiple categories are handled
 
   // configuration
   std::string        categoryHandled;  // what category this store is handling
-  time_t             checkPeriod;      // how often to call periodicCheck in seconds
+  unsigned           storeIndex;       // of the <store> in the config, it
+                                       // tells apart write-ahead logs and
+                                       // overflow segments of stores that
+                                       // handle the same category
+  category_id_t      categoryId;       // NO_CATEGORY_ID for model stores
+  unsigned long long checkPeriodMs;    // how often to call periodicCheck
   unsigned long long targetWriteSize;  // in bytes
-  time_t             maxWriteInterval; // in seconds
+  unsigned long long maxWriteIntervalMs;
   bool               mustSucceed;      // Always retry even if secondary fails
+  bool               pipelined;        // write batches from writerThread
+  unsigned long      ringQueueSize;    // 0 to use the locked msgQueue
+  unsigned long long maxQueueMemory;   // in bytes, 0 for no limit
+  std::string        overflowPath;     // directory for overflow segments
+  unsigned long long overflowSegmentSize;
+  std::string        walPath;          // directory for write-ahead logs
+  unsigned long long walSegmentSize;
+
+  // Set if the queue runs on a StoreScheduler instead of storeThread.
+  // hasWorkCond is then only used to wait for finished.
+  boost::shared_ptr<StoreScheduler> scheduler;
+  bool scheduled; // queued or running on scheduler, under hasWorkMutex
+  bool finishing; // ignoring wakeups, under hasWorkMutex
+  bool finished;  // store closed after stop, under hasWorkMutex
+
+  // state of the store loop, only used by whoever runs it
+  // in msec of scribe::clock::monotonicNowInMsec()
+  unsigned long long lastPeriodicCheck;
+  unsigned long long lastHandleMessages;
+  bool stopReceived;
 
   // Store that will handle messages. This can contain other stores.
   boost::shared_ptr<Store> store;
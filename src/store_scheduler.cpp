@@ -0,0 +1,263 @@
+#include "common.h"
+#include "scribe_server.h"
+#include "store_scheduler.h"
+
+#include <time.h>
+
+using namespace std;
+
+boost::shared_ptr<StoreScheduler> g_storeScheduler;
+
+// which worker of which scheduler the calling thread is, if any
+static __thread StoreScheduler* current_scheduler = NULL;
+static __thread unsigned long current_worker = 0;
+
+struct WorkerStart {
+  StoreScheduler* scheduler;
+  unsigned long index;
+};
+
+static void* workerStatic(void* arg) {
+  WorkerStart* start = (WorkerStart*)arg;
+  StoreScheduler* scheduler = start->scheduler;
+  unsigned long index = start->index;
+  delete start;
+
+  current_scheduler = scheduler;
+  current_worker = index;
+  scheduler->workerMember(index);
+  return NULL;
+}
+
+static void* timerStatic(void* this_ptr) {
+  StoreScheduler* scheduler = (StoreScheduler*)this_ptr;
+  scheduler->timerMember();
+  return NULL;
+}
+
+StoreScheduler::StoreScheduler(unsigned long num_threads)
+  : nextWorker(0),
+    pendingTasks(0),
+    idleWorkers(0),
+    running(false),
+    stopping(false) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    Worker* worker = new Worker;
+    worker->scheduler = this;
+    worker->index = i;
+    pthread_mutex_init(&worker->mutex, NULL);
+    workers.push_back(worker);
+  }
+  pthread_mutex_init(&idleMutex, NULL);
+  pthread_cond_init(&idleCond, NULL);
+
+  // timer deadlines are in CLOCK_MONOTONIC, so wait on that clock too
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timerCond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&timerMutex, NULL);
+  pthread_mutex_init(&fireMutex, NULL);
+}
+
+StoreScheduler::~StoreScheduler() {
+  stop();
+  for (vector<Worker*>::iterator iter = workers.begin();
+       iter != workers.end(); ++iter) {
+    pthread_mutex_destroy(&(*iter)->mutex);
+    delete *iter;
+  }
+  pthread_mutex_destroy(&idleMutex);
+  pthread_cond_destroy(&idleCond);
+  pthread_mutex_destroy(&timerMutex);
+  pthread_cond_destroy(&timerCond);
+  pthread_mutex_destroy(&fireMutex);
+}
+
+void StoreScheduler::start() {
+  if (running) {
+    return;
+  }
+  running = true;
+  stopping = false;
+
+  for (unsigned long i = 0; i < workers.size(); ++i) {
+    WorkerStart* start = new WorkerStart;
+    start->scheduler = this;
+    start->index = i;
+    pthread_create(&workers[i]->thread, NULL, workerStatic, (void*) start);
+  }
+  pthread_create(&timerThread, NULL, timerStatic, (void*) this);
+  LOG_OPER("Started store thread pool with %lu threads", workers.size());
+}
+
+void StoreScheduler::stop() {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&idleMutex);
+  pthread_mutex_lock(&timerMutex);
+  stopping = true;
+  pthread_cond_broadcast(&idleCond);
+  pthread_cond_signal(&timerCond);
+  pthread_mutex_unlock(&timerMutex);
+  pthread_mutex_unlock(&idleMutex);
+
+  for (unsigned long i = 0; i < workers.size(); ++i) {
+    pthread_join(workers[i]->thread, NULL);
+  }
+  pthread_join(timerThread, NULL);
+  running = false;
+}
+
+void StoreScheduler::schedule(StoreQueue* queue) {
+  Worker* worker;
+  if (current_scheduler == this) {
+    worker = workers[current_worker];
+  } else {
+    unsigned long next = __atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED);
+    worker = workers[next % workers.size()];
+  }
+
+  pthread_mutex_lock(&worker->mutex);
+  worker->runQueue.push_back(queue);
+  pthread_mutex_unlock(&worker->mutex);
+
+  // Workers bump idleWorkers before they look at pendingTasks, so either
+  // they see this task or we see them waiting.
+  __atomic_add_fetch(&pendingTasks, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idleMutex);
+    pthread_cond_signal(&idleCond);
+    pthread_mutex_unlock(&idleMutex);
+  }
+}
+
+void StoreScheduler::scheduleAfter(StoreQueue* queue, unsigned long delay_ms) {
+  unsigned long long deadline = scribe::clock::monotonicNowInMsec() + delay_ms;
+
+  pthread_mutex_lock(&timerMutex);
+  map<StoreQueue*, unsigned long long>::iterator iter =
+    timerDeadlines.find(queue);
+  if (iter != timerDeadlines.end()) {
+    timers.erase(make_pair(iter->second, queue));
+    iter->second = deadline;
+  } else {
+    timerDeadlines[queue] = deadline;
+  }
+  timers.insert(make_pair(deadline, queue));
+
+  // wake up the timer thread if this is now the first timer to fire
+  if (timers.begin()->second == queue) {
+    pthread_cond_signal(&timerCond);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreScheduler::cancel(StoreQueue* queue) {
+  pthread_mutex_lock(&timerMutex);
+  map<StoreQueue*, unsigned long long>::iterator iter =
+    timerDeadlines.find(queue);
+  if (iter != timerDeadlines.end()) {
+    timers.erase(make_pair(iter->second, queue));
+    timerDeadlines.erase(iter);
+  }
+  pthread_mutex_unlock(&timerMutex);
+
+  // the timer may have just fired, wait until it is done with queue
+  pthread_mutex_lock(&fireMutex);
+  pthread_mutex_unlock(&fireMutex);
+}
+
+// Take the next task from our own run queue, or steal one from the back
+// of someone else's.
+StoreQueue* StoreScheduler::nextTask(unsigned long index) {
+  StoreQueue* queue = NULL;
+  for (unsigned long i = 0; i < workers.size() && queue == NULL; ++i) {
+    Worker* worker = workers[(index + i) % workers.size()];
+    pthread_mutex_lock(&worker->mutex);
+    if (!worker->runQueue.empty()) {
+      if (i == 0) {
+        queue = worker->runQueue.front();
+        worker->runQueue.pop_front();
+      } else {
+        queue = worker->runQueue.back();
+        worker->runQueue.pop_back();
+      }
+    }
+    pthread_mutex_unlock(&worker->mutex);
+  }
+
+  if (queue != NULL) {
+    __atomic_sub_fetch(&pendingTasks, 1, __ATOMIC_SEQ_CST);
+  }
+  return queue;
+}
+
+void StoreScheduler::workerMember(unsigned long index) {
+  for (;;) {
+    StoreQueue* queue = nextTask(index);
+    if (queue != NULL) {
+      queue->runScheduled();
+      continue;
+    }
+
+    pthread_mutex_lock(&idleMutex);
+    __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while (!stopping && __atomic_load_n(&pendingTasks, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&idleCond, &idleMutex);
+    }
+    __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    bool stop = stopping;
+    pthread_mutex_unlock(&idleMutex);
+
+    if (stop) {
+      return;
+    }
+  }
+}
+
+void StoreScheduler::timerMember() {
+  vector<StoreQueue*> due;
+
+  pthread_mutex_lock(&timerMutex);
+  while (!stopping) {
+    unsigned long long now = scribe::clock::monotonicNowInMsec();
+    while (!timers.empty() && timers.begin()->first <= now) {
+      StoreQueue* queue = timers.begin()->second;
+      timers.erase(timers.begin());
+      timerDeadlines.erase(queue);
+      due.push_back(queue);
+    }
+
+    if (!due.empty()) {
+      // don't hold timerMutex while waking up queues, since they call
+      // scheduleAfter() while holding their own locks
+      pthread_mutex_lock(&fireMutex);
+      pthread_mutex_unlock(&timerMutex);
+      for (vector<StoreQueue*>::iterator iter = due.begin();
+           iter != due.end(); ++iter) {
+        (*iter)->wakeUp();
+      }
+      due.clear();
+      pthread_mutex_unlock(&fireMutex);
+      pthread_mutex_lock(&timerMutex);
+      continue;
+    }
+
+    if (timers.empty()) {
+      pthread_cond_wait(&timerCond, &timerMutex);
+    } else {
+      struct timespec abs_timeout;
+      abs_timeout.tv_sec = timers.begin()->first / 1000;
+      abs_timeout.tv_nsec = (timers.begin()->first % 1000) * 1000000;
+      pthread_cond_timedwait(&timerCond, &timerMutex, &abs_timeout);
+    }
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
@@ -0,0 +1,86 @@
+#ifndef SCRIBE_STORE_SCHEDULER_H
+#define SCRIBE_STORE_SCHEDULER_H
+
+#include "common.h"
+
+#include <deque>
+
+class StoreQueue;
+
+/*
+ * Fixed-size pool of threads that runs StoreQueues instead of giving each
+ * queue a thread of its own (see store_thread_pool in scribe.conf).
+ *
+ * Every worker has its own run queue. Queues scheduled from a worker go
+ * on that worker's run queue, everything else is spread round-robin, and
+ * a worker that runs out of work steals from the others. A single timer
+ * thread keeps each StoreQueue's next deadline, ordered in a set since
+ * deadlines vary widely between stores, and wakes the queue up when the
+ * deadline passes.
+ *
+ * The scheduler does not make sure a StoreQueue only runs on one worker at
+ * a time, StoreQueue does that by only calling schedule() when it is not
+ * already scheduled or running.
+ */
+class StoreScheduler {
+ public:
+  explicit StoreScheduler(unsigned long num_threads);
+  ~StoreScheduler();
+
+  void start();
+  void stop(); // all queues must have finished before this is called
+
+  // run queue->runScheduled() on some worker as soon as possible
+  void schedule(StoreQueue* queue);
+  // schedule queue once delay_ms has passed, replaces any earlier timer
+  void scheduleAfter(StoreQueue* queue, unsigned long delay_ms);
+  // forget the timer for queue, if any. Once this returns the timer
+  // thread will not touch queue again.
+  void cancel(StoreQueue* queue);
+
+  unsigned long getNumThreads() const { return workers.size(); }
+
+  // these need to be public for the thread creation to get to them,
+  // but no one else should ever call them.
+  void workerMember(unsigned long index);
+  void timerMember();
+
+ private:
+  struct Worker {
+    StoreScheduler* scheduler;
+    unsigned long index;
+    pthread_t thread;
+    pthread_mutex_t mutex;  // Must be held to read/modify runQueue
+    std::deque<StoreQueue*> runQueue;
+  };
+
+  StoreQueue* nextTask(unsigned long index);
+
+  std::vector<Worker*> workers;
+  unsigned long nextWorker;          // for round-robin placement
+  unsigned long pendingTasks;        // queued on any runQueue
+  unsigned long idleWorkers;         // waiting on idleCond
+  pthread_mutex_t idleMutex;
+  pthread_cond_t idleCond;           // signaled when work is added
+
+  // timers, ordered by deadline in msec of CLOCK_MONOTONIC
+  typedef std::set<std::pair<unsigned long long, StoreQueue*> > timer_set_t;
+  timer_set_t timers;
+  std::map<StoreQueue*, unsigned long long> timerDeadlines;
+  pthread_t timerThread;
+  pthread_mutex_t timerMutex;        // Must be held to read/modify timers
+  pthread_cond_t timerCond;          // signaled when the first timer changes
+  pthread_mutex_t fireMutex;         // held while waking up due queues
+
+  bool running;
+  bool stopping;
+
+  // disallow copy and assignment
+  StoreScheduler(const StoreScheduler& rhs);
+  StoreScheduler& operator=(const StoreScheduler& rhs);
+};
+
+// NULL unless store_thread_pool is enabled
+extern boost::shared_ptr<StoreScheduler> g_storeScheduler;
+
+#endif // !defined SCRIBE_STORE_SCHEDULER_H
@@ -0,0 +1,62 @@
+#ifndef SCRIBE_TEST_UTIL_H
+#define SCRIBE_TEST_UTIL_H
+
+#include "common.h"
+
+#include <stdlib.h>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+/*
+ * Helpers shared by the unit tests that work with files on disk.
+ */
+
+// Gives every test a new scratch directory in path and removes it after.
+class TempDirTestCase : public CppUnit::TestCase {
+protected:
+    std::string path;
+
+    void setUp() {
+        char dir[] = "/tmp/scribe_test.XXXXXX";
+        CPPUNIT_ASSERT(mkdtemp(dir) != NULL);
+        path = dir;
+    }
+
+    void tearDown() {
+        boost::filesystem::remove_all(path);
+    }
+};
+
+inline std::string makeMessage(int i) {
+    std::ostringstream message;
+    message << "message " << i;
+    return message.str();
+}
+
+inline logentry_ptr_t makeEntry(const std::string& category,
+                                const std::string& message) {
+    logentry_ptr_t entry(new scribe::thrift::LogEntry);
+    entry->category = category;
+    entry->message = message;
+    return entry;
+}
+
+// count entries numbered from first, alternating between two categories
+inline logentry_vector_t makeEntries(int first, int count) {
+    logentry_vector_t entries;
+    for (int i = first; i < first + count; ++i) {
+        entries.push_back(makeEntry(i % 2 ? "odd" : "even", makeMessage(i)));
+    }
+    return entries;
+}
+
+inline void assertEntries(const logentry_vector_t& expected,
+                          const logentry_vector_t& actual) {
+    CPPUNIT_ASSERT_EQUAL(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CPPUNIT_ASSERT_EQUAL(expected[i]->category, actual[i]->category);
+        CPPUNIT_ASSERT_EQUAL(expected[i]->message, actual[i]->message);
+    }
+}
+
+#endif // !defined SCRIBE_TEST_UTIL_H
@@ -0,0 +1,103 @@
+#include "token_bucket.h"
+
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000LL
+
+TokenBucket::TokenBucket(double rate_, double burst_)
+  : rate(rate_),
+    burst(burst_),
+    fullTime(0) {
+  if (rate <= 0) {
+    rate = 1;
+  }
+  if (burst < 1) {
+    burst = 1;
+  }
+}
+
+int64_t TokenBucket::nowInNsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+int64_t TokenBucket::costInNsec(double amount) const {
+  return (int64_t)(amount * NSEC_PER_SEC / getRate());
+}
+
+double TokenBucket::getRate() const {
+  double result;
+  __atomic_load(&rate, &result, __ATOMIC_RELAXED);
+  return result;
+}
+
+void TokenBucket::setRate(double new_rate) {
+  if (new_rate <= 0) {
+    new_rate = 1;
+  }
+  double old_rate;
+  __atomic_exchange(&rate, &new_rate, &old_rate, __ATOMIC_RELAXED);
+
+  // The tokens taken stay taken, it is only the time it takes to get them
+  // back that changes.
+  int64_t now = nowInNsec();
+  int64_t old_full = __atomic_load_n(&fullTime, __ATOMIC_RELAXED);
+  for (;;) {
+    if (old_full <= now) {
+      return;
+    }
+    int64_t new_full = now +
+      (int64_t)((double)(old_full - now) * old_rate / new_rate);
+    if (__atomic_compare_exchange_n(&fullTime, &old_full, new_full, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+bool TokenBucket::tryConsume(double amount) {
+  int64_t now = nowInNsec();
+  int64_t cost = costInNsec(amount);
+  int64_t tolerance = costInNsec(burst);
+
+  int64_t old_full = __atomic_load_n(&fullTime, __ATOMIC_RELAXED);
+  for (;;) {
+    bool full = old_full <= now;
+    int64_t start = full ? now : old_full;
+    if (!full && start + cost - now > tolerance) {
+      return false;
+    }
+    if (__atomic_compare_exchange_n(&fullTime, &old_full, start + cost, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return true;
+    }
+    // old_full was reloaded by the failed compare-and-swap
+  }
+}
+
+void TokenBucket::giveBack(double amount) {
+  // Going back past now just means the bucket is full, see tryConsume()
+  __atomic_sub_fetch(&fullTime, costInNsec(amount), __ATOMIC_RELAXED);
+}
+
+void TokenBucket::consume(double amount) {
+  int64_t now = nowInNsec();
+  int64_t cost = costInNsec(amount);
+
+  int64_t old_full = __atomic_load_n(&fullTime, __ATOMIC_RELAXED);
+  for (;;) {
+    int64_t start = old_full <= now ? now : old_full;
+    if (__atomic_compare_exchange_n(&fullTime, &old_full, start + cost, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+double TokenBucket::secondsUntilAvailable() const {
+  // in debt once the bucket is more than burst tokens away from full
+  int64_t debt = __atomic_load_n(&fullTime, __ATOMIC_RELAXED) -
+    nowInNsec() - costInNsec(burst);
+  return debt > 0 ? (double)debt / NSEC_PER_SEC : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef SCRIBE_TOKEN_BUCKET_H
+#define SCRIBE_TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+/*
+ * Token bucket rate limiter that can be shared between threads without
+ * locking.
+ *
+ * Tokens are added at rate per second, up to burst tokens. Instead of a
+ * token count and a last refill time the bucket keeps a single
+ * "theoretical arrival time": the moment the bucket would be full again.
+ * Consuming tokens moves it forward and giving them back moves it back,
+ * each with a single compare-and-swap.
+ *
+ * A request for more than burst tokens is allowed when the bucket is
+ * full, and it leaves the bucket in debt. Otherwise it could never pass.
+ * consume() goes into debt unconditionally, for callers that only know
+ * the cost once the work is done.
+ *
+ * The rate can be changed while the bucket is in use, see setRate().
+ */
+class TokenBucket {
+ public:
+  TokenBucket(double rate, double burst);
+
+  // Takes amount tokens and returns true if they were available
+  bool tryConsume(double amount);
+  // Returns tokens taken by a successful tryConsume()
+  void giveBack(double amount);
+  // Takes amount tokens whether or not they are available
+  void consume(double amount);
+  // Seconds until the bucket is out of debt, 0 if it isn't in debt
+  double secondsUntilAvailable() const;
+
+  double getRate() const;
+  // Tokens taken are kept as they were, including any debt
+  void setRate(double new_rate);
+  double getBurst() const { return burst; }
+
+ private:
+  static int64_t nowInNsec();
+  int64_t costInNsec(double amount) const;
+
+  double rate;      // tokens per second
+  double burst;     // bucket size in tokens
+  int64_t fullTime; // CLOCK_MONOTONIC time in nsec when bucket is full
+
+  // disallow copy and assignment
+  TokenBucket(const TokenBucket& rhs);
+  TokenBucket& operator=(const TokenBucket& rhs);
+};
+
+#endif // !defined SCRIBE_TOKEN_BUCKET_H
@@ -0,0 +1,96 @@
+#include "token_bucket.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+// The tests run far faster than the rates below refill the bucket, so
+// time passing only shows up as a small error in the waits.
+#define WAIT_ERROR 0.05
+
+class TokenBucketTest : public CppUnit::TestCase {
+public:
+    CPPUNIT_TEST_SUITE(TokenBucketTest);
+    CPPUNIT_TEST(testBurst);
+    CPPUNIT_TEST(testGiveBack);
+    CPPUNIT_TEST(testDebt);
+    CPPUNIT_TEST(testSetRateKeepsDebt);
+    CPPUNIT_TEST(testSetRateWhenFull);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testBurst() {
+        TokenBucket bucket(1, 10);
+        for (int i = 0; i < 10; ++i) {
+            CPPUNIT_ASSERT(bucket.tryConsume(1));
+        }
+        CPPUNIT_ASSERT(!bucket.tryConsume(1));
+        CPPUNIT_ASSERT_EQUAL(0.0, bucket.secondsUntilAvailable());
+    }
+
+    void testGiveBack() {
+        TokenBucket bucket(1, 10);
+        CPPUNIT_ASSERT(bucket.tryConsume(10));
+        CPPUNIT_ASSERT(!bucket.tryConsume(5));
+        bucket.giveBack(5);
+        CPPUNIT_ASSERT(bucket.tryConsume(5));
+        CPPUNIT_ASSERT(!bucket.tryConsume(1));
+    }
+
+    void testDebt() {
+        // more than burst passes on a full bucket, and leaves it in debt
+        TokenBucket bucket(10, 10);
+        CPPUNIT_ASSERT(bucket.tryConsume(30));
+        CPPUNIT_ASSERT(!bucket.tryConsume(1));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+
+        bucket.consume(10);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(3.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+    }
+
+    void testSetRateKeepsDebt() {
+        // 20 tokens of debt take twice as long at half the rate
+        TokenBucket bucket(10, 10);
+        bucket.consume(30);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+
+        bucket.setRate(5);
+        CPPUNIT_ASSERT_EQUAL(5.0, bucket.getRate());
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(4.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+
+        bucket.setRate(2.5);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(8.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+
+        bucket.setRate(20);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, bucket.secondsUntilAvailable(),
+                                     WAIT_ERROR);
+    }
+
+    void testSetRateWhenFull() {
+        TokenBucket bucket(10, 10);
+        bucket.setRate(1);
+        CPPUNIT_ASSERT_EQUAL(0.0, bucket.secondsUntilAvailable());
+        CPPUNIT_ASSERT(bucket.tryConsume(10));
+        CPPUNIT_ASSERT(!bucket.tryConsume(1));
+
+        // a rate that isn't positive is taken as 1
+        bucket.setRate(0);
+        CPPUNIT_ASSERT_EQUAL(1.0, bucket.getRate());
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(TokenBucketTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}
@@ -0,0 +1,369 @@
+#include "write_ahead_log.h"
+#include "file.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+
+using namespace std;
+using namespace scribe::thrift;
+
+// frame length, then sequence number and category length
+#define FRAME_HEADER_SIZE 4
+#define RECORD_HEADER_SIZE 12
+#define MAX_RECORD_SIZE 0x7fffffff
+
+static void putUInt(string& buffer, unsigned long long value, int bytes) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    buffer.push_back((char)((value >> (i * 8)) & 0xff));
+  }
+}
+
+static unsigned long long getUInt(const char* buffer, int bytes) {
+  unsigned long long value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value = (value << 8) | (unsigned char)buffer[i];
+  }
+  return value;
+}
+
+static bool writeAll(int fd, const string& data) {
+  const char* pos = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    ssize_t written = ::write(fd, pos, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    pos += written;
+    left -= written;
+  }
+  return true;
+}
+
+WriteAheadLog::WriteAheadLog(const string& path_, const string& base_name,
+                             unsigned long long segment_size)
+  : path(path_),
+    baseName(base_name),
+    segmentSize(segment_size),
+    fd(-1),
+    writeNumber(0),
+    writeBytes(0),
+    writeLastSeq(0),
+    nextNumber(0),
+    nextSeq(1),
+    writtenSeq(0),
+    syncedSeq(0),
+    releasedSeq(0),
+    syncing(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&syncCond, NULL);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  pthread_mutex_lock(&mutex);
+  closeSegment();
+  pthread_mutex_unlock(&mutex);
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&syncCond);
+}
+
+string WriteAheadLog::segmentName(unsigned long number) const {
+  ostringstream name;
+  name << path << '/' << baseName << "_wal_"
+       << setw(5) << setfill('0') << number;
+  return name.str();
+}
+
+string WriteAheadLog::releasedName() const {
+  return path + '/' + baseName + "_wal_released";
+}
+
+vector<string> WriteAheadLog::listLogs(const string& path) {
+  set<string> names;
+  vector<string> files = FileInterface::list(path, "std");
+  for (vector<string>::iterator iter = files.begin();
+       iter != files.end(); ++iter) {
+    string::size_type pos = iter->rfind("_wal_");
+    if (pos == string::npos || pos == 0 || pos + 5 == iter->size() ||
+        iter->find_first_not_of("0123456789", pos + 5) != string::npos) {
+      continue;
+    }
+    names.insert(iter->substr(0, pos));
+  }
+  return vector<string>(names.begin(), names.end());
+}
+
+unsigned long long WriteAheadLog::recover(logentry_vector_t& entries) {
+  pthread_mutex_lock(&mutex);
+
+  ifstream released_file(releasedName().c_str());
+  if (released_file.good()) {
+    released_file >> releasedSeq;
+  }
+
+  string prefix = baseName + "_wal_";
+  vector<unsigned long> numbers;
+  vector<string> files = FileInterface::list(path, "std");
+  for (vector<string>::iterator iter = files.begin();
+       iter != files.end(); ++iter) {
+    if (iter->compare(0, prefix.size(), prefix) != 0 ||
+        iter->size() == prefix.size() ||
+        iter->find_first_not_of("0123456789", prefix.size()) != string::npos) {
+      continue;
+    }
+    numbers.push_back(strtoul(iter->c_str() + prefix.size(), NULL, 10));
+  }
+  sort(numbers.begin(), numbers.end());
+
+  size_t before = entries.size();
+  for (vector<unsigned long>::iterator iter = numbers.begin();
+       iter != numbers.end(); ++iter) {
+    Segment segment;
+    segment.number = *iter;
+    segment.lastSeq = readSegment(*iter, releasedSeq, entries);
+    segments.push_back(segment);
+    nextNumber = *iter + 1;
+    nextSeq = max(nextSeq, segment.lastSeq + 1);
+  }
+  nextSeq = max(nextSeq, releasedSeq + 1);
+  writtenSeq = syncedSeq = nextSeq - 1;
+
+  if (entries.size() > before) {
+    LOG_OPER("[%s] recovered %lu unreleased messages from write-ahead log",
+             baseName.c_str(), (unsigned long)(entries.size() - before));
+  }
+
+  unsigned long long last = writtenSeq;
+  pthread_mutex_unlock(&mutex);
+  return last;
+}
+
+// Appends the messages after released in segment number to entries and
+// returns the last sequence number in it. Stops at the first incomplete
+// record, which is what a crash in the middle of a write leaves behind.
+unsigned long long WriteAheadLog::readSegment(unsigned long number,
+                                              unsigned long long released,
+                                              logentry_vector_t& entries) {
+  unsigned long long last_seq = 0;
+  FILE* file = fopen(segmentName(number).c_str(), "r");
+  if (file == NULL) {
+    LOG_OPER("[%s] failed to open write-ahead log <%s>",
+             baseName.c_str(), segmentName(number).c_str());
+    return last_seq;
+  }
+
+  vector<char> buffer;
+  for (;;) {
+    char frame[FRAME_HEADER_SIZE];
+    if (fread(frame, 1, FRAME_HEADER_SIZE, file) != FRAME_HEADER_SIZE) {
+      break;
+    }
+    unsigned long long size = getUInt(frame, FRAME_HEADER_SIZE);
+    if (size < RECORD_HEADER_SIZE || size > MAX_RECORD_SIZE) {
+      LOG_OPER("[%s] corrupt record in write-ahead log <%s>, ignoring the rest",
+               baseName.c_str(), segmentName(number).c_str());
+      break;
+    }
+    buffer.resize(size);
+    if (fread(&buffer[0], 1, size, file) != size) {
+      LOG_OPER("[%s] incomplete record at the end of write-ahead log <%s>",
+               baseName.c_str(), segmentName(number).c_str());
+      break;
+    }
+
+    unsigned long long seq = getUInt(&buffer[0], 8);
+    unsigned long long category_length = getUInt(&buffer[8], 4);
+    if (category_length > size - RECORD_HEADER_SIZE) {
+      LOG_OPER("[%s] corrupt record in write-ahead log <%s>, ignoring the rest",
+               baseName.c_str(), segmentName(number).c_str());
+      break;
+    }
+    last_seq = seq;
+    if (seq <= released) {
+      continue;
+    }
+
+    logentry_ptr_t entry(new LogEntry);
+    entry->category.assign(&buffer[RECORD_HEADER_SIZE], category_length);
+    entry->message.assign(&buffer[RECORD_HEADER_SIZE + category_length],
+                          size - RECORD_HEADER_SIZE - category_length);
+    entries.push_back(entry);
+  }
+
+  fclose(file);
+  return last_seq;
+}
+
+unsigned long long WriteAheadLog::write(const logentry_vector_t& entries) {
+  if (entries.empty()) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&mutex);
+  if (fd < 0 && !openSegment()) {
+    pthread_mutex_unlock(&mutex);
+    return 0;
+  }
+
+  unsigned long long seq = nextSeq;
+  string data;
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end(); ++iter, ++seq) {
+    putUInt(data, RECORD_HEADER_SIZE + (*iter)->category.size() +
+            (*iter)->message.size(), FRAME_HEADER_SIZE);
+    putUInt(data, seq, 8);
+    putUInt(data, (*iter)->category.size(), 4);
+    data.append((*iter)->category);
+    data.append((*iter)->message);
+  }
+
+  if (!writeAll(fd, data)) {
+    // Cut off whatever part of the batch got written, since the caller
+    // treats all of it as not logged, and start over in a new segment.
+    // The batch's sequence numbers are skipped either way, so records
+    // that could not be cut off are never numbered twice.
+    LOG_OPER("[%s] failed to write to write-ahead log <%s>: %s",
+             baseName.c_str(), segmentName(writeNumber).c_str(),
+             strerror(errno));
+    if (ftruncate(fd, writeBytes) != 0) {
+      LOG_OPER("[%s] ERROR: failed to truncate write-ahead log <%s>, messages "
+               "of a failed write may be recovered: %s",
+               baseName.c_str(), segmentName(writeNumber).c_str(),
+               strerror(errno));
+      writeLastSeq = seq - 1;
+      writeBytes = max(writeBytes, 1ULL);
+    }
+    nextSeq = seq;
+    closeSegment();
+    pthread_mutex_unlock(&mutex);
+    return 0;
+  }
+
+  nextSeq = seq;
+  writtenSeq = writeLastSeq = seq - 1;
+  writeBytes += data.size();
+  if (writeBytes >= segmentSize) {
+    closeSegment();
+  }
+
+  pthread_mutex_unlock(&mutex);
+  return seq - 1;
+}
+
+bool WriteAheadLog::sync(unsigned long long seq) {
+  bool success = true;
+
+  pthread_mutex_lock(&mutex);
+  while (syncedSeq < seq) {
+    if (syncing) {
+      pthread_cond_wait(&syncCond, &mutex);
+      continue;
+    }
+    if (fd < 0) {
+      // closeSegment() syncs, so only a failed sync gets here
+      success = false;
+      break;
+    }
+
+    // sync everything written so far on behalf of everyone waiting
+    syncing = true;
+    unsigned long long target = writtenSeq;
+    int sync_fd = fd;
+    pthread_mutex_unlock(&mutex);
+    int result = fdatasync(sync_fd);
+    pthread_mutex_lock(&mutex);
+    syncing = false;
+    pthread_cond_broadcast(&syncCond);
+
+    if (result != 0) {
+      LOG_OPER("[%s] failed to sync write-ahead log <%s>: %s",
+               baseName.c_str(), segmentName(writeNumber).c_str(),
+               strerror(errno));
+      success = false;
+      break;
+    }
+    syncedSeq = max(syncedSeq, target);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  return success;
+}
+
+// Only the store thread releases, so the released file is written
+// without holding mutex and writers don't wait for it to be synced. It is
+// on disk before the segments it covers are deleted.
+void WriteAheadLog::release(unsigned long long seq) {
+  pthread_mutex_lock(&mutex);
+  if (seq <= releasedSeq) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  releasedSeq = seq;
+  pthread_mutex_unlock(&mutex);
+
+  ostringstream released;
+  released << seq << endl;
+  if (!FileInterface::replaceLocalFile(releasedName(), released.str())) {
+    LOG_OPER("[%s] failed to record released sequence number in <%s>",
+             baseName.c_str(), releasedName().c_str());
+  }
+
+  pthread_mutex_lock(&mutex);
+  while (!segments.empty() && segments.front().lastSeq <= seq) {
+    unlink(segmentName(segments.front().number).c_str());
+    segments.pop_front();
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool WriteAheadLog::openSegment() {
+  try {
+    boost::filesystem::create_directories(path);
+  } catch(const std::exception& e) {
+    LOG_OPER("[%s] exception <%s> creating write-ahead log directory <%s>",
+             baseName.c_str(), e.what(), path.c_str());
+    return false;
+  }
+
+  writeNumber = nextNumber++;
+  fd = open(segmentName(writeNumber).c_str(),
+            O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG_OPER("[%s] failed to open write-ahead log <%s>: %s",
+             baseName.c_str(), segmentName(writeNumber).c_str(),
+             strerror(errno));
+    return false;
+  }
+  writeBytes = 0;
+  writeLastSeq = 0;
+  return true;
+}
+
+// Syncs and closes the segment being written. Must hold mutex.
+void WriteAheadLog::closeSegment() {
+  if (fd < 0) {
+    return;
+  }
+  while (syncing) {
+    pthread_cond_wait(&syncCond, &mutex);
+  }
+
+  if (fdatasync(fd) == 0) {
+    syncedSeq = writtenSeq;
+  }
+  ::close(fd);
+  fd = -1;
+
+  if (writeBytes > 0) {
+    Segment segment;
+    segment.number = writeNumber;
+    segment.lastSeq = writeLastSeq;
+    segments.push_back(segment);
+  } else {
+    unlink(segmentName(writeNumber).c_str());
+  }
+  writeBytes = 0;
+}
@@ -0,0 +1,81 @@
+#ifndef SCRIBE_WRITE_AHEAD_LOG_H
+#define SCRIBE_WRITE_AHEAD_LOG_H
+
+#include "common.h"
+
+/*
+ * Write-ahead log of the messages held in memory by a StoreQueue.
+ *
+ * Every message gets a sequence number and is appended to numbered
+ * segment files named <base name>_wal_<number>, as frames of
+ * <length><sequence number><category length><category><message>. Callers
+ * first write() a batch, which only costs a write(2), and then sync() it.
+ * Threads that sync() at the same time share one fdatasync, the first one
+ * in does it for everyone written so far.
+ *
+ * Once the store has written everything up to some sequence number it is
+ * release()d. Segments whose messages are all released are deleted, and
+ * the released sequence number is kept in <base name>_wal_released so
+ * recover() does not return those messages again after a restart.
+ */
+class WriteAheadLog {
+ public:
+  WriteAheadLog(const std::string& path, const std::string& base_name,
+                unsigned long long segment_size);
+  ~WriteAheadLog();
+
+  // Appends the messages that were logged by an earlier run but never
+  // released to entries. Returns the sequence number of the last message
+  // logged so far. Must be called once, before anything else.
+  unsigned long long recover(logentry_vector_t& entries);
+
+  // Returns the sequence number of the last entry, or 0 on failure
+  unsigned long long write(const logentry_vector_t& entries);
+  // Waits until everything up to seq is on disk
+  bool sync(unsigned long long seq);
+  // Everything up to seq has been handled and can be forgotten
+  void release(unsigned long long seq);
+
+  // base names that have segments in path
+  static std::vector<std::string> listLogs(const std::string& path);
+
+ private:
+  struct Segment {
+    unsigned long number;
+    unsigned long long lastSeq;
+  };
+
+  std::string segmentName(unsigned long number) const;
+  std::string releasedName() const;
+  unsigned long long readSegment(unsigned long number,
+                                 unsigned long long released,
+                                 logentry_vector_t& entries);
+  bool openSegment();
+  void closeSegment();
+
+  std::string path;
+  std::string baseName;
+  unsigned long long segmentSize;
+
+  std::deque<Segment> segments;     // closed segments, oldest first
+  int fd;                           // segment being written, or -1
+  unsigned long writeNumber;
+  unsigned long long writeBytes;
+  unsigned long long writeLastSeq;
+  unsigned long nextNumber;
+
+  unsigned long long nextSeq;
+  unsigned long long writtenSeq;
+  unsigned long long syncedSeq;
+  unsigned long long releasedSeq;
+  bool syncing;                     // someone is in fdatasync
+
+  pthread_mutex_t mutex;            // Must be held to read/modify any of the above
+  pthread_cond_t syncCond;          // signaled when syncing is cleared
+
+  // disallow copy and assignment
+  WriteAheadLog(const WriteAheadLog& rhs);
+  WriteAheadLog& operator=(const WriteAheadLog& rhs);
+};
+
+#endif // !defined SCRIBE_WRITE_AHEAD_LOG_H
@@ -0,0 +1,141 @@
+#include "write_ahead_log.h"
+#include "file.h"
+#include "test_util.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+class WriteAheadLogTest : public TempDirTestCase {
+public:
+    CPPUNIT_TEST_SUITE(WriteAheadLogTest);
+    CPPUNIT_TEST(testRecover);
+    CPPUNIT_TEST(testRelease);
+    CPPUNIT_TEST(testReleaseSegments);
+    CPPUNIT_TEST(testIncompleteRecord);
+    CPPUNIT_TEST(testListLogs);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testRecover() {
+        logentry_vector_t written = makeEntries(0, 10);
+        {
+            WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+            logentry_vector_t recovered;
+            CPPUNIT_ASSERT_EQUAL(0ULL, wal.recover(recovered));
+            CPPUNIT_ASSERT(recovered.empty());
+
+            CPPUNIT_ASSERT_EQUAL(10ULL, wal.write(written));
+            CPPUNIT_ASSERT(wal.sync(10));
+        }
+
+        // sequence numbers carry on after a restart
+        WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+        logentry_vector_t recovered;
+        CPPUNIT_ASSERT_EQUAL(10ULL, wal.recover(recovered));
+        assertEntries(written, recovered);
+        CPPUNIT_ASSERT_EQUAL(11ULL, wal.write(makeEntries(10, 1)));
+    }
+
+    void testRelease() {
+        {
+            WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+            logentry_vector_t recovered;
+            wal.recover(recovered);
+            CPPUNIT_ASSERT_EQUAL(10ULL, wal.write(makeEntries(0, 10)));
+            CPPUNIT_ASSERT(wal.sync(10));
+            wal.release(6);
+            // releasing less than before changes nothing
+            wal.release(3);
+        }
+
+        WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+        logentry_vector_t recovered;
+        CPPUNIT_ASSERT_EQUAL(10ULL, wal.recover(recovered));
+        assertEntries(makeEntries(6, 4), recovered);
+    }
+
+    void testReleaseSegments() {
+        // every write fills a segment, released ones are deleted
+        WriteAheadLog wal(path, "cat.0", 1);
+        logentry_vector_t recovered;
+        wal.recover(recovered);
+        for (int i = 0; i < 5; ++i) {
+            CPPUNIT_ASSERT(wal.write(makeEntries(i * 2, 2)) != 0);
+        }
+        CPPUNIT_ASSERT_EQUAL((size_t)5, countSegments());
+
+        wal.release(5);
+        CPPUNIT_ASSERT_EQUAL((size_t)3, countSegments());
+        wal.release(10);
+        CPPUNIT_ASSERT_EQUAL((size_t)0, countSegments());
+
+        WriteAheadLog restarted(path, "cat.0", 1);
+        CPPUNIT_ASSERT_EQUAL(10ULL, restarted.recover(recovered));
+        CPPUNIT_ASSERT(recovered.empty());
+    }
+
+    void testIncompleteRecord() {
+        {
+            WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+            logentry_vector_t recovered;
+            wal.recover(recovered);
+            CPPUNIT_ASSERT_EQUAL(3ULL, wal.write(makeEntries(0, 3)));
+        }
+
+        // what a crash in the middle of a write leaves behind
+        std::string segment = path + "/cat.0_wal_00000";
+        FILE* file = fopen(segment.c_str(), "a");
+        CPPUNIT_ASSERT(file != NULL);
+        const char partial[] = {0, 0, 1, 0, 'x'};
+        CPPUNIT_ASSERT_EQUAL(sizeof(partial),
+                             fwrite(partial, 1, sizeof(partial), file));
+        fclose(file);
+
+        WriteAheadLog wal(path, "cat.0", 1024 * 1024);
+        logentry_vector_t recovered;
+        CPPUNIT_ASSERT_EQUAL(3ULL, wal.recover(recovered));
+        assertEntries(makeEntries(0, 3), recovered);
+    }
+
+    void testListLogs() {
+        WriteAheadLog first(path, "cat.0", 1);
+        WriteAheadLog second(path, "cat.1", 1);
+        WriteAheadLog other(path, "other_wal.0", 1);
+        logentry_vector_t recovered;
+        first.recover(recovered);
+        second.recover(recovered);
+        other.recover(recovered);
+        CPPUNIT_ASSERT(first.write(makeEntries(0, 1)) != 0);
+        CPPUNIT_ASSERT(second.write(makeEntries(1, 1)) != 0);
+        CPPUNIT_ASSERT(other.write(makeEntries(2, 1)) != 0);
+        first.release(1);
+
+        std::vector<std::string> logs = WriteAheadLog::listLogs(path);
+        CPPUNIT_ASSERT_EQUAL((size_t)2, logs.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("cat.1"), logs[0]);
+        CPPUNIT_ASSERT_EQUAL(std::string("other_wal.0"), logs[1]);
+    }
+
+    size_t countSegments() {
+        size_t count = 0;
+        std::vector<std::string> files = FileInterface::list(path, "std");
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].find("_wal_0") != std::string::npos) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(WriteAheadLogTest);
+
+int main(int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  runner.run();
+  return 0;
+}